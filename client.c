@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
@@ -7,6 +8,9 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <math.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -17,25 +21,42 @@
 #include <arpa/inet.h>
 
 #include <poll.h>
+#include <sys/epoll.h>
 #include <signal.h>
+#include <sys/timerfd.h>
 #include <getopt.h>
 #include <pthread.h>
 #include <pulse/simple.h>
+#include <pulse/pulseaudio.h>
 #include <pulse/error.h>
 
 #include <opus.h>
 #include "proto.h"
+#include "mix.h"
+#include "ring.h"
+#include "latency.h"
+#include "dsp.h"
 
 
 typedef struct {
 	char *host;
 	char *port;
+	uint32_t room;
 	
 	uint32_t sample_rate;  // in Hz
 	uint8_t channel_count;  // 1 or 2
 	uint16_t frame_duration;  // in 0.1 ms units, 25 (2.5ms), 50, 100, 200, 400, 600
+	size_t frames_per_packet;  // Opus frames packed into one DATA packet
 	
 	int input_fd, output_fd;
+	enum { AUDIO_ASYNC, AUDIO_THREADS } audio_backend;  // used when there's no input or output file
+	size_t max_speakers;  // number of preallocated decoders
+	uint32_t max_bitrate;  // in bit/s, the encoder goes below it when receivers report loss
+	bool vad;  // stop sending while the input is below vad_threshold
+	double vad_threshold;  // in dBFS, also the threshold of the noise gate
+	bool dsp;  // run the capture processing (high-pass, AGC, noise gate) before encoding
+	char *bench_pipeline;  // PCM file to run through the codec pipeline, NULL for normal operation
+	bool bench_dsp;  // run the DSP kernel benchmark and exit
 	
 	size_t frame_samples_per_channel;
 	size_t frame_size;  // in bytes
@@ -44,6 +65,7 @@ typedef struct {
 options_t opts;
 
 void parse_options(int argc, char **argv, options_p opts);
+void options_derive(options_p opts);
 void show_usage_and_exit(char *program_name);
 void notice(const char *format, ...);
 void error(const char *format, ...);
@@ -86,14 +108,25 @@ void pdie(int status, const char *message){
 // Argument parsing stuff
 //
 
+enum {
+	OPT_BENCH_PIPELINE = 256, OPT_DSP, OPT_BENCH_DSP
+};
+
 void parse_options(int argc, char **argv, options_p opts){
 	// Set default options
 	*opts = (options_t){
-		.host = NULL, .port = "61234",
+		.host = NULL, .port = "61234", .room = 0,
 		.sample_rate = 48000,
 		.channel_count = 2,
 		.frame_duration = 100,
-		.input_fd = -1, .output_fd = -1
+		.frames_per_packet = 1,
+		.input_fd = -1, .output_fd = -1,
+		.audio_backend = AUDIO_ASYNC,
+		.max_speakers = 16,
+		.max_bitrate = 64000,
+		.vad = true, .vad_threshold = -45,
+		.dsp = true,
+		.bench_pipeline = NULL, .bench_dsp = false
 	};
 	
 	// Parse the arguments
@@ -104,10 +137,19 @@ void parse_options(int argc, char **argv, options_p opts){
 		{"sample-rate", required_argument, NULL, 'r'},
 		{"channels", required_argument, NULL, 'c'},
 		{"frame-duration", required_argument, NULL, 'd'},
+		{"frames-per-packet", required_argument, NULL, 'p'},
+		{"room", required_argument, NULL, 'R'},
+		{"max-speakers", required_argument, NULL, 's'},
+		{"bitrate", required_argument, NULL, 'b'},
+		{"audio", required_argument, NULL, 'a'},
+		{"vad-threshold", required_argument, NULL, 'v'},
+		{"dsp", required_argument, NULL, OPT_DSP},
+		{"bench-pipeline", required_argument, NULL, OPT_BENCH_PIPELINE},
+		{"bench-dsp", no_argument, NULL, OPT_BENCH_DSP},
 		{"help", no_argument, NULL, 'h'},
 		{0, 0, 0, 0}
 	};
-	while( (opt_char = getopt_long(argc, argv, "i:o:r:c:d:h", longopts, NULL)) != -1 ){
+	while( (opt_char = getopt_long(argc, argv, "i:o:r:c:d:p:R:s:b:a:v:h", longopts, NULL)) != -1 ){
 		switch(opt_char){
 			case 'i':
 				if (strcmp(optarg, "-") == 0) {
@@ -163,12 +205,63 @@ void parse_options(int argc, char **argv, options_p opts){
 						break;
 				}
 				break;
+			case 'p':
+				opts->frames_per_packet = strtoul(optarg, NULL, 10);
+				break;
+			case 'R':
+				opts->room = strtoul(optarg, NULL, 10);
+				break;
+			case 's':
+				opts->max_speakers = strtoul(optarg, NULL, 10);
+				if (opts->max_speakers < 1)
+					die(1, "At least one speaker is needed\n");
+				break;
+			case 'b':
+				opts->max_bitrate = strtoul(optarg, NULL, 10);
+				if (opts->max_bitrate < 6000 || opts->max_bitrate > 510000)
+					die(1, "The bitrate has to be between 6000 and 510000 bit/s\n");
+				break;
+			case 'a':
+				if ( strcmp(optarg, "async") == 0 )
+					opts->audio_backend = AUDIO_ASYNC;
+				else if ( strcmp(optarg, "threads") == 0 )
+					opts->audio_backend = AUDIO_THREADS;
+				else
+					die(1, "The audio backend has to be async or threads\n");
+				break;
+			case 'v':
+				if ( strcmp(optarg, "off") == 0 ){
+					opts->vad = false;
+				} else {
+					opts->vad_threshold = strtod(optarg, NULL);
+					if (opts->vad_threshold > 0)
+						die(1, "The VAD threshold is in dBFS and has to be 0 or below\n");
+				}
+				break;
+			case OPT_DSP:
+				if ( strcmp(optarg, "on") == 0 )
+					opts->dsp = true;
+				else if ( strcmp(optarg, "off") == 0 )
+					opts->dsp = false;
+				else
+					die(1, "--dsp has to be on or off\n");
+				break;
+			case OPT_BENCH_PIPELINE:
+				opts->bench_pipeline = optarg;
+				break;
+			case OPT_BENCH_DSP:
+				opts->bench_dsp = true;
+				break;
 			case '?': case 'h':
 				show_usage_and_exit(argv[0]);
 				break;
 		}
 	}
 	
+	// The benchmark runs every format, the frames per packet are capped for each one
+	if (opts->bench_pipeline || opts->bench_dsp)
+		return;
+	
 	// After option parsing we're at the host:port argument
 	if (optind >= argc)
 		show_usage_and_exit(argv[0]);
@@ -181,30 +274,44 @@ void parse_options(int argc, char **argv, options_p opts){
 		opts->host = argv[optind];
 	}
 	
-	// Calculate derived values
-	opts->frame_samples_per_channel = (opts->sample_rate * opts->frame_duration) / 10000LL;
-	opts->frame_size = opts->channel_count * opts->frame_samples_per_channel * sizeof(int16_t);
+	// An Opus packet can hold at most 120 ms
+	if (opts->frames_per_packet < 1 || opts->frames_per_packet * opts->frame_duration > 1200)
+		die(1, "Packets have to contain at least one frame and at most 120 ms\n");
+	
+	options_derive(opts);
 	
 	// Print options
 	notice("Options:\n"
-		"  host: %s, port: %s\n"
-		"  sample_rate: %u, channel_count: %hhu, frame_duration: %.1f\n"
-		"  input_fd: %d, output_fd %d\n"
+		"  host: %s, port: %s, room: %u\n"
+		"  sample_rate: %u, channel_count: %hhu, frame_duration: %.1f, frames_per_packet: %zu\n"
+		"  input_fd: %d, output_fd %d, audio_backend: %s\n"
+		"  max_speakers: %zu, max_bitrate: %u, vad_threshold: %.1f dBFS%s, dsp: %s (%s)\n"
 		"  frame_samples_per_channel: %zu, frame_size: %zu\n",
-		opts->host, opts->port,
-		opts->sample_rate, opts->channel_count, opts->frame_duration / 10.0,
-		opts->input_fd, opts->output_fd,
+		opts->host, opts->port, opts->room,
+		opts->sample_rate, opts->channel_count, opts->frame_duration / 10.0, opts->frames_per_packet,
+		opts->input_fd, opts->output_fd, (opts->audio_backend == AUDIO_ASYNC) ? "async" : "threads",
+		opts->max_speakers, opts->max_bitrate, opts->vad_threshold, opts->vad ? "" : " (off)", opts->dsp ? "on" : "off", dsp_kernel_name(),
 		opts->frame_samples_per_channel, opts->frame_size
 	);
 }
 
+// Calculates the values that follow from the audio format
+void options_derive(options_p opts){
+	opts->frame_samples_per_channel = (opts->sample_rate * opts->frame_duration) / 10000LL;
+	opts->frame_size = opts->channel_count * opts->frame_samples_per_channel * sizeof(int16_t);
+}
+
 void show_usage_and_exit(char *program_name){
 	die(1,
 		"%s [-i file] [-o file]\n"
-		"    [-r sampe-rate] [-c channels] [-d frame-duration]\n"
+		"    [-r sampe-rate] [-c channels] [-d frame-duration] [-p frames-per-packet]\n"
+		"    [-R room] [-s max-speakers] [-b max-bitrate] [-a async|threads]\n"
+		"    [-v vad-threshold|off] [--dsp on|off]\n"
 		"    [-h help]\n"
-		"    host[:port]\n",
-		program_name
+		"    host[:port]\n"
+		"%s --bench-pipeline pcm-file [-p frames-per-packet] [-b max-bitrate] [-v vad-threshold|off] [--dsp on|off]\n"
+		"%s --bench-dsp\n",
+		program_name, program_name, program_name
 	);
 }
 
@@ -212,15 +319,22 @@ void show_usage_and_exit(char *program_name){
 //
 // Recording functions
 //
+// The audio threads exchange frames with the main loop through SPSC rings. Pulse Audio reads and
+// writes the frames directly in the ring memory so no copy through the kernel is needed.
+//
+
+// In frames, the fill level is printed with the speaker report
+#define CAPTURE_RING_FRAMES  16
+#define PLAYBACK_RING_FRAMES  16
 
-void* recording_thread(void *pipe_out_fd_p){
+ring_t capture_ring, playback_ring;
+
+void* recording_thread(void *data){
 	sigset_t sigs;
 	sigemptyset(&sigs);
 	sigaddset(&sigs, SIGINT);
 	pthread_sigmask(SIG_BLOCK, &sigs, NULL);
 	
-	int recording_pipe_in = *((int*)pipe_out_fd_p);
-	
 	const pa_sample_spec ss = {
 		.format = PA_SAMPLE_S16LE,
 		.rate = opts.sample_rate,
@@ -234,44 +348,32 @@ void* recording_thread(void *pipe_out_fd_p){
 	
 	notice("Recording thread started...\n");
 	
-	uint8_t *buffer = malloc(opts.frame_size);
+	// When the main loop falls behind the newest frame is dropped into the scratch buffer
+	uint8_t *scratch = malloc(opts.frame_size);
 	while (true) {
-		if ( pa_simple_read(pa, buffer, opts.frame_size, &pa_error) < 0 ){
+		uint8_t *frame = ring_write_frame(&capture_ring);
+		if ( pa_simple_read(pa, frame ? frame : scratch, opts.frame_size, &pa_error) < 0 ){
 			error("pa_simple_read() failed: %s\n", pa_strerror(pa_error));
 			break;
 		}
 		
-		size_t bytes_written = 0;
-		while(bytes_written < opts.frame_size){
-			ssize_t written = write(recording_pipe_in, buffer + bytes_written, opts.frame_size - bytes_written);
-			if (written < 0){
-				perror("write() failed");
-				break;
-			}
-			bytes_written += written;
-		}
+		if (frame)
+			ring_write_commit(&capture_ring);
 	}
 	
-	free(buffer);
-	free(pipe_out_fd_p);
+	free(scratch);
 	pa_simple_free(pa);
 	
 	return NULL;
 }
 
-int startup_recording_thread(){
-	int fds[2];
+void startup_recording_thread(){
 	pthread_t thread;
 	
-	if ( pipe(fds) == -1 )
-		pdie(2, "pipe() failed");
-	
-	int *pipe_in_fd_p = malloc(sizeof(int));
-	*pipe_in_fd_p = fds[1];
-	if ( pthread_create(&thread, NULL, recording_thread, pipe_in_fd_p) != 0 )
+	if ( !ring_init(&capture_ring, opts.frame_size, CAPTURE_RING_FRAMES) )
+		pdie(2, "Failed to create capture ring");
+	if ( pthread_create(&thread, NULL, recording_thread, NULL) != 0 )
 		die(2, "Failed to create recording thread\n");
-	
-	return fds[0];
 }
 
 
@@ -279,14 +381,12 @@ int startup_recording_thread(){
 // Playback functions
 //
 
-void* playback_thread(void *pipe_out_fd_p){
+void* playback_thread(void *data){
 	sigset_t sigs;
 	sigemptyset(&sigs);
 	sigaddset(&sigs, SIGINT);
 	pthread_sigmask(SIG_BLOCK, &sigs, NULL);
 	
-	int playback_pipe_out = *((int*)pipe_out_fd_p);
-	
 	const pa_sample_spec ss = {
 		.format = PA_SAMPLE_S16LE,
 		.rate = opts.sample_rate,
@@ -300,273 +400,2279 @@ void* playback_thread(void *pipe_out_fd_p){
 	
 	notice("Playback thread started...\n");
 	
-	uint8_t *buffer = malloc(opts.frame_size);
 	while (true) {
-		ssize_t bytes_read = read(playback_pipe_out, buffer, opts.frame_size);
-		if (bytes_read == 0)
-			break;
-		if (bytes_read < 0){
-			perror("read() failed");
-			break;
-		}
+		ring_wait(&playback_ring);
+		uint8_t *frame = ring_read_frame(&playback_ring);
 		
-		if (pa_simple_write(pa, buffer, bytes_read, &pa_error) < 0){
+		int result = pa_simple_write(pa, frame, opts.frame_size, &pa_error);
+		ring_read_release(&playback_ring);
+		if (result < 0){
 			error("pa_simple_write() failed: %s\n", pa_strerror(pa_error));
 			break;
 		}
 	}
 	
-	free(buffer);
-	free(pipe_out_fd_p);
 	pa_simple_free(pa);
 	
 	return NULL;
 }
 
-int startup_playback_thread(){
-	int fds[2];
+void startup_playback_thread(){
 	pthread_t thread;
 	
-	if ( pipe(fds) == -1 )
-		pdie(2, "pipe() failed");
-	
-	int *pipe_out_fd_p = malloc(sizeof(int));
-	*pipe_out_fd_p = fds[0];
-	if ( pthread_create(&thread, NULL, playback_thread, pipe_out_fd_p) != 0 )
+	if ( !ring_init(&playback_ring, opts.frame_size, PLAYBACK_RING_FRAMES) )
+		pdie(2, "Failed to create playback ring");
+	if ( pthread_create(&thread, NULL, playback_thread, NULL) != 0 )
 		die(2, "Failed to create playback thread\n");
-	
-	return fds[1];
 }
 
 
 //
-// Signal handling stuff
+// Pulse Audio async backend
+//
+// Drives Pulse Audio from the main loop instead of two extra threads. The Pulse Audio main loop
+// gets a custom poll function that also polls the file descriptors of the main loop, so one poll()
+// waits for the socket, the playout timer and the audio streams. Recorded audio is cut into frames
+// in the capture ring (producer and consumer are the same thread then), playback frames are written
+// into the playback stream when the playout timer mixed them.
+//
+// Both streams ask for buffers of about one frame (fragsize for recording, minreq and tlength for
+// playback) to keep the latency low.
 //
-bool quit = false;
-
-void sigint_handler(int signum){
-	quit = true;
-}
 
-void establish_signal_handlers(){
-	struct sigaction action;
-	memset(&action, 0, sizeof(action));
-	action.sa_handler = sigint_handler;
-	action.sa_flags = SA_RESTART;
-	if ( sigaction(SIGINT, &action, NULL) == -1 )
-		perror("sigaction() failed");
-}
+// Target playback buffer, in frames
+#define PULSE_PLAYBACK_FRAMES  2
 
-void log_print(const char *format, ...){
-	va_list args;
-	va_start(args, format);
-	vfprintf(stderr, format, args);
-	va_end(args);
-}
+typedef struct {
+	pa_mainloop *mainloop;
+	pa_context *context;
+	pa_stream *record, *playback;
+	size_t capture_filled;  // bytes in the current capture ring frame
+	size_t underflows, overflows;
+	
+	// Merged pollfds of Pulse Audio and the main loop
+	struct pollfd *poll_fds;
+	size_t poll_fds_size;
+	// pollfds of the main loop for the current iteration
+	struct pollfd *loop_fds;
+	nfds_t loop_fd_count;
+	int loop_timeout, loop_result, loop_errno;
+	bool loop_polled;
+} pulse_async_t;
 
+pulse_async_t pulse_async = { 0 };
 
-int main(int argc, char **argv){
-	parse_options(argc, argv, &opts);
-	establish_signal_handlers();
+// Poll function of the Pulse Audio main loop, the fds of the main loop are polled right after the
+// Pulse Audio ones
+int pulse_async_poll(struct pollfd *pa_fds, unsigned long pa_fd_count, int pa_timeout, void *userdata){
+	pulse_async_t *pulse = userdata;
+	size_t count = pa_fd_count + pulse->loop_fd_count;
+	if (count > pulse->poll_fds_size){
+		pulse->poll_fds = realloc(pulse->poll_fds, count * sizeof(struct pollfd));
+		pulse->poll_fds_size = count;
+	}
+	memcpy(pulse->poll_fds, pa_fds, pa_fd_count * sizeof(struct pollfd));
+	memcpy(pulse->poll_fds + pa_fd_count, pulse->loop_fds, pulse->loop_fd_count * sizeof(struct pollfd));
 	
-	if (opts.input_fd == -1)
-		opts.input_fd = startup_recording_thread();
-	if (opts.output_fd == -1)
-		opts.output_fd = startup_playback_thread();
+	int timeout = pa_timeout;
+	if (timeout < 0 || (pulse->loop_timeout >= 0 && pulse->loop_timeout < timeout))
+		timeout = pulse->loop_timeout;
 	
-	/*
-	// read audio data in 48 kHz and s16ne
-	const size_t freq = 48000; // in Hz
-	const size_t frame_dur = 10; // in ms, 2.5 (won't work), 5, 10, 20, 40, 60
-	const size_t frame_samples = (freq * frame_dur) / 1000;
-	const size_t channel_count = 2;
-	log_print("%zu samples per frame, %zu channels\n", frame_samples, channel_count);
-	*/
+	int result = poll(pulse->poll_fds, count, timeout);
+	pulse->loop_polled = true;
+	pulse->loop_errno = errno;
+	if (result < 0){
+		pulse->loop_result = result;
+		return result;
+	}
 	
-	// Allocate frame buffers
-	int16_t *in_frame = malloc(opts.frame_size);
-	int16_t *out_frame = malloc(opts.frame_size);
+	int pa_ready = 0;
+	for(size_t i = 0; i < pa_fd_count; i++){
+		pa_fds[i].revents = pulse->poll_fds[i].revents;
+		if (pa_fds[i].revents)
+			pa_ready++;
+	}
+	for(size_t i = 0; i < pulse->loop_fd_count; i++)
+		pulse->loop_fds[i].revents = pulse->poll_fds[pa_fd_count + i].revents;
+	pulse->loop_result = result - pa_ready;
 	
-	// Init Opus encoder and decoder
-	int error_code = 0;
-	OpusEncoder *enc;
-	enc = opus_encoder_create(opts.sample_rate, opts.channel_count, OPUS_APPLICATION_VOIP, &error_code);
-	assert(error_code == OPUS_OK);
+	return pa_ready;
+}
+
+// Drop in replacement for poll() in the main loop, runs one Pulse Audio main loop iteration when
+// the async backend is active
+int audio_poll(struct pollfd *fds, nfds_t count, int timeout){
+	if (pulse_async.mainloop == NULL)
+		return poll(fds, count, timeout);
 	
-	OpusDecoder *dec;
- 	dec = opus_decoder_create(opts.sample_rate, opts.channel_count, &error_code);
- 	assert(error_code == OPUS_OK);
+	pulse_async.loop_fds = fds;
+	pulse_async.loop_fd_count = count;
+	pulse_async.loop_timeout = timeout;
+	pulse_async.loop_polled = false;
 	
-	// Search for the server
-	struct addrinfo hints = {0};
-	hints.ai_family = AF_INET;
-	hints.ai_socktype = SOCK_DGRAM;
-	struct addrinfo *addr_info;
-	error_code = getaddrinfo(opts.host, opts.port, &hints, &addr_info);
-	if (error_code != 0)
-		die(3, "getaddrinfo failed: %s\n", gai_strerror(error_code));
+	pa_mainloop_iterate(pulse_async.mainloop, 1, NULL);
 	
-	// Remember the first matching IP address
-	struct sockaddr_in server_addr;
-	memcpy(&server_addr, addr_info->ai_addr, sizeof(server_addr));
+	// Pulse Audio might have dispatched pending events without polling, then nothing of ours is ready
+	if (!pulse_async.loop_polled){
+		for(nfds_t i = 0; i < count; i++)
+			fds[i].revents = 0;
+		return 0;
+	}
 	
-	// Show all found addresses... just some fun for debugging
-	size_t host_len = 1024, service_len = 1024;
-	char host[host_len], service[service_len];
-	for (struct addrinfo * cur_addr_info = addr_info; cur_addr_info != NULL; cur_addr_info = cur_addr_info->ai_next){
-		getnameinfo(cur_addr_info->ai_addr, cur_addr_info->ai_addrlen, host, host_len, service, service_len, NI_DGRAM | NI_NUMERICHOST);
-		notice("%s:%s\n", host, service);
+	errno = pulse_async.loop_errno;
+	return pulse_async.loop_result;
+}
+
+void pulse_async_read(pa_stream *stream, size_t length, void *userdata){
+	pulse_async_t *pulse = userdata;
+	
+	while (pa_stream_readable_size(stream) > 0){
+		const uint8_t *data = NULL;
+		size_t size = 0;
+		if ( pa_stream_peek(stream, (const void**)&data, &size) < 0 ){
+			error("pa_stream_peek() failed: %s\n", pa_strerror(pa_context_errno(pulse->context)));
+			return;
+		}
+		if (size == 0)
+			break;
+		
+		// Cut the fragment into frames, holes in the stream (data NULL) are recorded as silence
+		while (size > 0){
+			uint8_t *frame = ring_write_frame(&capture_ring);
+			if (frame == NULL)
+				break;
+			
+			size_t chunk = opts.frame_size - pulse->capture_filled;
+			if (chunk > size)
+				chunk = size;
+			if (data){
+				memcpy(frame + pulse->capture_filled, data, chunk);
+				data += chunk;
+			} else {
+				memset(frame + pulse->capture_filled, 0, chunk);
+			}
+			size -= chunk;
+			
+			pulse->capture_filled += chunk;
+			if (pulse->capture_filled == opts.frame_size){
+				ring_write_commit(&capture_ring);
+				pulse->capture_filled = 0;
+			}
+		}
+		
+		pa_stream_drop(stream);
+	}
+}
+
+void pulse_async_underflow(pa_stream *stream, void *userdata){
+	((pulse_async_t*)userdata)->underflows++;
+}
+
+void pulse_async_overflow(pa_stream *stream, void *userdata){
+	((pulse_async_t*)userdata)->overflows++;
+}
+
+// Iterates the Pulse Audio main loop until the stream is ready
+void pulse_async_wait_for_stream(pa_stream *stream){
+	pa_stream_state_t state;
+	while( (state = pa_stream_get_state(stream)) != PA_STREAM_READY ){
+		if ( !PA_STREAM_IS_GOOD(state) )
+			die(2, "Pulse Audio stream failed: %s\n", pa_strerror(pa_context_errno(pulse_async.context)));
+		pa_mainloop_iterate(pulse_async.mainloop, 1, NULL);
 	}
+}
+
+void pulse_async_start(bool record, bool playback){
+	pulse_async_t *pulse = &pulse_async;
 	
-	// Free the entire address list
-	freeaddrinfo(addr_info);
+	const pa_sample_spec ss = {
+		.format = PA_SAMPLE_S16LE,
+		.rate = opts.sample_rate,
+		.channels = opts.channel_count
+	};
 	
+	pulse->mainloop = pa_mainloop_new();
+	pa_mainloop_set_poll_func(pulse->mainloop, pulse_async_poll, pulse);
+	pulse->context = pa_context_new(pa_mainloop_get_api(pulse->mainloop), "arkanis voice chat");
+	if ( pa_context_connect(pulse->context, NULL, PA_CONTEXT_NOFLAGS, NULL) < 0 )
+		die(2, "pa_context_connect() failed: %s\n", pa_strerror(pa_context_errno(pulse->context)));
 	
-	// Create a local socket and bind to some free port
-	int client_fd = socket(AF_INET, SOCK_DGRAM, 0);
-	if (client_fd == -1)
-		pdie(3, "socket");
+	pa_context_state_t state;
+	while( (state = pa_context_get_state(pulse->context)) != PA_CONTEXT_READY ){
+		if ( !PA_CONTEXT_IS_GOOD(state) )
+			die(2, "Pulse Audio connection failed: %s\n", pa_strerror(pa_context_errno(pulse->context)));
+		pa_mainloop_iterate(pulse->mainloop, 1, NULL);
+	}
 	
-	struct sockaddr_in addr = (struct sockaddr_in){ AF_INET, 0, .sin_addr = { INADDR_ANY } };
-	if (bind(client_fd, (const struct sockaddr *)&addr, sizeof(addr)) == -1)
-		pdie(3, "bind");
+	pa_stream_flags_t flags = PA_STREAM_ADJUST_LATENCY | PA_STREAM_INTERPOLATE_TIMING | PA_STREAM_AUTO_TIMING_UPDATE;
 	
+	if (record){
+		if ( !ring_init(&capture_ring, opts.frame_size, CAPTURE_RING_FRAMES) )
+			pdie(2, "Failed to create capture ring");
+		
+		const pa_buffer_attr attr = {
+			.maxlength = (uint32_t)-1, .tlength = (uint32_t)-1, .prebuf = (uint32_t)-1, .minreq = (uint32_t)-1,
+			.fragsize = opts.frame_size
+		};
+		pulse->record = pa_stream_new(pulse->context, "arkanis voice chat", &ss, NULL);
+		pa_stream_set_read_callback(pulse->record, pulse_async_read, pulse);
+		pa_stream_set_overflow_callback(pulse->record, pulse_async_overflow, pulse);
+		if ( pa_stream_connect_record(pulse->record, NULL, &attr, flags) < 0 )
+			die(2, "pa_stream_connect_record() failed: %s\n", pa_strerror(pa_context_errno(pulse->context)));
+		pulse_async_wait_for_stream(pulse->record);
+	}
 	
-	packet_t packet;
-	ssize_t bytes_send, bytes_received;
+	if (playback){
+		const pa_buffer_attr attr = {
+			.maxlength = (uint32_t)-1,
+			.tlength = PULSE_PLAYBACK_FRAMES * opts.frame_size,
+			.prebuf = opts.frame_size,
+			.minreq = opts.frame_size,
+			.fragsize = (uint32_t)-1
+		};
+		pulse->playback = pa_stream_new(pulse->context, "arkanis voice chat", &ss, NULL);
+		pa_stream_set_underflow_callback(pulse->playback, pulse_async_underflow, pulse);
+		if ( pa_stream_connect_playback(pulse->playback, NULL, &attr, flags, NULL, NULL) < 0 )
+			die(2, "pa_stream_connect_playback() failed: %s\n", pa_strerror(pa_context_errno(pulse->context)));
+		pulse_async_wait_for_stream(pulse->playback);
+	}
 	
-	// Do connection setup
-	packet = (packet_t){ PACKET_HELLO };
-	bytes_send = sendto(client_fd, &packet, offsetof(packet_t, user), 0, (const struct sockaddr *)&server_addr, sizeof(server_addr));
-	if (bytes_send == -1)
-		perror("sendto");
+	notice("Pulse Audio async backend started...\n");
+}
+
+void pulse_async_write(const int16_t *frame){
+	if ( pa_stream_write(pulse_async.playback, frame, opts.frame_size, NULL, 0, PA_SEEK_RELATIVE) < 0 )
+		error("pa_stream_write() failed: %s\n", pa_strerror(pa_context_errno(pulse_async.context)));
+}
+
+// Prints the latency of a stream as reported by the server, it includes the device latency
+void pulse_async_report_stream(const char *name, pa_stream *stream){
+	pa_usec_t latency = 0;
+	int negative = 0;
+	if ( pa_stream_get_latency(stream, &latency, &negative) < 0 ){
+		notice("pulse %s latency: unknown\n", name);
+		return;
+	}
 	
-	uint8_t user_id = 0;
-	do {
-		bytes_received = recvfrom(client_fd, &packet, sizeof(packet), 0, NULL, NULL);
-	} while(packet.type != PACKET_WELCOME);
-	user_id = packet.user;
-	notice("Welcome from server, you're client %hhu\n", packet.user);
+	// Pulse Audio might not grant the buffer sizes we asked for
+	const pa_buffer_attr *attr = pa_stream_get_buffer_attr(stream);
+	uint32_t buffer_size = 0;
+	if (attr)
+		buffer_size = (stream == pulse_async.record) ? attr->fragsize : attr->tlength;
+	notice("pulse %s latency: %s%.2f ms, buffer %u bytes\n", name, negative ? "-" : "", latency / 1000.0, buffer_size);
+}
+
+void pulse_async_report(){
+	if (pulse_async.record)
+		pulse_async_report_stream("record", pulse_async.record);
+	if (pulse_async.playback)
+		pulse_async_report_stream("playback", pulse_async.playback);
+	notice("pulse underflows: %zu, overflows: %zu\n", pulse_async.underflows, pulse_async.overflows);
+}
+
+void pulse_async_stop(){
+	pulse_async_t *pulse = &pulse_async;
+	if (pulse->record){
+		pa_stream_disconnect(pulse->record);
+		pa_stream_unref(pulse->record);
+	}
+	if (pulse->playback){
+		pa_stream_disconnect(pulse->playback);
+		pa_stream_unref(pulse->playback);
+	}
+	pa_context_disconnect(pulse->context);
+	pa_context_unref(pulse->context);
+	pa_mainloop_free(pulse->mainloop);
+	free(pulse->poll_fds);
+	*pulse = (pulse_async_t){ 0 };
+}
+
+
+//
+// Voice activity detection
+//
+// An energy based VAD: frames above the threshold are voice, after the last voice frame we keep
+// sending for a hangover time so word endings and short pauses aren't cut. While silent nothing is
+// encoded or sent, only a SILENCE packet at the start and then as keepalive now and then. The server
+// forwards only the first one so silent participants cost the relay next to nothing.
+//
+
+// In ms
+#define VAD_HANGOVER  300
+#define SILENCE_KEEPALIVE_INTERVAL  1000
+
+typedef struct {
+	bool talking;
+	size_t frames_since_voice, frames_since_keepalive;
+	double noise_level;  // average level of silent frames, in dBFS
+	size_t voiced_frames, silent_frames;
+} vad_t;
+
+vad_t vad = { .talking = true, .noise_level = -100 };
+
+// Takes the level of the next frame in dBFS and returns true if the frame should be sent. While
+// silent send_silence is set when a SILENCE packet is due (start of the silence or keepalive).
+bool vad_update(double level, bool *send_silence){
+	*send_silence = false;
+	if (!opts.vad)
+		return true;
 	
+	if (level >= opts.vad_threshold){
+		vad.frames_since_voice = 0;
+	} else {
+		vad.frames_since_voice++;
+		vad.noise_level += (level - vad.noise_level) / 16;
+	}
 	
-	void conceal_loss(){
-		int decoded_samples = opus_decode(dec, NULL, 0, out_frame, opts.frame_samples_per_channel, 0);
-		if (decoded_samples < 0)
-			error("opus_decode error: %d\n", opus_decode);
-		else
-			write(opts.output_fd, out_frame, decoded_samples * opts.channel_count * sizeof(int16_t));
+	if (vad.frames_since_voice * opts.frame_duration < VAD_HANGOVER * 10){
+		vad.talking = true;
+		vad.voiced_frames++;
+		return true;
 	}
 	
-	size_t frame_filled = 0;
-	uint16_t send_seq = 0;
-	uint16_t recv_seq = 0;
-	while(!quit){
-		// Read and receive stuff
-		struct pollfd pollfds[2] = {
-			(struct pollfd){ client_fd, POLLIN },
-			(struct pollfd){ opts.input_fd, POLLIN }
-		};
-		error_code = poll(pollfds, 2, -1);
-		if (error_code == -1){
-			perror("poll");
+	vad.silent_frames++;
+	vad.frames_since_keepalive++;
+	if (vad.talking || vad.frames_since_keepalive * opts.frame_duration >= SILENCE_KEEPALIVE_INTERVAL * 10){
+		vad.talking = false;
+		vad.frames_since_keepalive = 0;
+		*send_silence = true;
+	}
+	return false;
+}
+
+
+//
+// Latency telemetry
+//
+// When the delay feels too long we want to know where it comes from, so the live client timestamps
+// every frame along its way:
+//
+//	capture   a recorded frame waits in the capture ring until the main loop takes it
+//	encode    frame taken until its packet goes out (analyze, encode, packetize, frame packing)
+//	send      the sendto() call
+//	rtt       round trip time to the server, measured with PING packets
+//	buffer    packet received until its frame is decoded, mostly the jitter buffer
+//	decode    decoding or concealing a frame
+//	playback  frames queued in the playback ring ahead of a mixed frame
+//
+// The sender stages of one client and the receiver stages of another add up to the mouth to ear
+// delay between them, the rtt stands for the two network hops through the server. The device
+// latency of Pulse Audio comes on top (the async backend reports it with the rings). Every
+// JITTER_REPORT_INTERVAL the histograms are printed and reset along with the speaker stats.
+//
+
+// In ms
+#define PING_INTERVAL  1000
+
+typedef enum {
+	LATENCY_CAPTURE, LATENCY_ENCODE, LATENCY_SEND, LATENCY_RTT, LATENCY_BUFFER, LATENCY_DECODE, LATENCY_PLAYBACK, LATENCY_STAGES
+} latency_stage_t;
+
+const char *latency_stage_names[LATENCY_STAGES] = { "capture", "encode", "send", "rtt", "buffer", "decode", "playback" };
+
+typedef struct {
+	latency_histogram_t stages[LATENCY_STAGES];
+	uint64_t packet_started;  // when the first frame of the next packet was taken, 0 if there is none
+	uint64_t last_ping;
+	size_t pings_sent, pongs_received;
+} telemetry_t;
+
+telemetry_t telemetry = { 0 };
+
+uint64_t now_ns(){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+void telemetry_add(latency_stage_t stage, uint64_t start_ns, uint64_t end_ns){
+	latency_add(&telemetry.stages[stage], (end_ns > start_ns) ? (end_ns - start_ns) / 1000 : 0);
+}
+
+// Sends a PING with our clock in it, the server echoes it back as PONG
+void telemetry_ping(int client_fd, const struct sockaddr_in *server_addr){
+	uint64_t now = now_ns();
+	if (now - telemetry.last_ping < PING_INTERVAL * 1000000ULL)
+		return;
+	telemetry.last_ping = now;
+	
+	uint8_t packet[PACKET_HEADER_MAX + sizeof(now)];
+	size_t len = packet_pack_header(packet, PACKET_PING, 0, 0);
+	memcpy(packet + len, &now, sizeof(now));
+	len += sizeof(now);
+	if ( sendto(client_fd, packet, len, 0, (const struct sockaddr *)server_addr, sizeof(*server_addr)) == -1 )
+		perror("sendto");
+	else
+		telemetry.pings_sent++;
+}
+
+void telemetry_pong(const uint8_t *data, size_t len){
+	uint64_t sent;
+	if (len != sizeof(sent))
+		return;
+	memcpy(&sent, data, sizeof(sent));
+	telemetry_add(LATENCY_RTT, sent, now_ns());
+	telemetry.pongs_received++;
+}
+
+void telemetry_report(){
+	double total = 0;
+	for(size_t i = 0; i < LATENCY_STAGES; i++){
+		latency_histogram_p histogram = &telemetry.stages[i];
+		if (histogram->count == 0)
 			continue;
+		
+		double p50 = latency_percentile(histogram, 50) / 1000.0;
+		total += p50;
+		notice("latency %-8s p50 %7.2f ms, p99 %7.2f ms, max %7.2f ms, %zu samples\n", latency_stage_names[i],
+			p50, latency_percentile(histogram, 99) / 1000.0, histogram->max / 1000.0, histogram->count);
+		*histogram = (latency_histogram_t){ 0 };
+	}
+	notice("latency mouth to ear about %.2f ms plus device latency, %zu of %zu pings answered\n",
+		total, telemetry.pongs_received, telemetry.pings_sent);
+	telemetry.pings_sent = telemetry.pongs_received = 0;
+}
+
+
+//
+// Jitter buffer
+//
+// Every speaker buffers its packets by sequence number and the playout timer takes one frame per
+// tick. The playout delay follows the measured jitter (RFC 3550 interarrival jitter): the target
+// depth is three times the jitter plus the frames of one packet. When the buffer runs low a
+// concealed frame is played without consuming a packet to build up delay. When it stays above the
+// target for a while a frame is skipped to cut the delay again. Missing frames are recovered from
+// the in-band FEC of the following packet if it's already there, otherwise they are concealed by
+// Opus (PLC). Packets that arrive after their playout time are dropped.
+//
+
+// Power of two, more frames than we ever want to buffer
+#define JITTER_SLOTS  64
+#define JITTER_PACKET_MAX  (PACKET_MAX - PACKET_HEADER_MAX)
+// Concealed frames in a row with nothing newer received before the speaker is considered silent
+#define JITTER_MAX_CONCEAL  5
+// Ticks the buffer has to stay above the target before a frame is skipped
+#define JITTER_SHRINK_TICKS  50
+// In seconds
+#define JITTER_REPORT_INTERVAL  5
+// Loss reports to the speakers, in ms
+#define REPORT_INTERVAL  1000
+
+typedef struct {
+	bool filled;
+	uint16_t seq;
+	uint16_t len;
+	double received;  // in ms, when the packet with the frame arrived
+	uint8_t data[JITTER_PACKET_MAX];
+} jitter_slot_t, *jitter_slot_p;
+
+typedef struct {
+	jitter_slot_t slots[JITTER_SLOTS];
+	bool receiving;       // false until the first packet after a reset or a silence
+	bool playing;         // false while we buffer up to the target depth
+	uint16_t next_seq;    // frame to play next
+	uint16_t newest_seq;  // newest frame received so far
+	
+	double jitter;        // in ms
+	double last_arrival;  // in ms
+	uint16_t last_seq;
+	size_t target_depth;  // in frames
+	size_t packet_frames;  // frames in the last received packet, set by the caller of jitter_put()
+	double received;       // when that packet arrived in ms, set by the caller of jitter_put()
+	bool ending;          // the speaker went silent, play up to end_seq and stop
+	uint16_t end_seq;
+	size_t concealed_in_row;
+	size_t ticks_above_target;
+	
+	size_t played, concealed, late, skipped, recovered;
+	// Frames played and missing (lost or late) since the last loss report
+	size_t interval_played, interval_missing;
+} jitter_buffer_t, *jitter_buffer_p;
+
+typedef enum { JITTER_NOTHING, JITTER_PACKET, JITTER_FEC, JITTER_CONCEAL } jitter_action_t;
+
+double now_ms(){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000.0 + now.tv_nsec / 1000000.0;
+}
+
+void jitter_reset(jitter_buffer_p jb){
+	for(size_t i = 0; i < JITTER_SLOTS; i++)
+		jb->slots[i].filled = false;
+	jb->receiving = false;
+	jb->playing = false;
+	jb->ending = false;
+}
+
+void jitter_init(jitter_buffer_p jb){
+	jitter_reset(jb);
+	jb->jitter = 0;
+	jb->target_depth = 1;
+	jb->packet_frames = 1;
+	jb->concealed_in_row = jb->ticks_above_target = 0;
+	jb->played = jb->concealed = jb->late = jb->skipped = jb->recovered = 0;
+	jb->interval_played = jb->interval_missing = 0;
+}
+
+// Frames from the playout position up to the newest received one
+size_t jitter_depth(jitter_buffer_p jb){
+	if (!jb->receiving)
+		return 0;
+	int16_t depth = jb->newest_seq - jb->next_seq + 1;
+	return (depth > 0) ? depth : 0;
+}
+
+void jitter_put(jitter_buffer_p jb, uint16_t seq, const uint8_t *data, size_t len, double arrival){
+	double frame_ms = opts.frame_duration / 10.0;
+	if (len > JITTER_PACKET_MAX){
+		error("packet of %zu bytes too large for the jitter buffer\n", len);
+		return;
+	}
+	
+	if (!jb->receiving){
+		jb->receiving = true;
+		jb->playing = false;
+		jb->next_seq = jb->newest_seq = jb->last_seq = seq;
+		jb->last_arrival = arrival;
+		jb->concealed_in_row = 0;
+	} else {
+		int16_t ahead = seq - jb->next_seq;
+		if (ahead < 0 && jb->playing){
+			jb->late++;
+			return;
+		} else if (ahead < 0) {
+			// Reordered before playout started, start with the earlier packet
+			jb->next_seq = seq;
+		} else if (ahead >= JITTER_SLOTS) {
+			// Far ahead of what we play, the sender restarted or we fell way behind
+			jitter_reset(jb);
+			jitter_put(jb, seq, data, len, arrival);
+			return;
 		}
 		
-		if (pollfds[0].revents & POLLIN){
-			// Ready to receive packet from the server
-			bytes_received = recvfrom(client_fd, &packet, sizeof(packet), 0, NULL, NULL);
-			size_t data_len = bytes_received - offsetof(packet_t, data);
-			//log_print("received packet type %hhu, %zu data bytes\n", packet.type, data_len);
-			
-			if (packet.type == PACKET_DATA) {
-				if (data_len != packet.len){
-					log_print("incomplete packet, expected %hu, got %zu\n", packet.len, data_len);
-					conceal_loss();
-				}
-				
-				log_print("packet seq: %hu, cur seq: %hu\n", packet.seq, recv_seq);
-				/*
-				//if (packet.seq == 0)
-				//	recv_seq == 0;
-				if (recv_seq == UINT16_MAX) {
-					// Init seq number
-					//recv_seq = packet.seq;
-				}
-				
-				uint16_t lost = packet.seq - recv_seq;
-				if (lost == 0) {
-					// received expected seq, everthing is fine, expect next packet
-					recv_seq++;
-				} else if (lost < UINT16_MAX / 2) {
-					// We use the range [1, UINT16_MAX / 2] for normal packet loss
-					log_print("packet loss, last known seq: %hu, packet seq: %hu, lost: %hu\n",
-						recv_seq, packet.seq, lost);
-					for(size_t i = 0; i < lost; i++)
-						conceal_loss();
-					recv_seq = packet.seq;
-				} else {
-					// lost was actually negative and warped around. We use the range
-					// [UINT16_MAX / 2, UINT16_MAX] to capture this.
-					log_print("old (out of order) packet from seq %hu, curren seq: %hu, age: %hu\n",
-						packet.seq, recv_seq, UINT16_MAX - lost);
-					continue;
-				}
-				*/
-				int decoded_samples = opus_decode(dec, packet.data, data_len, out_frame, opts.frame_samples_per_channel, 0);
-				if (decoded_samples < 0)
-					log_print("opus_decode error: %d\n", opus_decode);
-				else
-					write(opts.output_fd, out_frame, decoded_samples * opts.channel_count * sizeof(int16_t));
-			} else if (packet.type == PACKET_JOIN) {
-				recv_seq = 0;
-				log_print("user %hhu joined\n", packet.user);
-			} else if (packet.type == PACKET_BYE) {
-				log_print("user %hhu disconnected\n", packet.user);
-			} else {
-				log_print("unknown packet, type %hhu, %zu bytes data\n", packet.type, data_len);
-			}
+		// Interarrival jitter, difference of the arrival spacing and the send spacing. A new
+		// talkspurt that arrives before we played out the last one starts after a pause of unknown
+		// length, its first packet only gives the new reference.
+		bool talkspurt_start = jb->ending && (int16_t)(seq - jb->end_seq) >= 0;
+		if (!talkspurt_start){
+			double d = (arrival - jb->last_arrival) - (int16_t)(seq - jb->last_seq) * frame_ms;
+			jb->jitter += (((d < 0) ? -d : d) - jb->jitter) / 16;
 		}
+		jb->last_arrival = arrival;
+		jb->last_seq = seq;
 		
-		if (pollfds[1].revents & POLLIN){
-			// Audio data from input fd ready to read
-			ssize_t bytes_read = read(opts.input_fd, in_frame + frame_filled, opts.frame_size - frame_filled);
-			if (bytes_read == -1){
-				perror("read");
-				continue;
-			}
-			
-			frame_filled += bytes_read;
-			if (frame_filled >= opts.frame_size){
-				packet = (packet_t){ PACKET_DATA, user_id, send_seq };
-				int32_t len = opus_encode(enc, in_frame, opts.frame_samples_per_channel, packet.data, sizeof(packet) - offsetof(packet_t, data));
-				frame_filled -= opts.frame_size;
-				
-				if (len < 0)
-					log_print("opus_encode error!\n");
-				else if (len == 1)
-					continue;
-				
-				packet.len = len;
-				bytes_send = sendto(client_fd, &packet, offsetof(packet_t, data) + len, 0, (const struct sockaddr *)&server_addr, sizeof(server_addr));
-				if (bytes_send < 0)
-					perror("sendto");
-				
-				log_print("send %zd bytes\n", bytes_send);
-				send_seq++;
-			}
-			
+		if ((int16_t)(seq - jb->newest_seq) > 0)
+			jb->newest_seq = seq;
+		if (talkspurt_start)
+			jb->ending = false;
+	}
+	
+	jitter_slot_p slot = &jb->slots[seq & (JITTER_SLOTS - 1)];
+	slot->filled = true;
+	slot->seq = seq;
+	slot->len = len;
+	slot->received = jb->received;
+	memcpy(slot->data, data, len);
+	
+	// Packets with several frames arrive only every few frames, we need them all buffered
+	size_t target = (size_t)(3 * jb->jitter / frame_ms + 0.999) + jb->packet_frames;
+	jb->target_depth = (target < JITTER_SLOTS / 2) ? target : JITTER_SLOTS / 2;
+}
+
+// The speaker went silent, all frames before seq were sent. Instead of concealing frames at the
+// end we stop playing once they are played out.
+void jitter_end(jitter_buffer_p jb, uint16_t seq){
+	if (!jb->receiving)
+		return;
+	jb->ending = true;
+	jb->end_seq = seq;
+}
+
+// Decides what to play in this tick. For JITTER_PACKET slot points to the packet to decode, for
+// JITTER_FEC to the following packet that carries the FEC data of the missing frame.
+jitter_action_t jitter_get(jitter_buffer_p jb, jitter_slot_p *slot){
+	if (!jb->receiving)
+		return JITTER_NOTHING;
+	
+	if (jb->ending && (int16_t)(jb->next_seq - jb->end_seq) >= 0){
+		jitter_reset(jb);
+		return JITTER_NOTHING;
+	}
+	
+	// At the end of a talkspurt play whatever is there
+	size_t depth = jitter_depth(jb);
+	if (!jb->playing){
+		if (depth < jb->target_depth && !jb->ending)
+			return JITTER_NOTHING;
+		jb->playing = true;
+		jb->ticks_above_target = 0;
+	}
+	
+	// Too little buffered, stretch by one concealed frame
+	if (depth > 0 && depth + 1 < jb->target_depth && !jb->ending){
+		jb->concealed++;
+		return JITTER_CONCEAL;
+	}
+	
+	// Too much buffered for a while, skip a frame
+	jb->ticks_above_target = (depth > jb->target_depth + 2) ? jb->ticks_above_target + 1 : 0;
+	if (jb->ticks_above_target >= JITTER_SHRINK_TICKS){
+		jb->slots[jb->next_seq & (JITTER_SLOTS - 1)].filled = false;
+		jb->next_seq++;
+		jb->skipped++;
+		jb->ticks_above_target = 0;
+	}
+	
+	jitter_slot_p current = &jb->slots[jb->next_seq & (JITTER_SLOTS - 1)];
+	if (current->filled && current->seq == jb->next_seq){
+		current->filled = false;
+		jb->next_seq++;
+		jb->concealed_in_row = 0;
+		jb->played++;
+		jb->interval_played++;
+		*slot = current;
+		return JITTER_PACKET;
+	}
+	
+	// The frame is missing. If nothing newer arrived either the speaker might have stopped, after
+	// a few concealed frames we stop playing until the next packet.
+	if (depth == 0 && ++jb->concealed_in_row > JITTER_MAX_CONCEAL){
+		jitter_reset(jb);
+		return JITTER_NOTHING;
+	}
+	
+	jb->interval_missing++;
+	jitter_slot_p following = &jb->slots[(jb->next_seq + 1) & (JITTER_SLOTS - 1)];
+	if (following->filled && following->seq == (uint16_t)(jb->next_seq + 1)){
+		jb->next_seq++;
+		jb->recovered++;
+		*slot = following;
+		return JITTER_FEC;
+	}
+	
+	jb->next_seq++;
+	jb->concealed++;
+	return JITTER_CONCEAL;
+}
+
+
+//
+// Speakers
+//
+// Every remote user gets its own decoder and jitter buffer. Opus predicts from previous frames so
+// feeding packets of different users into one decoder corrupts its state. All speakers are
+// allocated as one pool at startup so a join doesn't allocate anything. The playout timer takes one
+// frame of every speaker and mixes them into one output frame.
+//
+
+typedef struct speaker_s speaker_t, *speaker_p;
+struct speaker_s {
+	speaker_p next_free;
+	bool active;
+	uint8_t user;
+	OpusDecoder *dec;
+	jitter_buffer_t jitter;
+};
+
+speaker_p speaker_pool = NULL;
+speaker_p speaker_free_list = NULL;
+speaker_p speakers[256];  // indexed by user id, NULL if that user has no decoder
+int16_t *speaker_frame = NULL;  // decode buffer for mixing
+OpusRepacketizer *speaker_repacketizer = NULL;  // splits packets with several frames
+double speaker_last_report = 0;
+double speaker_last_loss_report = 0;
+
+void speaker_pool_init(){
+	size_t decoder_size = opus_decoder_get_size(opts.channel_count);
+	uint8_t *decoder_memory = malloc(opts.max_speakers * decoder_size);
+	speaker_frame = malloc(opts.frame_size);
+	speaker_repacketizer = opus_repacketizer_create();
+	
+	speaker_pool = calloc(opts.max_speakers, sizeof(speaker_t));
+	for(size_t i = 0; i < opts.max_speakers; i++){
+		speaker_p speaker = &speaker_pool[i];
+		speaker->dec = (OpusDecoder*)(decoder_memory + i * decoder_size);
+		speaker->next_free = speaker_free_list;
+		speaker_free_list = speaker;
+	}
+	
+	speaker_last_report = now_ms();
+}
+
+// Returns the speaker of the user, takes one from the pool if the user has none yet. Returns NULL
+// if the pool is empty.
+speaker_p speaker_get(uint8_t user){
+	if (speakers[user])
+		return speakers[user];
+	
+	speaker_p speaker = speaker_free_list;
+	if (speaker == NULL){
+		error("no decoder left for user %hhu, increase --max-speakers\n", user);
+		return NULL;
+	}
+	
+	int error_code = opus_decoder_init(speaker->dec, opts.sample_rate, opts.channel_count);
+	if (error_code != OPUS_OK){
+		error("opus_decoder_init error: %d\n", error_code);
+		return NULL;
+	}
+	
+	speaker_free_list = speaker->next_free;
+	speaker->next_free = NULL;
+	speaker->active = true;
+	speaker->user = user;
+	jitter_init(&speaker->jitter);
+	speakers[user] = speaker;
+	
+	return speaker;
+}
+
+void speaker_release(uint8_t user){
+	speaker_p speaker = speakers[user];
+	if (speaker == NULL)
+		return;
+	
+	speakers[user] = NULL;
+	speaker->active = false;
+	speaker->next_free = speaker_free_list;
+	speaker_free_list = speaker;
+}
+
+typedef void (*frame_sink_t)(uint16_t seq, int index, int count, const uint8_t *data, size_t len, void *context);
+
+// Depacketize stage: splits the payload of a DATA packet into its Opus frames and hands each one to
+// sink, frame index gets seq + index. Returns the number of frames or -1 if the packet is invalid.
+int packet_split_frames(uint16_t seq, const uint8_t *data, size_t len, frame_sink_t sink, void *context){
+	int frame_count = opus_packet_get_nb_frames(data, len);
+	if (frame_count <= 1){
+		sink(seq, 0, 1, data, len, context);
+		return 1;
+	}
+	
+	opus_repacketizer_init(speaker_repacketizer);
+	if ( opus_repacketizer_cat(speaker_repacketizer, data, len) != OPUS_OK )
+		return -1;
+	
+	uint8_t frame_data[JITTER_PACKET_MAX];
+	for(int i = 0; i < frame_count; i++){
+		int frame_len = opus_repacketizer_out_range(speaker_repacketizer, i, i + 1, frame_data, sizeof(frame_data));
+		if (frame_len > 0)
+			sink(seq + i, i, frame_count, frame_data, frame_len, context);
+	}
+	return frame_count;
+}
+
+typedef struct {
+	speaker_p speaker;
+	double arrival;
+} speaker_arrival_t;
+
+// The frames of a packet are put in with the arrival times they'd have if sent one by one, so only
+// the network jitter ends up in the jitter estimate.
+void speaker_put_frame(uint16_t seq, int index, int count, const uint8_t *data, size_t len, void *context){
+	speaker_arrival_t *arrival = context;
+	jitter_buffer_p jb = &arrival->speaker->jitter;
+	jb->packet_frames = count;
+	jb->received = arrival->arrival;
+	jitter_put(jb, seq, data, len, arrival->arrival - (count - 1 - index) * (opts.frame_duration / 10.0));
+}
+
+// Puts every frame of a received packet into the jitter buffer, seq is the one of the first frame
+void speaker_put_packet(speaker_p speaker, uint16_t seq, const uint8_t *data, size_t len, double arrival){
+	speaker_arrival_t context = { speaker, arrival };
+	if ( packet_split_frames(seq, data, len, speaker_put_frame, &context) < 0 )
+		error("invalid packet from user %hhu with %d frames\n", speaker->user, opus_packet_get_nb_frames(data, len));
+}
+
+// Decodes one frame into frame, data NULL conceals a lost frame (Opus PLC). With decode_fec the
+// frame before data is recovered from its FEC data. Returns false on errors.
+bool speaker_decode(speaker_p speaker, const uint8_t *data, size_t len, int16_t *frame, int decode_fec){
+	int decoded_samples = opus_decode(speaker->dec, data, len, frame, opts.frame_samples_per_channel, decode_fec);
+	if (decoded_samples < 0){
+		error("opus_decode error for user %hhu: %d\n", speaker->user, decoded_samples);
+		return false;
+	}
+	
+	if ((size_t)decoded_samples < opts.frame_samples_per_channel)
+		memset(frame + decoded_samples * opts.channel_count, 0, opts.frame_size - decoded_samples * opts.channel_count * sizeof(int16_t));
+	return true;
+}
+
+bool speaker_conceal_loss(speaker_p speaker, int16_t *frame){
+	return speaker_decode(speaker, NULL, 0, frame, 0);
+}
+
+// Plays the next frame of every speaker and mixes them into out_frame. Returns false if nobody had
+// anything.
+bool speakers_mix(int16_t *out_frame){
+	size_t sample_count = opts.frame_size / sizeof(int16_t);
+	bool empty = true;
+	
+	for(size_t i = 0; i < opts.max_speakers; i++){
+		speaker_p speaker = &speaker_pool[i];
+		if (!speaker->active)
+			continue;
+		
+		// The first speaker is decoded right into the output frame
+		int16_t *frame = empty ? out_frame : speaker_frame;
+		jitter_slot_p slot = NULL;
+		bool decoded = false;
+		jitter_action_t action = jitter_get(&speaker->jitter, &slot);
+		if (action == JITTER_NOTHING)
+			continue;
+		
+		uint64_t start = now_ns();
+		switch(action){
+			case JITTER_NOTHING:
+				break;
+			case JITTER_PACKET:
+				latency_add(&telemetry.stages[LATENCY_BUFFER], (start / 1000000.0 - slot->received) * 1000);
+				decoded = speaker_decode(speaker, slot->data, slot->len, frame, 0);
+				break;
+			case JITTER_FEC:
+				decoded = speaker_decode(speaker, slot->data, slot->len, frame, 1);
+				break;
+			case JITTER_CONCEAL:
+				decoded = speaker_conceal_loss(speaker, frame);
+				break;
+		}
+		telemetry_add(LATENCY_DECODE, start, now_ns());
+		
+		if (!decoded)
+			continue;
+		if (!empty)
+			mix_add(out_frame, frame, sample_count);
+		empty = false;
+	}
+	
+	return !empty;
+}
+
+void speakers_report(){
+	double now = now_ms();
+	if (now - speaker_last_report < JITTER_REPORT_INTERVAL * 1000)
+		return;
+	speaker_last_report = now;
+	
+	if (opts.input_fd == -1)
+		notice("capture ring: %zu of %zu frames, %zu overruns\n", ring_fill(&capture_ring), capture_ring.frame_count, capture_ring.overruns);
+	if (opts.output_fd == -1 && opts.audio_backend == AUDIO_THREADS)
+		notice("playback ring: %zu of %zu frames, %zu overruns\n", ring_fill(&playback_ring), playback_ring.frame_count, playback_ring.overruns);
+	if (pulse_async.mainloop)
+		pulse_async_report();
+	if (opts.vad)
+		notice("vad: %s, %zu voiced, %zu silent frames, noise %.1f dBFS\n", vad.talking ? "talking" : "silent",
+			vad.voiced_frames, vad.silent_frames, vad.noise_level);
+	
+	for(size_t i = 0; i < opts.max_speakers; i++){
+		speaker_p speaker = &speaker_pool[i];
+		if (!speaker->active)
+			continue;
+		
+		jitter_buffer_p jb = &speaker->jitter;
+		notice("user %hhu: depth %zu frames (target %zu), jitter %.2f ms, played %zu, recovered %zu, concealed %zu, late %zu, skipped %zu\n",
+			speaker->user, jitter_depth(jb), jb->target_depth, jb->jitter, jb->played, jb->recovered, jb->concealed, jb->late, jb->skipped);
+	}
+	
+	telemetry_report();
+}
+
+// Tells every speaker how well we receive it so it can adapt its encoder
+void speakers_send_reports(int client_fd, const struct sockaddr_in *server_addr){
+	double now = now_ms();
+	if (now - speaker_last_loss_report < REPORT_INTERVAL)
+		return;
+	speaker_last_loss_report = now;
+	
+	for(size_t i = 0; i < opts.max_speakers; i++){
+		speaker_p speaker = &speaker_pool[i];
+		jitter_buffer_p jb = &speaker->jitter;
+		size_t frames = jb->interval_played + jb->interval_missing;
+		if (!speaker->active || frames == 0)
+			continue;
+		
+		report_t report = {
+			.loss_percent = (jb->interval_missing * 100 + frames - 1) / frames,
+			.jitter = (jb->jitter * 10 < UINT16_MAX) ? jb->jitter * 10 : UINT16_MAX
+		};
+		jb->interval_played = jb->interval_missing = 0;
+		
+		uint8_t packet[PACKET_HEADER_MAX + 1 + VARINT_MAX];
+		size_t len = packet_pack_header(packet, PACKET_REPORT, speaker->user, 0);
+		len += report_pack(packet + len, &report);
+		if ( sendto(client_fd, packet, len, 0, (const struct sockaddr *)server_addr, sizeof(*server_addr)) == -1 )
+			perror("sendto");
+	}
+}
+
+
+//
+// Encoder adaptation
+//
+// Receivers report their loss about once per second. We adapt to the worst receiver: the loss
+// percentage is passed on to Opus, in-band FEC is switched on when there is loss and off again
+// when all links are clean. The bitrate backs off multiplicatively on heavy loss and recovers
+// slowly while the loss is low.
+//
+
+// Reports older than this are ignored, in ms
+#define ADAPT_REPORT_TIMEOUT  3000
+// Loss in percent to turn FEC on, it's turned off again at 0%
+#define ADAPT_FEC_LOSS  2
+// Loss in percent above which the bitrate is reduced
+#define ADAPT_HIGH_LOSS  10
+#define ADAPT_MIN_BITRATE  12000
+#define ADAPT_BITRATE_STEP  4000
+// Min time between two bitrate changes, in ms
+#define ADAPT_BITRATE_INTERVAL  1000
+
+typedef struct {
+	double received_at;  // in ms, 0 if that receiver never reported
+	uint8_t loss_percent;
+	uint16_t jitter;
+} receiver_report_t;
+
+receiver_report_t receiver_reports[256];  // indexed by the user id of the receiver
+int32_t encoder_bitrate = 0;
+uint8_t encoder_loss_percent = 0;
+bool encoder_fec = false;
+double encoder_last_bitrate_change = 0;
+
+void encoder_adapt_init(OpusEncoder *enc){
+	encoder_bitrate = opts.max_bitrate;
+	opus_encoder_ctl(enc, OPUS_SET_BITRATE(encoder_bitrate));
+	opus_encoder_ctl(enc, OPUS_SET_INBAND_FEC(0));
+	opus_encoder_ctl(enc, OPUS_SET_PACKET_LOSS_PERC(0));
+	// Opus stops producing frames in silence the VAD doesn't catch (1 byte packets we don't send)
+	opus_encoder_ctl(enc, OPUS_SET_DTX(1));
+}
+
+void encoder_adapt(OpusEncoder *enc, uint8_t receiver, report_p report){
+	double now = now_ms();
+	receiver_reports[receiver] = (receiver_report_t){ now, report->loss_percent, report->jitter };
+	
+	uint8_t worst_loss = 0;
+	for(size_t i = 0; i < 256; i++){
+		receiver_report_t *r = &receiver_reports[i];
+		if (r->received_at > 0 && now - r->received_at < ADAPT_REPORT_TIMEOUT && r->loss_percent > worst_loss)
+			worst_loss = r->loss_percent;
+	}
+	if (worst_loss > 100)
+		worst_loss = 100;
+	
+	if (worst_loss != encoder_loss_percent){
+		opus_encoder_ctl(enc, OPUS_SET_PACKET_LOSS_PERC(worst_loss));
+		encoder_loss_percent = worst_loss;
+	}
+	
+	bool fec = encoder_fec;
+	if (worst_loss >= ADAPT_FEC_LOSS)
+		fec = true;
+	else if (worst_loss == 0)
+		fec = false;
+	if (fec != encoder_fec){
+		opus_encoder_ctl(enc, OPUS_SET_INBAND_FEC(fec ? 1 : 0));
+		encoder_fec = fec;
+		notice("in-band FEC %s, worst loss %hhu%%\n", fec ? "on" : "off", worst_loss);
+	}
+	
+	if (now - encoder_last_bitrate_change >= ADAPT_BITRATE_INTERVAL){
+		int32_t bitrate = encoder_bitrate;
+		if (worst_loss > ADAPT_HIGH_LOSS)
+			bitrate = bitrate * 3 / 4;
+		else if (worst_loss < ADAPT_FEC_LOSS)
+			bitrate += ADAPT_BITRATE_STEP;
+		
+		if (bitrate < ADAPT_MIN_BITRATE)
+			bitrate = ADAPT_MIN_BITRATE;
+		if (bitrate > (int32_t)opts.max_bitrate)
+			bitrate = opts.max_bitrate;
+		
+		if (bitrate != encoder_bitrate){
+			opus_encoder_ctl(enc, OPUS_SET_BITRATE(bitrate));
+			encoder_bitrate = bitrate;
+			encoder_last_bitrate_change = now;
+			notice("bitrate %d bit/s, worst loss %hhu%%\n", bitrate, worst_loss);
+		}
+	}
+}
+
+
+//
+// Signal handling stuff
+//
+bool quit = false;
+
+void sigint_handler(int signum){
+	quit = true;
+}
+
+void establish_signal_handlers(){
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = sigint_handler;
+	action.sa_flags = SA_RESTART;
+	if ( sigaction(SIGINT, &action, NULL) == -1 )
+		perror("sigaction() failed");
+}
+
+void log_print(const char *format, ...){
+	va_list args;
+	va_start(args, format);
+	vfprintf(stderr, format, args);
+	va_end(args);
+}
+
+
+//
+// Codec pipeline
+//
+// Sending goes through four stages: process (the capture DSP chain, see dsp.h), analyze (VAD on the
+// level the DSP meter measured), encode and packetize (header, frame packing). Received packets are
+// depacketized (header, splitting packed frames) into the jitter buffer and decoded at playout, see
+// the speakers. The sender hands finished packets to a sink, the live client sends them to the
+// server and the pipeline benchmark feeds them right back into the receiving stages. With stats set
+// the sender times each of its stages.
+//
+// With --frames-per-packet the encoded frames are collected and packed into one Opus packet with
+// the repacketizer. That cuts the packet rate (and the per packet overhead of the server) at the
+// cost of latency. The sequence number still counts frames, a packet carries the number of its
+// first frame. A packet is sent early if the encoder goes silent (DTX or VAD) or changes its mode
+// so the frames can't be packed together.
+//
+
+typedef enum {
+	STAGE_PROCESS, STAGE_ANALYZE, STAGE_ENCODE, STAGE_PACKETIZE, STAGE_DEPACKETIZE, STAGE_DECODE, STAGE_COUNT
+} pipeline_stage_t;
+
+const char *pipeline_stage_names[STAGE_COUNT] = { "process", "analyze", "encode", "packetize", "depacketize", "decode" };
+
+typedef struct {
+	uint64_t ns[STAGE_COUNT];
+	size_t frames[STAGE_COUNT];
+} pipeline_stats_t, *pipeline_stats_p;
+
+// Adds the time since *start to the stage and restarts the clock, does nothing without stats
+void pipeline_stage_done(pipeline_stats_p stats, pipeline_stage_t stage, uint64_t *start){
+	if (stats == NULL)
+		return;
+	
+	uint64_t now = now_ns();
+	stats->ns[stage] += now - *start;
+	stats->frames[stage]++;
+	*start = now;
+}
+
+typedef void (*packet_sink_t)(const uint8_t *packet, size_t len, void *context);
+
+typedef struct {
+	OpusEncoder *enc;
+	uint8_t user;
+	uint16_t seq;  // of the next frame
+	packet_sink_t sink;
+	void *sink_context;
+	pipeline_stats_p stats;  // NULL to skip the timing
+	
+	// Frame packing
+	OpusRepacketizer *repacketizer;
+	uint8_t *frames;  // frames_per_packet encoded frames, the repacketizer points into them
+	size_t frame_max, count;
+	uint16_t first_seq;
+	uint8_t level;  // of the loudest frame
+	uint8_t packet[PACKET_MAX];
+	int16_t *processed;  // the frame after the DSP chain
+	bool dtx;  // the encoder is in DTX and the SILENCE packet for it went out
+} sender_t, *sender_p;
+
+// Capture processing of the sender, set up for the current format with dsp_init()
+dsp_t dsp;
+
+void sender_init(sender_p sender, OpusEncoder *enc, uint8_t user, packet_sink_t sink, void *sink_context){
+	*sender = (sender_t){ .enc = enc, .user = user, .sink = sink, .sink_context = sink_context };
+	sender->repacketizer = opus_repacketizer_create();
+	// Leave room for the frame lengths the packed packet needs
+	sender->frame_max = (PACKET_MAX - PACKET_HEADER_MAX - 2) / opts.frames_per_packet - 2;
+	sender->frames = malloc(opts.frames_per_packet * sender->frame_max);
+	sender->processed = malloc(opts.frame_size);
+	opus_repacketizer_init(sender->repacketizer);
+}
+
+void sender_destroy(sender_p sender){
+	opus_repacketizer_destroy(sender->repacketizer);
+	free(sender->frames);
+	free(sender->processed);
+}
+
+// Packs the collected frames into sender->packet and returns its size, 0 if there is nothing
+size_t sender_pack(sender_p sender){
+	if (sender->count == 0)
+		return 0;
+	
+	size_t header_len = packet_pack_data_header(sender->packet, sender->user, sender->first_seq, sender->level);
+	opus_int32 len = opus_repacketizer_out(sender->repacketizer, sender->packet + header_len, sizeof(sender->packet) - header_len);
+	sender->count = 0;
+	opus_repacketizer_init(sender->repacketizer);
+	
+	if (len < 0){
+		log_print("opus_repacketizer_out error: %s\n", opus_strerror(len));
+		return 0;
+	}
+	return header_len + len;
+}
+
+// Sends the packed frames as one packet
+void sender_flush(sender_p sender){
+	size_t len = sender_pack(sender);
+	if (len > 0)
+		sender->sink(sender->packet, len, sender->sink_context);
+}
+
+// Tells the receivers that the talkspurt ended, all frames before the current sequence number were
+// sent. They stop playing instead of concealing the pause and don't take it for network jitter.
+void sender_send_silence(sender_p sender, double noise_dbfs){
+	uint8_t packet[PACKET_HEADER_MAX + 1];
+	size_t len = packet_pack_header(packet, PACKET_SILENCE, sender->user, sender->seq);
+	packet[len++] = (uint8_t)(int8_t)((noise_dbfs > -127) ? noise_dbfs : -127);
+	sender->sink(packet, len, sender->sink_context);
+}
+
+// Process stage: runs the frame through the DSP chain and returns the frame to encode and its level
+// in dBFS. The level is taken before the AGC and the gate, like the gate's own decision. Without
+// the DSP the frame is only measured.
+const int16_t* sender_process(sender_p sender, const int16_t *frame, double *level_dbfs){
+	if (!opts.dsp){
+		*level_dbfs = mix_level_dbfs(frame, opts.frame_samples_per_channel * opts.channel_count);
+		return frame;
+	}
+	
+	dsp_meter_t meter;
+	dsp_process(&dsp, frame, sender->processed, &meter);
+	*level_dbfs = meter.rms_dbfs;
+	return sender->processed;
+}
+
+// Analyze stage: takes the level for the header and runs the VAD. Returns false if the frame isn't
+// sent, send_silence is set when a SILENCE packet is due.
+bool sender_analyze(double level_dbfs, uint8_t *level, bool *send_silence){
+	*level = packet_level_from_dbfs(level_dbfs);
+	return vad_update(level_dbfs, send_silence);
+}
+
+// Runs one frame through the sending stages. Frames dropped by the VAD or Opus DTX don't use a
+// sequence number, so both end the talkspurt with a SILENCE packet. Otherwise the receivers would
+// see the pause as a late packet. In DTX Opus still sends a comfort noise frame every 400 ms, each
+// of them is a talkspurt of its own.
+void sender_push(sender_p sender, const int16_t *frame){
+	uint64_t start = sender->stats ? now_ns() : 0;
+	
+	uint8_t level = PACKET_LEVEL_SILENT;
+	bool send_silence = false;
+	double level_dbfs;
+	frame = sender_process(sender, frame, &level_dbfs);
+	pipeline_stage_done(sender->stats, STAGE_PROCESS, &start);
+	bool voice = sender_analyze(level_dbfs, &level, &send_silence);
+	pipeline_stage_done(sender->stats, STAGE_ANALYZE, &start);
+	if (!voice){
+		sender_flush(sender);
+		if (send_silence && !sender->dtx)
+			sender_send_silence(sender, vad.noise_level);
+		sender->dtx = false;
+		return;
+	}
+	
+	if (opts.frames_per_packet == 1){
+		uint8_t packet[PACKET_MAX];
+		size_t header_len = packet_pack_data_header(packet, sender->user, sender->seq, level);
+		int32_t len = opus_encode(sender->enc, frame, opts.frame_samples_per_channel, packet + header_len, sizeof(packet) - header_len);
+		pipeline_stage_done(sender->stats, STAGE_ENCODE, &start);
+		if (len < 0){
+			log_print("opus_encode error!\n");
+			return;
+		} else if (len == 1) {
+			if (!sender->dtx)
+				sender_send_silence(sender, level_dbfs);
+			sender->dtx = true;
+			return;
+		}
+		
+		sender->dtx = false;
+		sender->seq++;
+		pipeline_stage_done(sender->stats, STAGE_PACKETIZE, &start);
+		sender->sink(packet, header_len + len, sender->sink_context);
+		return;
+	}
+	
+	uint8_t *data = sender->frames + sender->count * sender->frame_max;
+	int32_t len = opus_encode(sender->enc, frame, opts.frame_samples_per_channel, data, sender->frame_max);
+	pipeline_stage_done(sender->stats, STAGE_ENCODE, &start);
+	if (len < 0){
+		log_print("opus_encode error!\n");
+		return;
+	} else if (len == 1) {
+		// Don't hold back the frames before the silence
+		sender_flush(sender);
+		if (!sender->dtx)
+			sender_send_silence(sender, level_dbfs);
+		sender->dtx = true;
+		return;
+	}
+	
+	sender->dtx = false;
+	if ( opus_repacketizer_cat(sender->repacketizer, data, len) != OPUS_OK ){
+		// Different mode than the frames before, send them and start a new packet. The frame has to
+		// be moved to the start since the repacketizer keeps pointers into the frame buffer.
+		sender_flush(sender);
+		memmove(sender->frames, data, len);
+		data = sender->frames;
+		opus_repacketizer_cat(sender->repacketizer, data, len);
+	}
+	
+	if (sender->count == 0){
+		sender->first_seq = sender->seq;
+		sender->level = level;
+	} else if (level < sender->level) {
+		sender->level = level;
+	}
+	sender->seq++;
+	sender->count++;
+	size_t packet_len = (sender->count == opts.frames_per_packet) ? sender_pack(sender) : 0;
+	pipeline_stage_done(sender->stats, STAGE_PACKETIZE, &start);
+	if (packet_len > 0)
+		sender->sink(sender->packet, packet_len, sender->sink_context);
+}
+
+// Max packets collected while batching, more are sent in several sendmmsg() calls
+#define SEND_BATCH  16
+
+// Packet sink of the live client. While batching the packets are only collected and leave together
+// with one sendmmsg() in server_link_flush().
+typedef struct {
+	int fd;
+	struct sockaddr_in addr;
+	
+	bool batching;
+	size_t count;
+	uint64_t queued_at[SEND_BATCH];
+	uint8_t packets[SEND_BATCH][PACKET_MAX];
+	struct iovec iovecs[SEND_BATCH];
+	struct mmsghdr msgs[SEND_BATCH];
+	
+	// Since the last report
+	size_t sends, sent_packets, sent_bytes;
+} server_link_t, *server_link_p;
+
+void server_link_flush(server_link_p link){
+	if (link->count == 0)
+		return;
+	
+	size_t sent = 0;
+	while (sent < link->count){
+		int count = sendmmsg(link->fd, link->msgs + sent, link->count - sent, 0);
+		if (count == -1){
+			perror("sendmmsg");
+			break;
+		}
+		sent += count;
+		link->sends++;
+	}
+	
+	uint64_t end = now_ns();
+	for(size_t i = 0; i < sent; i++){
+		telemetry_add(LATENCY_SEND, link->queued_at[i], end);
+		link->sent_bytes += link->msgs[i].msg_len;
+	}
+	link->sent_packets += sent;
+	link->count = 0;
+}
+
+void send_packet(const uint8_t *packet, size_t len, void *context){
+	server_link_p link = context;
+	uint64_t start = now_ns();
+	packet_header_t header;
+	if (telemetry.packet_started && packet_unpack_header(packet, len, &header) && header.type == PACKET_DATA){
+		telemetry_add(LATENCY_ENCODE, telemetry.packet_started, start);
+		telemetry.packet_started = 0;
+	}
+	
+	if (link->batching){
+		if (link->count == SEND_BATCH)
+			server_link_flush(link);
+		size_t i = link->count++;
+		memcpy(link->packets[i], packet, len);
+		link->iovecs[i] = (struct iovec){ link->packets[i], len };
+		link->msgs[i].msg_hdr = (struct msghdr){
+			.msg_name = &link->addr, .msg_namelen = sizeof(link->addr),
+			.msg_iov = &link->iovecs[i], .msg_iovlen = 1
+		};
+		link->queued_at[i] = start;
+		return;
+	}
+	
+	ssize_t bytes_send = sendto(link->fd, packet, len, 0, (const struct sockaddr *)&link->addr, sizeof(link->addr));
+	if (bytes_send < 0)
+		perror("sendto");
+	telemetry_add(LATENCY_SEND, start, now_ns());
+	
+	link->sends++;
+	if (bytes_send >= 0){
+		link->sent_packets++;
+		link->sent_bytes += bytes_send;
+	}
+}
+
+void server_link_report(server_link_p link, double seconds){
+	notice("send: %.0f packets/s, %.0f bytes/s, %.2f packets per send call\n",
+		link->sent_packets / seconds, link->sent_bytes / seconds,
+		link->sends ? (double)link->sent_packets / link->sends : 0.0);
+	link->sends = link->sent_packets = link->sent_bytes = 0;
+}
+
+// Runs a frame of the live client through the sender, remembers when the packet it goes into was
+// started for the encode latency
+void push_frame(sender_p sender, const int16_t *frame, uint64_t taken){
+	if (telemetry.packet_started == 0)
+		telemetry.packet_started = taken;
+	sender_push(sender, frame);
+	if (sender->count == 0)
+		telemetry.packet_started = 0;
+}
+
+
+// Handles a packet from the server, DATA packets go into the jitter buffer of their speaker
+void receive_packet(OpusEncoder *enc, const uint8_t *packet, size_t packet_len){
+	packet_header_t header;
+	size_t header_len = packet_unpack_header(packet, packet_len, &header);
+	if (header_len == 0){
+		log_print("invalid packet, %zu bytes\n", packet_len);
+		return;
+	}
+	const uint8_t *data = packet + header_len;
+	size_t data_len = packet_len - header_len;
+	//log_print("received packet type %hhu, %zu data bytes\n", header.type, data_len);
+	
+	report_t report;
+	if (header.type == PACKET_DATA) {
+		speaker_p speaker = speaker_get(header.user);
+		if (speaker)
+			speaker_put_packet(speaker, header.seq, data, data_len, now_ms());
+	} else if (header.type == PACKET_JOIN) {
+		log_print("user %hhu joined\n", header.user);
+		speaker_p speaker = speaker_get(header.user);
+		if (speaker)
+			jitter_init(&speaker->jitter);
+	} else if (header.type == PACKET_SILENCE) {
+		speaker_p speaker = speakers[header.user];
+		if (speaker)
+			jitter_end(&speaker->jitter, header.seq);
+		log_print("user %hhu silent, noise %hhd dBFS\n", header.user, (int8_t)(data_len > 0 ? data[0] : -127));
+	} else if (header.type == PACKET_BYE) {
+		log_print("user %hhu disconnected\n", header.user);
+		speaker_release(header.user);
+	} else if (header.type == PACKET_REPORT && report_unpack(data, data_len, &report)) {
+		encoder_adapt(enc, header.user, &report);
+	} else if (header.type == PACKET_PONG) {
+		telemetry_pong(data, data_len);
+	} else {
+		log_print("unknown packet, type %hhu, %zu bytes data\n", header.type, data_len);
+	}
+}
+
+//
+// Input framing
+//
+// Pipes deliver whatever the writer wrote, parec for example hands over its whole latency worth of
+// samples at once. The framer is a byte ring that takes reads of any size and hands out complete
+// frames. The capacity is a multiple of the frame size and frames are only taken whole, so a frame
+// always starts at a multiple of the frame size and never wraps around the end. The event loop
+// reads until the pipe is empty and encodes every complete frame in the same pass, so nothing queues
+// up in front of the encoder and the input latency is what the writer chose, never more.
+//
+
+// Ring capacity in frames, a read fills at most that much
+#define FRAMER_FRAMES  32
+
+typedef struct {
+	uint8_t *buffer;  // capacity bytes, FRAMER_FRAMES whole frames
+	size_t capacity, frame_size;
+	size_t read, write;  // byte positions, they only grow
+	
+	// Since the last report, the backlog is the number of frames encoded in one pass
+	size_t reads, bytes, passes, max_backlog;
+} framer_t, *framer_p;
+
+void framer_init(framer_p framer, size_t frame_size){
+	*framer = (framer_t){ .capacity = frame_size * FRAMER_FRAMES, .frame_size = frame_size };
+	framer->buffer = malloc(framer->capacity);
+}
+
+void framer_destroy(framer_p framer){
+	free(framer->buffer);
+}
+
+// Reads from the non-blocking fd until it's empty or the ring is full, at most limit bytes. Returns
+// false at the end of the input.
+bool framer_fill(framer_p framer, int fd, size_t limit){
+	while (limit > 0){
+		size_t free_bytes = framer->capacity - (framer->write - framer->read);
+		size_t offset = framer->write % framer->capacity;
+		size_t chunk = framer->capacity - offset;
+		if (chunk > free_bytes)
+			chunk = free_bytes;
+		if (chunk > limit)
+			chunk = limit;
+		if (chunk == 0)
+			return true;
+		
+		ssize_t bytes_read = read(fd, framer->buffer + offset, chunk);
+		if (bytes_read == 0)
+			return false;
+		if (bytes_read == -1){
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				perror("read");
+			return true;
+		}
+		
+		framer->write += bytes_read;
+		framer->reads++;
+		framer->bytes += bytes_read;
+		limit -= bytes_read;
+	}
+	
+	return true;
+}
+
+size_t framer_frames(framer_p framer){
+	return (framer->write - framer->read) / framer->frame_size;
+}
+
+// Returns the next complete frame or NULL, it stays valid until the next framer_fill()
+int16_t* framer_take(framer_p framer){
+	if (framer_frames(framer) == 0)
+		return NULL;
+	
+	size_t offset = framer->read % framer->capacity;
+	framer->read += framer->frame_size;
+	return (int16_t*)(framer->buffer + offset);
+}
+
+void framer_report(framer_p framer, double seconds){
+	if (framer->passes == 0)
+		return;
+	
+	notice("input: %.0f reads/s, %.0f bytes per read, max backlog %zu frames (%.1f ms)\n",
+		framer->reads / seconds, framer->reads ? (double)framer->bytes / framer->reads : 0.0,
+		framer->max_backlog, framer->max_backlog * opts.frame_duration / 10.0);
+	framer->reads = framer->bytes = framer->passes = framer->max_backlog = 0;
+}
+
+
+//
+// Event loop
+//
+// The main loop waits on one epoll set that lives for the whole session: the socket, the frame
+// timer and, with the audio threads, the eventfd of the capture ring. With the async backend Pulse
+// Audio polls the epoll fd along with its own fds and we collect the events afterwards. Every socket
+// wakeup drains all queued datagrams with recvmmsg(), so a burst of packets from several talkers
+// costs one trip through the loop. Recorded frames are encoded as soon as the device delivers them
+// (the device clock is the frame clock there), same for pipes: whatever the writer delivered is
+// framed and every complete frame is encoded in that pass. The packets of a pass leave together
+// with one sendmmsg(). Regular files have no clock, they're read one frame per tick of the frame
+// timer. Playout runs on the same timer.
+//
+
+// Datagrams per recvmmsg() call
+#define RECV_BATCH  16
+
+typedef enum { EVENT_SOCKET, EVENT_CAPTURE, EVENT_FRAME_TIMER, EVENT_INPUT } event_source_t;
+
+typedef struct {
+	uint8_t packets[RECV_BATCH][PACKET_MAX];
+	struct iovec iovecs[RECV_BATCH];
+	struct mmsghdr msgs[RECV_BATCH];
+	
+	// Since the last report
+	size_t wakeups, socket_wakeups, datagrams;
+	double last_report;
+} event_loop_t;
+
+event_loop_t event_loop = { 0 };
+
+void event_loop_watch(int epoll_fd, int fd, event_source_t source){
+	struct epoll_event event = { .events = EPOLLIN, .data.u32 = source };
+	if ( epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1 )
+		pdie(3, "epoll_ctl");
+}
+
+// Waits for events like epoll_wait(), runs one Pulse Audio main loop iteration with the async backend
+int event_loop_wait(int epoll_fd, struct epoll_event *events, int max_events, int timeout){
+	int count;
+	if (pulse_async.mainloop == NULL){
+		count = epoll_wait(epoll_fd, events, max_events, timeout);
+	} else {
+		struct pollfd pollfd = { epoll_fd, POLLIN };
+		count = audio_poll(&pollfd, 1, timeout);
+		if (count > 0)
+			count = epoll_wait(epoll_fd, events, max_events, 0);
+	}
+	
+	if (count >= 0)
+		event_loop.wakeups++;
+	return count;
+}
+
+// Receives and handles everything that's queued on the (non-blocking) socket
+void event_loop_receive(int client_fd, OpusEncoder *enc){
+	event_loop.socket_wakeups++;
+	int count;
+	do {
+		for(size_t i = 0; i < RECV_BATCH; i++){
+			event_loop.iovecs[i] = (struct iovec){ event_loop.packets[i], PACKET_MAX };
+			event_loop.msgs[i].msg_hdr = (struct msghdr){ .msg_iov = &event_loop.iovecs[i], .msg_iovlen = 1 };
+		}
+		
+		count = recvmmsg(client_fd, event_loop.msgs, RECV_BATCH, MSG_DONTWAIT, NULL);
+		if (count == -1){
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				perror("recvmmsg");
+			return;
+		}
+		event_loop.datagrams += count;
+		
+		for(int i = 0; i < count; i++){
+			// Truncated packets are left out, the jitter buffer conceals them
+			if (event_loop.msgs[i].msg_hdr.msg_flags & MSG_TRUNC){
+				log_print("truncated packet, got more than %d bytes\n", PACKET_MAX);
+				continue;
+			}
+			receive_packet(enc, event_loop.packets[i], event_loop.msgs[i].msg_len);
+		}
+	} while (count == RECV_BATCH);
+}
+
+void event_loop_report(framer_p framer, server_link_p link){
+	double now = now_ms();
+	if (event_loop.last_report == 0)
+		event_loop.last_report = now;
+	if (now - event_loop.last_report < JITTER_REPORT_INTERVAL * 1000)
+		return;
+	
+	double seconds = (now - event_loop.last_report) / 1000;
+	notice("loop: %.0f wakeups/s, %.0f datagrams/s, %.2f datagrams per socket wakeup\n",
+		event_loop.wakeups / seconds, event_loop.datagrams / seconds,
+		event_loop.socket_wakeups ? (double)event_loop.datagrams / event_loop.socket_wakeups : 0.0);
+	framer_report(framer, seconds);
+	server_link_report(link, seconds);
+	event_loop.wakeups = event_loop.socket_wakeups = event_loop.datagrams = 0;
+	event_loop.last_report = now;
+}
+
+
+//
+// Pipeline benchmark
+//
+// --bench-pipeline runs a PCM file through the codec pipeline at full speed, once for every sample
+// rate, channel count and frame duration the client supports. The file is read as raw s16 samples in
+// each of these formats, it's only there to give the encoder something realistic to chew on. There
+// is no network and no audio device involved, the packets of the sender go right into the
+// depacketize and decode stages.
+//
+// Before that it checks that a pause doesn't end up in the jitter estimate: a tone, digital silence
+// long enough for Opus DTX and the tone again go through the sender into a jitter buffer that gets
+// every packet exactly on time and plays out one frame per tick. The jitter has to stay below
+// BENCH_DTX_MAX_JITTER, it exits with 1 if it doesn't or if the encoder never went into DTX.
+//
+// The client_bench build (make client_bench, -DBENCH_ALLOC_COUNT) also counts allocations so we see
+// if anything allocates per frame. It's linked with -Wl,--wrap for malloc, calloc, realloc,
+// posix_memalign, aligned_alloc, strdup and strndup, which catches the calls of the client and of the
+// static Opus library but not the ones libc makes internally. free() isn't counted, we only look for
+// allocations. The plain client leaves the allocator alone and prints n/a.
+//
+
+// Most of the file we read, 16 MiB
+#define BENCH_PCM_MAX  (16 * 1024 * 1024)
+// Frames in one packet at most, 120 ms of 2.5 ms frames
+#define BENCH_PACKET_FRAMES  48
+
+size_t alloc_count = 0;
+
+#ifdef BENCH_ALLOC_COUNT
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void *ptr, size_t size);
+int __real_posix_memalign(void **ptr, size_t alignment, size_t size);
+void* __real_aligned_alloc(size_t alignment, size_t size);
+char* __real_strdup(const char *s);
+char* __real_strndup(const char *s, size_t n);
+
+void* __wrap_malloc(size_t size){
+	__atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+	return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t count, size_t size){
+	__atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+	return __real_calloc(count, size);
+}
+
+void* __wrap_realloc(void *ptr, size_t size){
+	__atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+	return __real_realloc(ptr, size);
+}
+
+int __wrap_posix_memalign(void **ptr, size_t alignment, size_t size){
+	__atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+	return __real_posix_memalign(ptr, alignment, size);
+}
+
+void* __wrap_aligned_alloc(size_t alignment, size_t size){
+	__atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+	return __real_aligned_alloc(alignment, size);
+}
+
+char* __wrap_strdup(const char *s){
+	__atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+	return __real_strdup(s);
+}
+
+char* __wrap_strndup(const char *s, size_t n){
+	__atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+	return __real_strndup(s, n);
+}
+
+#endif
+
+// Prints an allocation count, or n/a if this build doesn't count them
+void bench_print_allocs(size_t count){
+#ifdef BENCH_ALLOC_COUNT
+	printf(" %5zu", count);
+#else
+	printf(" %5s", "n/a");
+#endif
+}
+
+typedef struct {
+	pipeline_stats_p stats;
+	speaker_t speaker;
+	int16_t *frame;
+	size_t packets, bytes;
+	
+	// Frames of the current packet
+	size_t frame_count;
+	size_t frame_lens[BENCH_PACKET_FRAMES];
+	uint8_t frames[BENCH_PACKET_FRAMES][JITTER_PACKET_MAX];
+} bench_receiver_t;
+
+void bench_collect_frame(uint16_t seq, int index, int count, const uint8_t *data, size_t len, void *context){
+	bench_receiver_t *receiver = context;
+	if (receiver->frame_count == BENCH_PACKET_FRAMES)
+		return;
+	
+	memcpy(receiver->frames[receiver->frame_count], data, len);
+	receiver->frame_lens[receiver->frame_count++] = len;
+}
+
+// Packet sink of the benchmark, depacketizes and decodes right away
+void bench_receive(const uint8_t *packet, size_t len, void *context){
+	bench_receiver_t *receiver = context;
+	receiver->packets++;
+	receiver->bytes += len;
+	
+	uint64_t start = now_ns();
+	packet_header_t header;
+	size_t header_len = packet_unpack_header(packet, len, &header);
+	if (header_len == 0 || header.type != PACKET_DATA)
+		return;
+	
+	receiver->frame_count = 0;
+	packet_split_frames(header.seq, packet + header_len, len - header_len, bench_collect_frame, receiver);
+	pipeline_stage_done(receiver->stats, STAGE_DEPACKETIZE, &start);
+	
+	for(size_t i = 0; i < receiver->frame_count; i++){
+		speaker_decode(&receiver->speaker, receiver->frames[i], receiver->frame_lens[i], receiver->frame, 0);
+		pipeline_stage_done(receiver->stats, STAGE_DECODE, &start);
+	}
+}
+
+// The pause check, 20 ms frames of a 440 Hz tone at -20 dBFS
+#define BENCH_DTX_TONE_MS  1000
+#define BENCH_DTX_PAUSE_MS  3000
+// In ms, the packets arrive on time so anything above is the pause
+#define BENCH_DTX_MAX_JITTER  1.0
+
+typedef struct {
+	speaker_t speaker;
+	double now;  // in ms
+	size_t silence_packets;
+} bench_dtx_receiver_t;
+
+// Packet sink of the pause check, feeds the jitter buffer like receive_packet() does
+void bench_dtx_receive(const uint8_t *packet, size_t len, void *context){
+	bench_dtx_receiver_t *receiver = context;
+	packet_header_t header;
+	size_t header_len = packet_unpack_header(packet, len, &header);
+	if (header_len == 0)
+		return;
+	
+	if (header.type == PACKET_DATA){
+		speaker_put_packet(&receiver->speaker, header.seq, packet + header_len, len - header_len, receiver->now);
+	} else if (header.type == PACKET_SILENCE) {
+		jitter_end(&receiver->speaker.jitter, header.seq);
+		receiver->silence_packets++;
+	}
+}
+
+void bench_pipeline_check_dtx(){
+	options_t saved_opts = opts;
+	opts.sample_rate = 48000;
+	opts.channel_count = 1;
+	opts.frame_duration = 200;
+	opts.frames_per_packet = 1;
+	opts.vad = false;
+	opts.dsp = false;
+	// Low enough for SILK, older Opus versions have DTX only there
+	opts.max_bitrate = 24000;
+	options_derive(&opts);
+	
+	int error_code = 0;
+	OpusEncoder *enc = opus_encoder_create(opts.sample_rate, opts.channel_count, OPUS_APPLICATION_VOIP, &error_code);
+	if (error_code != OPUS_OK)
+		die(1, "opus_encoder_create error: %s\n", opus_strerror(error_code));
+	encoder_adapt_init(enc);
+	
+	static bench_dtx_receiver_t receiver;
+	receiver = (bench_dtx_receiver_t){ 0 };
+	jitter_init(&receiver.speaker.jitter);
+	sender_t sender;
+	sender_init(&sender, enc, 0, bench_dtx_receive, &receiver);
+	
+	static int16_t frame[DSP_FRAME_MAX];
+	double frame_ms = opts.frame_duration / 10.0;
+	size_t tone_frames = BENCH_DTX_TONE_MS / frame_ms, pause_frames = BENCH_DTX_PAUSE_MS / frame_ms;
+	double amplitude = 32768 * pow(10, -20.0 / 20);
+	double jitter_before = 0, jitter_max = 0;
+	for(size_t n = 0; n < 2 * tone_frames + pause_frames; n++){
+		bool pause = (n >= tone_frames && n < tone_frames + pause_frames);
+		for(size_t i = 0; i < opts.frame_samples_per_channel; i++){
+			size_t t = n * opts.frame_samples_per_channel + i;
+			frame[i] = pause ? 0 : amplitude * sin(2 * M_PI * 440 * t / opts.sample_rate);
+		}
+		
+		receiver.now = n * frame_ms;
+		sender_push(&sender, frame);
+		jitter_slot_p slot;
+		jitter_get(&receiver.speaker.jitter, &slot);
+		
+		if (n == tone_frames - 1)
+			jitter_before = receiver.speaker.jitter.jitter;
+		if (receiver.speaker.jitter.jitter > jitter_max)
+			jitter_max = receiver.speaker.jitter.jitter;
+	}
+	
+	printf("DTX check: %d ms pause, %zu SILENCE packets, jitter %.2f ms before, at most %.2f ms\n",
+		BENCH_DTX_PAUSE_MS, receiver.silence_packets, jitter_before, jitter_max);
+	if (receiver.silence_packets == 0)
+		die(1, "DTX check failed: the encoder never went into DTX\n");
+	if (jitter_max > BENCH_DTX_MAX_JITTER)
+		die(1, "DTX check failed: the pause raised the jitter estimate\n");
+	
+	sender_destroy(&sender);
+	opus_encoder_destroy(enc);
+	opts = saved_opts;
+	options_derive(&opts);
+}
+
+// Runs the PCM data through the pipeline in the format currently set in opts
+void bench_pipeline_run(const uint8_t *pcm, size_t pcm_size){
+	size_t frame_count = pcm_size / opts.frame_size;
+	if (frame_count == 0)
+		return;
+	
+	// Setup, the allocations here happen once per call
+	size_t allocs = alloc_count;
+	int error_code = 0;
+	OpusEncoder *enc = opus_encoder_create(opts.sample_rate, opts.channel_count, OPUS_APPLICATION_VOIP, &error_code);
+	if (error_code != OPUS_OK)
+		die(1, "opus_encoder_create error: %s\n", opus_strerror(error_code));
+	encoder_adapt_init(enc);
+	
+	bench_receiver_t *receiver = calloc(1, sizeof(bench_receiver_t));
+	receiver->speaker.dec = opus_decoder_create(opts.sample_rate, opts.channel_count, &error_code);
+	if (error_code != OPUS_OK)
+		die(1, "opus_decoder_create error: %s\n", opus_strerror(error_code));
+	receiver->frame = malloc(opts.frame_size);
+	
+	pipeline_stats_t stats = { 0 };
+	receiver->stats = &stats;
+	sender_t sender;
+	sender_init(&sender, enc, 0, bench_receive, receiver);
+	sender.stats = &stats;
+	vad = (vad_t){ .talking = true, .noise_level = -100 };
+	dsp_init(&dsp, opts.sample_rate, opts.channel_count, opts.frame_samples_per_channel, opts.vad_threshold);
+	size_t setup_allocs = alloc_count - allocs;
+	
+	// Per frame work
+	allocs = alloc_count;
+	uint64_t start = now_ns();
+	for(size_t i = 0; i < frame_count; i++)
+		sender_push(&sender, (const int16_t*)(pcm + i * opts.frame_size));
+	sender_flush(&sender);
+	uint64_t elapsed = now_ns() - start;
+	size_t frame_allocs = alloc_count - allocs;
+	
+	printf("%5u %2hhu %4.1f %9.0f", opts.sample_rate, opts.channel_count, opts.frame_duration / 10.0, frame_count / (elapsed / 1e9));
+	uint64_t total = 0;
+	for(size_t s = 0; s < STAGE_COUNT; s++){
+		printf(" %11.0f", (double)stats.ns[s] / frame_count);
+		total += stats.ns[s];
+	}
+	printf(" %7.0f %8zu %6.1f", (double)total / frame_count, receiver->packets,
+		(receiver->packets ? (double)receiver->bytes / receiver->packets : 0.0));
+	bench_print_allocs(setup_allocs);
+	bench_print_allocs(frame_allocs);
+	printf("\n");
+	
+	sender_destroy(&sender);
+	opus_encoder_destroy(enc);
+	opus_decoder_destroy(receiver->speaker.dec);
+	free(receiver->frame);
+	free(receiver);
+}
+
+void bench_pipeline(const char *path){
+	int fd = (strcmp(path, "-") == 0) ? STDIN_FILENO : open(path, O_RDONLY);
+	if (fd == -1)
+		pdie(1, "Could not open the PCM file");
+	
+	uint8_t *pcm = malloc(BENCH_PCM_MAX);
+	size_t pcm_size = 0;
+	ssize_t bytes_read;
+	while ( pcm_size < BENCH_PCM_MAX && (bytes_read = read(fd, pcm + pcm_size, BENCH_PCM_MAX - pcm_size)) > 0 )
+		pcm_size += bytes_read;
+	close(fd);
+	
+	speaker_repacketizer = opus_repacketizer_create();
+	bench_pipeline_check_dtx();
+	size_t frames_per_packet = opts.frames_per_packet;
+	
+	printf("%zu bytes of PCM data, %zu frames per packet (at most 120 ms), VAD %s, DSP %s (%s), max bitrate %u bit/s\n",
+		pcm_size, frames_per_packet, opts.vad ? "on" : "off", opts.dsp ? "on" : "off", dsp_kernel_name(), opts.max_bitrate);
+	printf(" rate ch   ms       fps  ns/frame:");
+	for(size_t s = 0; s < STAGE_COUNT; s++)
+		printf(" %s", pipeline_stage_names[s]);
+	printf(" total, packets, bytes/packet, allocs: setup per-run\n");
+	
+	const uint32_t rates[] = { 8000, 12000, 16000, 24000, 48000 };
+	const uint16_t durations[] = { 25, 50, 100, 200, 400, 600 };
+	for(size_t r = 0; r < sizeof(rates) / sizeof(rates[0]); r++){
+		for(uint8_t channels = 1; channels <= 2; channels++){
+			for(size_t d = 0; d < sizeof(durations) / sizeof(durations[0]); d++){
+				opts.sample_rate = rates[r];
+				opts.channel_count = channels;
+				opts.frame_duration = durations[d];
+				opts.frames_per_packet = frames_per_packet;
+				while (opts.frames_per_packet * opts.frame_duration > 1200)
+					opts.frames_per_packet--;
+				options_derive(&opts);
+				bench_pipeline_run(pcm, pcm_size);
+			}
+		}
+	}
+	
+	opus_repacketizer_destroy(speaker_repacketizer);
+	free(pcm);
+}
+
+
+//
+// DSP benchmark
+//
+// --bench-dsp times every kernel of the capture DSP chain and the whole chain on 10 ms frames of
+// noise with a DC offset, in mono and stereo at 48 kHz. The kernels run in place on the same frame
+// over and over, the numbers are for hot caches.
+//
+// Before that it checks the VAD behind the DSP: a quiet voice burst lets the AGC raise its gain,
+// then noise 3 dB below the VAD threshold follows. The VAD has to drop once the hangover is over,
+// boosted noise during the gate's hold must not reopen it. It exits with 1 if that fails.
+//
+
+#define BENCH_DSP_FRAMES  20000
+// The voice burst, a 440 Hz tone. Its length and level make the AGC add several dB.
+#define BENCH_VAD_VOICE_DBFS  -35.0
+#define BENCH_VAD_VOICE_MS  3000
+#define BENCH_VAD_NOISE_MS  2000
+
+void bench_dsp_check_vad(){
+	opts.vad = true;
+	opts.sample_rate = 48000;
+	opts.channel_count = 1;
+	opts.frame_duration = 100;
+	opts.frame_samples_per_channel = opts.sample_rate / 100;
+	dsp_init(&dsp, opts.sample_rate, opts.channel_count, opts.frame_samples_per_channel, opts.vad_threshold);
+	vad = (vad_t){ .talking = true, .noise_level = -100 };
+	
+	static int16_t frame[DSP_FRAME_MAX];
+	size_t voice_frames = BENCH_VAD_VOICE_MS / 10, noise_frames = BENCH_VAD_NOISE_MS / 10;
+	double noise_dbfs = opts.vad_threshold - 3;
+	double voice_amplitude = 32768 * sqrt(2) * pow(10, BENCH_VAD_VOICE_DBFS / 20);
+	// Uniform noise in [-a, a] has an RMS of a / sqrt(3)
+	double noise_amplitude = 32768 * sqrt(3) * pow(10, noise_dbfs / 20);
+	
+	bool voice_dropped = false;
+	size_t noise_sent = 0;  // noise frames up to and including the last one the VAD let through
+	double agc_db = 0;
+	for(size_t n = 0; n < voice_frames + noise_frames; n++){
+		for(size_t i = 0; i < opts.frame_samples_per_channel; i++){
+			size_t t = n * opts.frame_samples_per_channel + i;
+			frame[i] = (n < voice_frames)
+				? voice_amplitude * sin(2 * M_PI * 440 * t / opts.sample_rate)
+				: noise_amplitude * (2.0 * rand() / RAND_MAX - 1);
+		}
+		
+		dsp_meter_t meter;
+		uint8_t level;
+		bool send_silence;
+		dsp_process(&dsp, frame, frame, &meter);
+		bool sent = sender_analyze(meter.rms_dbfs, &level, &send_silence);
+		if (n < voice_frames && !sent)
+			voice_dropped = true;
+		if (n >= voice_frames && sent)
+			noise_sent = n - voice_frames + 1;
+		if (n == voice_frames - 1)
+			agc_db = 20 * log10(dsp.agc_gain);
+	}
+	
+	size_t open_ms = noise_sent * opts.frame_duration / 10;
+	printf("VAD check: voice at %.1f dBFS (AGC %+.1f dB), noise at %.1f dBFS: open for %zu ms of noise, hangover %d ms\n",
+		BENCH_VAD_VOICE_DBFS, agc_db, noise_dbfs, open_ms, VAD_HANGOVER);
+	if (voice_dropped)
+		die(1, "VAD check failed: the VAD dropped voice frames\n");
+	if (open_ms > VAD_HANGOVER)
+		die(1, "VAD check failed: the VAD stayed open after the hangover\n");
+}
+
+typedef enum {
+	BENCH_DSP_FROM_INT16, BENCH_DSP_HIGHPASS, BENCH_DSP_METER, BENCH_DSP_GAIN, BENCH_DSP_TO_INT16, BENCH_DSP_CHAIN, BENCH_DSP_COUNT
+} bench_dsp_kernel_t;
+
+const char *bench_dsp_kernel_names[BENCH_DSP_COUNT] = { "from_int16", "highpass", "meter", "gain_ramp", "to_int16", "chain" };
+
+void bench_dsp(){
+	const uint32_t sample_rate = 48000;
+	const size_t frame_samples = sample_rate / 100;
+	static int16_t frame[DSP_FRAME_MAX * DSP_CHANNELS_MAX];
+	
+	bench_dsp_check_vad();
+	
+	printf("DSP kernels: %s, %u Hz, 10 ms frames, %d runs\n", dsp_kernel_name(), sample_rate, BENCH_DSP_FRAMES);
+	printf("%-12s %12s %12s\n", "kernel", "ns/frame", "ns/sample");
+	for(size_t channels = 1; channels <= DSP_CHANNELS_MAX; channels++){
+		dsp_init(&dsp, sample_rate, channels, frame_samples, -45);
+		float *planes[DSP_CHANNELS_MAX] = { dsp.planes[0], dsp.planes[1] };
+		for(size_t i = 0; i < frame_samples * channels; i++)
+			frame[i] = 2000 + (rand() % 8000) - 4000;
+		dsp_from_int16(planes, frame, frame_samples, channels);
+		
+		printf("%zu channel%s\n", channels, (channels > 1) ? "s" : "");
+		for(size_t k = 0; k < BENCH_DSP_COUNT; k++){
+			float sum = 0, peak = 0;
+			dsp_meter_t meter;
+			uint64_t start = now_ns();
+			for(size_t n = 0; n < BENCH_DSP_FRAMES; n++){
+				switch(k){
+					case BENCH_DSP_FROM_INT16: dsp_from_int16(planes, frame, frame_samples, channels); break;
+					case BENCH_DSP_TO_INT16:   dsp_to_int16(frame, planes, frame_samples, channels); break;
+					case BENCH_DSP_CHAIN:      dsp_process(&dsp, frame, frame, &meter); break;
+					default:
+						for(size_t c = 0; c < channels; c++){
+							if (k == BENCH_DSP_HIGHPASS)
+								dsp_highpass(planes[c], frame_samples, dsp.pole, &dsp.highpass[c]);
+							else if (k == BENCH_DSP_METER)
+								dsp_meter(planes[c], frame_samples, &sum, &peak);
+							else
+								dsp_gain_ramp(planes[c], frame_samples, 1, 1);
+						}
+						break;
+				}
+			}
+			double ns = (double)(now_ns() - start) / BENCH_DSP_FRAMES;
+			printf("%-12s %12.0f %12.2f\n", bench_dsp_kernel_names[k], ns, ns / (frame_samples * channels));
+		}
+	}
+}
+
+
+int main(int argc, char **argv){
+	parse_options(argc, argv, &opts);
+	if (opts.bench_pipeline){
+		bench_pipeline(opts.bench_pipeline);
+		return 0;
+	}
+	if (opts.bench_dsp){
+		bench_dsp();
+		return 0;
+	}
+	establish_signal_handlers();
+	
+	// Without input or output files Pulse Audio is used, input_fd and output_fd stay -1 in that case.
+	// Recorded frames end up in the capture ring with both backends.
+	if (opts.audio_backend == AUDIO_ASYNC){
+		if (opts.input_fd == -1 || opts.output_fd == -1)
+			pulse_async_start(opts.input_fd == -1, opts.output_fd == -1);
+	} else {
+		if (opts.input_fd == -1)
+			startup_recording_thread();
+		if (opts.output_fd == -1)
+			startup_playback_thread();
+	}
+	bool capture_thread = (opts.input_fd == -1 && opts.audio_backend == AUDIO_THREADS);
+	bool playback_thread = (opts.output_fd == -1 && opts.audio_backend == AUDIO_THREADS);
+	
+	/*
+	// read audio data in 48 kHz and s16ne
+	const size_t freq = 48000; // in Hz
+	const size_t frame_dur = 10; // in ms, 2.5 (won't work), 5, 10, 20, 40, 60
+	const size_t frame_samples = (freq * frame_dur) / 1000;
+	const size_t channel_count = 2;
+	log_print("%zu samples per frame, %zu channels\n", frame_samples, channel_count);
+	*/
+	
+	dsp_init(&dsp, opts.sample_rate, opts.channel_count, opts.frame_samples_per_channel, opts.vad_threshold);
+	
+	// Allocate frame buffers
+	framer_t framer;
+	framer_init(&framer, opts.frame_size);
+	int16_t *out_frame = malloc(opts.frame_size);
+	
+	// Init Opus encoder and decoder
+	int error_code = 0;
+	OpusEncoder *enc;
+	enc = opus_encoder_create(opts.sample_rate, opts.channel_count, OPUS_APPLICATION_VOIP, &error_code);
+	assert(error_code == OPUS_OK);
+	encoder_adapt_init(enc);
+	
+	speaker_pool_init();
+	
+	// Search for the server
+	struct addrinfo hints = {0};
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_DGRAM;
+	struct addrinfo *addr_info;
+	error_code = getaddrinfo(opts.host, opts.port, &hints, &addr_info);
+	if (error_code != 0)
+		die(3, "getaddrinfo failed: %s\n", gai_strerror(error_code));
+	
+	// Remember the first matching IP address
+	struct sockaddr_in server_addr;
+	memcpy(&server_addr, addr_info->ai_addr, sizeof(server_addr));
+	
+	// Show all found addresses... just some fun for debugging
+	size_t host_len = 1024, service_len = 1024;
+	char host[host_len], service[service_len];
+	for (struct addrinfo * cur_addr_info = addr_info; cur_addr_info != NULL; cur_addr_info = cur_addr_info->ai_next){
+		getnameinfo(cur_addr_info->ai_addr, cur_addr_info->ai_addrlen, host, host_len, service, service_len, NI_DGRAM | NI_NUMERICHOST);
+		notice("%s:%s\n", host, service);
+	}
+	
+	// Free the entire address list
+	freeaddrinfo(addr_info);
+	
+	
+	// Create a local socket and bind to some free port
+	int client_fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (client_fd == -1)
+		pdie(3, "socket");
+	
+	struct sockaddr_in addr = (struct sockaddr_in){ AF_INET, 0, .sin_addr = { INADDR_ANY } };
+	if (bind(client_fd, (const struct sockaddr *)&addr, sizeof(addr)) == -1)
+		pdie(3, "bind");
+	
+	
+	uint8_t packet[PACKET_MAX];
+	packet_header_t header;
+	size_t packet_len;
+	ssize_t bytes_send, bytes_received;
+	
+	// Do connection setup
+	packet_len = packet_pack_header(packet, PACKET_HELLO, 0, 0);
+	packet_len += varint_pack(packet + packet_len, opts.room);
+	bytes_send = sendto(client_fd, packet, packet_len, 0, (const struct sockaddr *)&server_addr, sizeof(server_addr));
+	if (bytes_send == -1)
+		perror("sendto");
+	
+	uint8_t user_id = 0;
+	do {
+		bytes_received = recvfrom(client_fd, packet, sizeof(packet), 0, NULL, NULL);
+	} while( bytes_received < 0 || packet_unpack_header(packet, bytes_received, &header) == 0 || header.type != PACKET_WELCOME );
+	user_id = header.user;
+	notice("Welcome from server, you're client %hhu\n", header.user);
+	
+	server_link_t server_link = { client_fd, server_addr };
+	sender_t sender;
+	sender_init(&sender, enc, user_id, send_packet, &server_link);
+	
+	
+	// Frame timer, mixes and plays one frame of all speakers per frame duration and paces the input fd
+	int frame_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	if (frame_timer_fd == -1)
+		pdie(3, "timerfd_create");
+	long frame_ns = opts.frame_duration * 100000L;
+	struct itimerspec interval = {
+		.it_interval = { frame_ns / 1000000000L, frame_ns % 1000000000L },
+		.it_value = { frame_ns / 1000000000L, frame_ns % 1000000000L }
+	};
+	if ( timerfd_settime(frame_timer_fd, 0, &interval, NULL) == -1 )
+		pdie(3, "timerfd_settime");
+	
+	// From here on everything is drained until EAGAIN
+	if ( fcntl(client_fd, F_SETFL, fcntl(client_fd, F_GETFL) | O_NONBLOCK) == -1 )
+		pdie(3, "fcntl");
+	if (opts.input_fd != -1 && fcntl(opts.input_fd, F_SETFL, fcntl(opts.input_fd, F_GETFL) | O_NONBLOCK) == -1)
+		pdie(3, "fcntl");
+	
+	int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd == -1)
+		pdie(3, "epoll_create1");
+	event_loop_watch(epoll_fd, client_fd, EVENT_SOCKET);
+	event_loop_watch(epoll_fd, frame_timer_fd, EVENT_FRAME_TIMER);
+	if (capture_thread)
+		event_loop_watch(epoll_fd, capture_ring.event_fd, EVENT_CAPTURE);
+	
+	// Pipes and devices are framed as their data arrives, regular files (not pollable) are paced
+	struct stat input_stat;
+	bool input_live = (opts.input_fd != -1 && fstat(opts.input_fd, &input_stat) == 0 && !S_ISREG(input_stat.st_mode));
+	if (input_live)
+		event_loop_watch(epoll_fd, opts.input_fd, EVENT_INPUT);
+	bool input_ready = false;
+	
+	struct epoll_event events[4];
+	while(!quit){
+		// Only sleep if the capture ring is empty, otherwise just look what else is there. The async
+		// backend fills the ring during event_loop_wait() so there is nothing to wait for.
+		int timeout = -1;
+		if (capture_thread && !ring_arm(&capture_ring))
+			timeout = 0;
+		
+		int event_count = event_loop_wait(epoll_fd, events, 4, timeout);
+		if (event_count == -1){
+			if (errno != EINTR)
+				perror("epoll_wait");
+			continue;
+		}
+		
+		bool frame_tick = false;
+		for(int e = 0; e < event_count; e++){
+			switch(events[e].data.u32){
+				case EVENT_SOCKET:
+					event_loop_receive(client_fd, enc);
+					break;
+				case EVENT_CAPTURE:
+					ring_clear_event(&capture_ring);
+					break;
+				case EVENT_FRAME_TIMER:
+					frame_tick = true;
+					break;
+				case EVENT_INPUT:
+					input_ready = true;
+					break;
+			}
+		}
+		
+		// Encode recorded frames directly from the capture ring, all packets of the pass go out together
+		server_link.batching = true;
+		if (opts.input_fd == -1){
+			uint8_t *frame;
+			while( (frame = ring_read_frame(&capture_ring)) != NULL ){
+				uint64_t taken = now_ns();
+				telemetry_add(LATENCY_CAPTURE, ring_read_time(&capture_ring), taken);
+				push_frame(&sender, (int16_t*)frame, taken);
+				ring_read_release(&capture_ring);
+			}
+		}
+		
+		// Same for pipes, read until they're empty and encode every complete frame. At the end of the
+		// input we stop watching it, it would be readable forever.
+		if (input_ready){
+			bool more, full;
+			do {
+				more = framer_fill(&framer, opts.input_fd, SIZE_MAX);
+				full = (framer.write - framer.read == framer.capacity);
+				size_t backlog = framer_frames(&framer);
+				if (backlog > framer.max_backlog)
+					framer.max_backlog = backlog;
+				framer.passes++;
+				
+				int16_t *frame;
+				uint64_t taken = now_ns();
+				while( (frame = framer_take(&framer)) != NULL )
+					push_frame(&sender, frame, taken);
+			} while (more && full);
+			
+			if (!more)
+				epoll_ctl(epoll_fd, EPOLL_CTL_DEL, opts.input_fd, NULL);
+			input_ready = false;
+		}
+		server_link_flush(&server_link);
+		server_link.batching = false;
+		
+		if (frame_tick){
+			uint64_t expirations = 0;
+			if ( read(frame_timer_fd, &expirations, sizeof(expirations)) != sizeof(expirations) )
+				continue;
+			
+			for(uint64_t i = 0; i < expirations; i++){
+				if (opts.input_fd != -1 && !input_live){
+					if (framer_frames(&framer) == 0)
+						framer_fill(&framer, opts.input_fd, opts.frame_size);
+					int16_t *frame = framer_take(&framer);
+					if (frame)
+						push_frame(&sender, frame, now_ns());
+				}
+				
+				// Mix right into the playback ring, if it's full the frame is mixed anyway to keep
+				// the jitter buffers going but dropped
+				int16_t *frame = NULL;
+				if (playback_thread)
+					frame = (int16_t*)ring_write_frame(&playback_ring);
+				if (frame == NULL)
+					frame = out_frame;
+				
+				if ( !speakers_mix(frame) )
+					continue;
+				if (opts.output_fd != -1)
+					write(opts.output_fd, frame, opts.frame_size);
+				else if (!playback_thread)
+					pulse_async_write(frame);
+				else if (frame != out_frame){
+					// Everything already in the ring is played before this frame
+					latency_add(&telemetry.stages[LATENCY_PLAYBACK], ring_fill(&playback_ring) * opts.frame_duration * 100);
+					ring_write_commit(&playback_ring);
+				}
+			}
+			speakers_report();
+			event_loop_report(&framer, &server_link);
+			speakers_send_reports(client_fd, &server_addr);
+			telemetry_ping(client_fd, &server_addr);
 		}
 	}
 	
 	log_print("exiting...\n");
-	packet = (packet_t){ PACKET_BYE, user_id };
-	bytes_send = sendto(client_fd, &packet, offsetof(packet_t, seq), 0, (const struct sockaddr *)&server_addr, sizeof(server_addr));
+	packet_len = packet_pack_header(packet, PACKET_BYE, user_id, 0);
+	bytes_send = sendto(client_fd, packet, packet_len, 0, (const struct sockaddr *)&server_addr, sizeof(server_addr));
 	if (bytes_send == -1)
 		perror("sendto");
 	
+	sender_destroy(&sender);
 	opus_encoder_destroy(enc);
+	if (pulse_async.mainloop)
+		pulse_async_stop();
 	
-	free(in_frame);
+	close(epoll_fd);
+	close(frame_timer_fd);
+	framer_destroy(&framer);
 	free(out_frame);
 	close(client_fd);
 }
\ No newline at end of file
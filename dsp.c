@@ -0,0 +1,441 @@
+#include <math.h>
+#include "dsp.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define DSP_AVX2
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define DSP_SSE2
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define DSP_NEON
+#endif
+
+// Corner frequency of the high-pass, removes DC and rumble below the voice
+#define DSP_HIGHPASS_HZ  80
+// The AGC pulls voice towards this RMS level and never amplifies more or less than the limits
+#define DSP_AGC_TARGET  -20.0
+#define DSP_AGC_GAIN_MAX  20.0
+#define DSP_AGC_GAIN_MIN  -10.0
+// In dB per second, the gain drops faster than it rises so loud words aren't pumped
+#define DSP_AGC_RISE  6.0
+#define DSP_AGC_FALL  30.0
+// Peaks are kept below this, in linear full scale (about -1 dBFS)
+#define DSP_PEAK_LIMIT  0.89f
+// The closed gate attenuates by this much, in dB. It stays open for the hold time (in ms) after the
+// last frame above the threshold and then closes with the release rate (dB per second).
+#define DSP_GATE_FLOOR  -30.0
+#define DSP_GATE_HOLD  150
+#define DSP_GATE_RELEASE  120.0
+
+
+static inline float db_to_gain(double db){
+	return powf(10, db / 20);
+}
+
+static inline double power_to_dbfs(double mean_square){
+	return (mean_square > 0) ? 10 * log10(mean_square) : -100;
+}
+
+static inline int16_t saturate(float sample){
+	long value = lrintf(sample * 32768);
+	if (value > INT16_MAX)
+		return INT16_MAX;
+	if (value < INT16_MIN)
+		return INT16_MIN;
+	return value;
+}
+
+
+//
+// Kernels
+//
+
+void dsp_from_int16(float *const *planes, const int16_t *samples, size_t frames, size_t channels){
+	const float scale = 1.0f / 32768;
+	size_t i = 0;
+
+#if defined(DSP_AVX2)
+	__m256 vscale = _mm256_set1_ps(scale);
+	if (channels == 1){
+		for(; i + 8 <= frames; i += 8){
+			__m256i v = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)(samples + i)));
+			_mm256_storeu_ps(planes[0] + i, _mm256_mul_ps(_mm256_cvtepi32_ps(v), vscale));
+		}
+	} else if (channels == 2){
+		// Each 32 bit lane is one frame, left in the low half
+		for(; i + 8 <= frames; i += 8){
+			__m256i v = _mm256_loadu_si256((const __m256i*)(samples + 2 * i));
+			__m256i left = _mm256_srai_epi32(_mm256_slli_epi32(v, 16), 16), right = _mm256_srai_epi32(v, 16);
+			_mm256_storeu_ps(planes[0] + i, _mm256_mul_ps(_mm256_cvtepi32_ps(left), vscale));
+			_mm256_storeu_ps(planes[1] + i, _mm256_mul_ps(_mm256_cvtepi32_ps(right), vscale));
+		}
+	}
+#elif defined(DSP_SSE2)
+	__m128 vscale = _mm_set1_ps(scale);
+	if (channels == 1){
+		for(; i + 8 <= frames; i += 8){
+			__m128i v = _mm_loadu_si128((const __m128i*)(samples + i));
+			__m128i low = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16), high = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+			_mm_storeu_ps(planes[0] + i, _mm_mul_ps(_mm_cvtepi32_ps(low), vscale));
+			_mm_storeu_ps(planes[0] + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(high), vscale));
+		}
+	} else if (channels == 2){
+		for(; i + 4 <= frames; i += 4){
+			__m128i v = _mm_loadu_si128((const __m128i*)(samples + 2 * i));
+			__m128i left = _mm_srai_epi32(_mm_slli_epi32(v, 16), 16), right = _mm_srai_epi32(v, 16);
+			_mm_storeu_ps(planes[0] + i, _mm_mul_ps(_mm_cvtepi32_ps(left), vscale));
+			_mm_storeu_ps(planes[1] + i, _mm_mul_ps(_mm_cvtepi32_ps(right), vscale));
+		}
+	}
+#elif defined(DSP_NEON)
+	if (channels == 1){
+		for(; i + 8 <= frames; i += 8){
+			int16x8_t v = vld1q_s16(samples + i);
+			vst1q_f32(planes[0] + i, vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(v))), scale));
+			vst1q_f32(planes[0] + i + 4, vmulq_n_f32(vcvtq_f32_s32(vmovl_high_s16(v)), scale));
+		}
+	} else if (channels == 2){
+		for(; i + 8 <= frames; i += 8){
+			int16x8x2_t v = vld2q_s16(samples + 2 * i);
+			for(size_t c = 0; c < 2; c++){
+				vst1q_f32(planes[c] + i, vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(v.val[c]))), scale));
+				vst1q_f32(planes[c] + i + 4, vmulq_n_f32(vcvtq_f32_s32(vmovl_high_s16(v.val[c])), scale));
+			}
+		}
+	}
+#endif
+
+	// Remaining frames (or all of them without SIMD)
+	for(; i < frames; i++){
+		for(size_t c = 0; c < channels; c++)
+			planes[c][i] = samples[i * channels + c] * scale;
+	}
+}
+
+void dsp_to_int16(int16_t *samples, float *const *planes, size_t frames, size_t channels){
+	size_t i = 0;
+
+#if defined(DSP_AVX2)
+	__m256 vscale = _mm256_set1_ps(32768);
+	if (channels == 1){
+		// packs works within 128 bit lanes, the permute puts the 64 bit blocks back in order
+		for(; i + 16 <= frames; i += 16){
+			__m256i a = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_loadu_ps(planes[0] + i), vscale));
+			__m256i b = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_loadu_ps(planes[0] + i + 8), vscale));
+			__m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), _MM_SHUFFLE(3, 1, 2, 0));
+			_mm256_storeu_si256((__m256i*)(samples + i), packed);
+		}
+	} else if (channels == 2){
+		// The unpacks and packs within the lanes cancel out, the frames come out in order
+		for(; i + 8 <= frames; i += 8){
+			__m256i left = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_loadu_ps(planes[0] + i), vscale));
+			__m256i right = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_loadu_ps(planes[1] + i), vscale));
+			__m256i packed = _mm256_packs_epi32(_mm256_unpacklo_epi32(left, right), _mm256_unpackhi_epi32(left, right));
+			_mm256_storeu_si256((__m256i*)(samples + 2 * i), packed);
+		}
+	}
+#elif defined(DSP_SSE2)
+	__m128 vscale = _mm_set1_ps(32768);
+	if (channels == 1){
+		for(; i + 8 <= frames; i += 8){
+			__m128i a = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(planes[0] + i), vscale));
+			__m128i b = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(planes[0] + i + 4), vscale));
+			_mm_storeu_si128((__m128i*)(samples + i), _mm_packs_epi32(a, b));
+		}
+	} else if (channels == 2){
+		for(; i + 4 <= frames; i += 4){
+			__m128i left = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(planes[0] + i), vscale));
+			__m128i right = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(planes[1] + i), vscale));
+			__m128i packed = _mm_packs_epi32(_mm_unpacklo_epi32(left, right), _mm_unpackhi_epi32(left, right));
+			_mm_storeu_si128((__m128i*)(samples + 2 * i), packed);
+		}
+	}
+#elif defined(DSP_NEON)
+	for(; i + 8 <= frames && channels <= 2; i += 8){
+		int16x8x2_t v;
+		for(size_t c = 0; c < channels; c++){
+			int32x4_t low = vcvtnq_s32_f32(vmulq_n_f32(vld1q_f32(planes[c] + i), 32768));
+			int32x4_t high = vcvtnq_s32_f32(vmulq_n_f32(vld1q_f32(planes[c] + i + 4), 32768));
+			v.val[c] = vcombine_s16(vqmovn_s32(low), vqmovn_s32(high));
+		}
+		if (channels == 1)
+			vst1q_s16(samples + i, v.val[0]);
+		else
+			vst2q_s16(samples + 2 * i, v);
+	}
+#endif
+
+	for(; i < frames; i++){
+		for(size_t c = 0; c < channels; c++)
+			samples[i * channels + c] = saturate(planes[c][i]);
+	}
+}
+
+// The recursion is what keeps an IIR filter from being vectorized. Within a vector it's solved as a
+// prefix scan: u[n] = x[n] - x[n-1] is computed for all lanes, then log2(lanes) shift-and-add steps
+// turn it into sum(pole^(n-k) * u[k]) and the output of the previous vector is added with the
+// matching powers of the pole. Only that last add depends on the previous vector.
+void dsp_highpass(float *samples, size_t count, float pole, dsp_highpass_state_t *state){
+	float x_prev = state->x, y_prev = state->y;
+	size_t i = 0;
+
+#if defined(DSP_AVX2)
+	const float p2 = pole * pole, p4 = p2 * p2;
+	__m256 powers = _mm256_setr_ps(pole, p2, p2 * pole, p4, p4 * pole, p4 * p2, p4 * p2 * pole, p4 * p4);
+	__m256 vp1 = _mm256_set1_ps(pole), vp2 = _mm256_set1_ps(p2), vp4 = _mm256_set1_ps(p4), zero = _mm256_setzero_ps();
+	__m256i shift1 = _mm256_setr_epi32(0, 0, 1, 2, 3, 4, 5, 6), shift2 = _mm256_setr_epi32(0, 0, 0, 1, 2, 3, 4, 5);
+	__m256i shift4 = _mm256_setr_epi32(0, 0, 0, 0, 0, 1, 2, 3), last = _mm256_set1_epi32(7);
+	__m256 vx_prev = _mm256_set1_ps(x_prev), vy_prev = _mm256_set1_ps(y_prev);
+	for(; i + 8 <= count; i += 8){
+		__m256 x = _mm256_loadu_ps(samples + i);
+		__m256 shifted = _mm256_blend_ps(_mm256_permutevar8x32_ps(x, shift1), vx_prev, 0x01);
+		__m256 v = _mm256_sub_ps(x, shifted);
+		v = _mm256_add_ps(v, _mm256_mul_ps(vp1, _mm256_blend_ps(_mm256_permutevar8x32_ps(v, shift1), zero, 0x01)));
+		v = _mm256_add_ps(v, _mm256_mul_ps(vp2, _mm256_blend_ps(_mm256_permutevar8x32_ps(v, shift2), zero, 0x03)));
+		v = _mm256_add_ps(v, _mm256_mul_ps(vp4, _mm256_blend_ps(_mm256_permutevar8x32_ps(v, shift4), zero, 0x0f)));
+		__m256 y = _mm256_add_ps(v, _mm256_mul_ps(powers, vy_prev));
+		_mm256_storeu_ps(samples + i, y);
+		vx_prev = _mm256_permutevar8x32_ps(x, last);
+		vy_prev = _mm256_permutevar8x32_ps(y, last);
+	}
+	x_prev = _mm256_cvtss_f32(vx_prev);
+	y_prev = _mm256_cvtss_f32(vy_prev);
+#elif defined(DSP_SSE2)
+	const float p2 = pole * pole;
+	__m128 powers = _mm_setr_ps(pole, p2, p2 * pole, p2 * p2);
+	__m128 vp1 = _mm_set1_ps(pole), vp2 = _mm_set1_ps(p2);
+	__m128 vx_prev = _mm_set1_ps(x_prev), vy_prev = _mm_set1_ps(y_prev);
+	for(; i + 4 <= count; i += 4){
+		__m128 x = _mm_loadu_ps(samples + i);
+		__m128 shifted = _mm_move_ss(_mm_castsi128_ps(_mm_slli_si128(_mm_castps_si128(x), 4)), vx_prev);
+		__m128 v = _mm_sub_ps(x, shifted);
+		v = _mm_add_ps(v, _mm_mul_ps(vp1, _mm_castsi128_ps(_mm_slli_si128(_mm_castps_si128(v), 4))));
+		v = _mm_add_ps(v, _mm_mul_ps(vp2, _mm_castsi128_ps(_mm_slli_si128(_mm_castps_si128(v), 8))));
+		__m128 y = _mm_add_ps(v, _mm_mul_ps(powers, vy_prev));
+		_mm_storeu_ps(samples + i, y);
+		vx_prev = _mm_shuffle_ps(x, x, _MM_SHUFFLE(3, 3, 3, 3));
+		vy_prev = _mm_shuffle_ps(y, y, _MM_SHUFFLE(3, 3, 3, 3));
+	}
+	x_prev = _mm_cvtss_f32(vx_prev);
+	y_prev = _mm_cvtss_f32(vy_prev);
+#elif defined(DSP_NEON)
+	const float p2 = pole * pole;
+	const float powers_array[4] = { pole, p2, p2 * pole, p2 * p2 };
+	float32x4_t powers = vld1q_f32(powers_array), zero = vdupq_n_f32(0);
+	float32x4_t vx_prev = vdupq_n_f32(x_prev), vy_prev = vdupq_n_f32(y_prev);
+	for(; i + 4 <= count; i += 4){
+		float32x4_t x = vld1q_f32(samples + i);
+		float32x4_t v = vsubq_f32(x, vextq_f32(vx_prev, x, 3));
+		v = vmlaq_n_f32(v, vextq_f32(zero, v, 3), pole);
+		v = vmlaq_n_f32(v, vextq_f32(zero, v, 2), p2);
+		float32x4_t y = vmlaq_f32(v, powers, vy_prev);
+		vst1q_f32(samples + i, y);
+		vx_prev = vdupq_laneq_f32(x, 3);
+		vy_prev = vdupq_laneq_f32(y, 3);
+	}
+	x_prev = vgetq_lane_f32(vx_prev, 0);
+	y_prev = vgetq_lane_f32(vy_prev, 0);
+#endif
+
+	for(; i < count; i++){
+		float x = samples[i];
+		y_prev = pole * y_prev + x - x_prev;
+		x_prev = x;
+		samples[i] = y_prev;
+	}
+	
+	state->x = x_prev;
+	state->y = y_prev;
+}
+
+void dsp_gain_ramp(float *samples, size_t count, float gain, float gain_end){
+	const float step = (count > 0) ? (gain_end - gain) / count : 0;
+	size_t i = 0;
+
+#if defined(DSP_AVX2)
+	__m256 steps = _mm256_mul_ps(_mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_ps(step));
+	for(; i + 8 <= count; i += 8){
+		__m256 g = _mm256_add_ps(_mm256_set1_ps(gain + step * i), steps);
+		_mm256_storeu_ps(samples + i, _mm256_mul_ps(_mm256_loadu_ps(samples + i), g));
+	}
+#elif defined(DSP_SSE2)
+	__m128 steps = _mm_mul_ps(_mm_setr_ps(0, 1, 2, 3), _mm_set1_ps(step));
+	for(; i + 4 <= count; i += 4){
+		__m128 g = _mm_add_ps(_mm_set1_ps(gain + step * i), steps);
+		_mm_storeu_ps(samples + i, _mm_mul_ps(_mm_loadu_ps(samples + i), g));
+	}
+#elif defined(DSP_NEON)
+	const float steps_array[4] = { 0, step, 2 * step, 3 * step };
+	float32x4_t steps = vld1q_f32(steps_array);
+	for(; i + 4 <= count; i += 4){
+		float32x4_t g = vaddq_f32(vdupq_n_f32(gain + step * i), steps);
+		vst1q_f32(samples + i, vmulq_f32(vld1q_f32(samples + i), g));
+	}
+#endif
+
+	for(; i < count; i++)
+		samples[i] *= gain + step * i;
+}
+
+void dsp_meter(const float *samples, size_t count, float *sum, float *peak){
+	float s = 0, p = *peak;
+	size_t i = 0;
+
+#if defined(DSP_AVX2)
+	__m256 vsum = _mm256_setzero_ps(), vpeak = _mm256_setzero_ps();
+	__m256 abs_mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+	for(; i + 8 <= count; i += 8){
+		__m256 x = _mm256_loadu_ps(samples + i);
+		vsum = _mm256_add_ps(vsum, _mm256_mul_ps(x, x));
+		vpeak = _mm256_max_ps(vpeak, _mm256_and_ps(x, abs_mask));
+	}
+	__m128 sum4 = _mm_add_ps(_mm256_castps256_ps128(vsum), _mm256_extractf128_ps(vsum, 1));
+	__m128 peak4 = _mm_max_ps(_mm256_castps256_ps128(vpeak), _mm256_extractf128_ps(vpeak, 1));
+	float sums[4], peaks[4];
+	_mm_storeu_ps(sums, sum4);
+	_mm_storeu_ps(peaks, peak4);
+	for(size_t l = 0; l < 4; l++){
+		s += sums[l];
+		p = (peaks[l] > p) ? peaks[l] : p;
+	}
+#elif defined(DSP_SSE2)
+	__m128 vsum = _mm_setzero_ps(), vpeak = _mm_setzero_ps();
+	__m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+	for(; i + 4 <= count; i += 4){
+		__m128 x = _mm_loadu_ps(samples + i);
+		vsum = _mm_add_ps(vsum, _mm_mul_ps(x, x));
+		vpeak = _mm_max_ps(vpeak, _mm_and_ps(x, abs_mask));
+	}
+	float sums[4], peaks[4];
+	_mm_storeu_ps(sums, vsum);
+	_mm_storeu_ps(peaks, vpeak);
+	for(size_t l = 0; l < 4; l++){
+		s += sums[l];
+		p = (peaks[l] > p) ? peaks[l] : p;
+	}
+#elif defined(DSP_NEON)
+	float32x4_t vsum = vdupq_n_f32(0), vpeak = vdupq_n_f32(0);
+	for(; i + 4 <= count; i += 4){
+		float32x4_t x = vld1q_f32(samples + i);
+		vsum = vmlaq_f32(vsum, x, x);
+		vpeak = vmaxq_f32(vpeak, vabsq_f32(x));
+	}
+	s += vaddvq_f32(vsum);
+	p = (vmaxvq_f32(vpeak) > p) ? vmaxvq_f32(vpeak) : p;
+#endif
+
+	for(; i < count; i++){
+		s += samples[i] * samples[i];
+		float magnitude = fabsf(samples[i]);
+		p = (magnitude > p) ? magnitude : p;
+	}
+	
+	*sum += s;
+	*peak = p;
+}
+
+const char* dsp_kernel_name(){
+#if defined(DSP_AVX2)
+	return "avx2";
+#elif defined(DSP_SSE2)
+	return "sse2";
+#elif defined(DSP_NEON)
+	return "neon";
+#else
+	return "scalar";
+#endif
+}
+
+
+//
+// Chain
+//
+
+void dsp_init(dsp_p dsp, uint32_t sample_rate, size_t channels, size_t frame_samples, double gate_threshold){
+	*dsp = (dsp_t){ .channels = channels, .frame_samples = frame_samples, .gate_threshold = gate_threshold };
+	if (dsp->channels > DSP_CHANNELS_MAX)
+		dsp->channels = DSP_CHANNELS_MAX;
+	if (dsp->frame_samples > DSP_FRAME_MAX)
+		dsp->frame_samples = DSP_FRAME_MAX;
+	
+	double frame_seconds = (double)frame_samples / sample_rate;
+	dsp->pole = 1 - 2 * M_PI * DSP_HIGHPASS_HZ / sample_rate;
+	dsp->gate_hold_frames = ceil(DSP_GATE_HOLD / 1000.0 / frame_seconds);
+	dsp->gate_release = db_to_gain(-DSP_GATE_RELEASE * frame_seconds);
+	dsp->agc_step_up = DSP_AGC_RISE * frame_seconds;
+	dsp->agc_step_down = DSP_AGC_FALL * frame_seconds;
+	dsp->agc_gain = 1;
+	dsp->gate_gain = 1;
+}
+
+// Level of the planes, the sum and peak of the meter kernel turned into dBFS
+static void dsp_measure(dsp_p dsp, float *const *planes, dsp_meter_p meter, float *peak){
+	float sum = 0;
+	*peak = 0;
+	for(size_t c = 0; c < dsp->channels; c++)
+		dsp_meter(planes[c], dsp->frame_samples, &sum, peak);
+	meter->rms_dbfs = power_to_dbfs((double)sum / (dsp->frame_samples * dsp->channels));
+	meter->peak_dbfs = (*peak > 0) ? 20 * log10(*peak) : -100;
+}
+
+void dsp_process(dsp_p dsp, const int16_t *in, int16_t *out, dsp_meter_p meter){
+	float *planes[DSP_CHANNELS_MAX];
+	for(size_t c = 0; c < DSP_CHANNELS_MAX; c++)
+		planes[c] = dsp->planes[c];
+	
+	dsp_from_int16(planes, in, dsp->frame_samples, dsp->channels);
+	for(size_t c = 0; c < dsp->channels; c++)
+		dsp_highpass(planes[c], dsp->frame_samples, dsp->pole, &dsp->highpass[c]);
+	
+	// Everything decides on the level before any gain, boosted noise must not look like voice
+	float peak;
+	dsp_measure(dsp, planes, meter, &peak);
+	bool voice = (meter->rms_dbfs >= dsp->gate_threshold);
+	
+	// The gate opens at once and closes gradually after the hold time
+	if (voice)
+		dsp->gate_hold = dsp->gate_hold_frames;
+	else if (dsp->gate_hold > 0)
+		dsp->gate_hold--;
+	float gate_end = 1, gate_floor = db_to_gain(DSP_GATE_FLOOR);
+	if (dsp->gate_hold == 0){
+		gate_end = dsp->gate_gain * dsp->gate_release;
+		if (gate_end < gate_floor)
+			gate_end = gate_floor;
+	}
+	
+	// The AGC only adapts to voice, otherwise it would pull up the noise between words
+	float agc_end = dsp->agc_gain;
+	if (voice){
+		double gain_db = 20 * log10(dsp->agc_gain);
+		double wanted_db = DSP_AGC_TARGET - meter->rms_dbfs;
+		if (wanted_db > DSP_AGC_GAIN_MAX)
+			wanted_db = DSP_AGC_GAIN_MAX;
+		if (wanted_db < DSP_AGC_GAIN_MIN)
+			wanted_db = DSP_AGC_GAIN_MIN;
+		
+		if (wanted_db > gain_db + dsp->agc_step_up)
+			wanted_db = gain_db + dsp->agc_step_up;
+		if (wanted_db < gain_db - dsp->agc_step_down)
+			wanted_db = gain_db - dsp->agc_step_down;
+		agc_end = db_to_gain(wanted_db);
+	}
+	
+	// Never push the peak of the frame over the limit, not even during the ramp
+	float gain = dsp->agc_gain * dsp->gate_gain, gain_end = agc_end * gate_end;
+	if (peak > 0 && peak * gain_end > DSP_PEAK_LIMIT){
+		agc_end = DSP_PEAK_LIMIT / peak / gate_end;
+		gain_end = agc_end * gate_end;
+	}
+	if (peak > 0 && peak * gain > DSP_PEAK_LIMIT)
+		gain = DSP_PEAK_LIMIT / peak;
+	
+	for(size_t c = 0; c < dsp->channels; c++)
+		dsp_gain_ramp(planes[c], dsp->frame_samples, gain, gain_end);
+	dsp->agc_gain = agc_end;
+	dsp->gate_gain = gate_end;
+	
+	dsp_to_int16(out, planes, dsp->frame_samples, dsp->channels);
+}
\ No newline at end of file
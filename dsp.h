@@ -0,0 +1,60 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+
+Capture processing of the client between the recording and the encoder: a high-pass filter against
+DC offsets and rumble, an automatic gain control, a noise gate and a level meter. The meter measures
+the filtered frame before any gain. The gate, the VAD and the level in the DATA header all use it,
+so noise the AGC boosted can't reopen the VAD while the gate holds.
+
+A frame is converted into planar floats once (one plane per channel, -1 to 1), the kernels work on
+a plane and the result is converted back with saturation. The kernels use AVX2, SSE2 or NEON
+(64 bit ARM) when the compiler targets them and plain C otherwise, build with ARCH_FLAGS=-mavx2 to
+get the AVX2 variant. Nothing allocates, the buffers are part of dsp_t.
+
+*/
+
+#define DSP_CHANNELS_MAX  2
+// Samples per channel of the largest frame, 60 ms at 48 kHz
+#define DSP_FRAME_MAX  2880
+
+typedef struct {
+	float x, y;  // last input and output
+} dsp_highpass_state_t;
+
+typedef struct {
+	double rms_dbfs, peak_dbfs;  // -100 for digital silence
+} dsp_meter_t, *dsp_meter_p;
+
+typedef struct {
+	size_t channels, frame_samples;  // samples per channel
+	float pole;  // of the high-pass
+	dsp_highpass_state_t highpass[DSP_CHANNELS_MAX];
+	double gate_threshold;  // in dBFS, the gate opens and the AGC adapts above it
+	size_t gate_hold_frames, gate_hold;
+	float agc_gain, gate_gain;  // linear, at the end of the last frame
+	float gate_release;  // factor per frame while the gate closes
+	double agc_step_up, agc_step_down;  // max change per frame, in dB
+	float planes[DSP_CHANNELS_MAX][DSP_FRAME_MAX] __attribute__((aligned(32)));
+} dsp_t, *dsp_p;
+
+void dsp_init(dsp_p dsp, uint32_t sample_rate, size_t channels, size_t frame_samples, double gate_threshold);
+// Runs one frame of interleaved samples through the chain, in and out may be the same. The meter
+// gets the level after the high-pass, before the gain.
+void dsp_process(dsp_p dsp, const int16_t *in, int16_t *out, dsp_meter_p meter);
+
+// Kernels, count and frames are per plane
+void dsp_from_int16(float *const *planes, const int16_t *samples, size_t frames, size_t channels);
+void dsp_to_int16(int16_t *samples, float *const *planes, size_t frames, size_t channels);
+// y[n] = pole * y[n-1] + x[n] - x[n-1]
+void dsp_highpass(float *samples, size_t count, float pole, dsp_highpass_state_t *state);
+// Multiplies with a gain that moves linearly from gain to gain_end over the samples
+void dsp_gain_ramp(float *samples, size_t count, float gain, float gain_end);
+// Adds the squares of the samples to *sum and raises *peak to the largest magnitude
+void dsp_meter(const float *samples, size_t count, float *sum, float *peak);
+
+// Name of the kernel variant that was compiled in, for benchmark output
+const char* dsp_kernel_name();
\ No newline at end of file
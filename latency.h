@@ -0,0 +1,57 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+
+Latency histogram with log-linear buckets: exact below 16 us, above that every power of two is
+split into 8 buckets. Percentiles are accurate to 12.5% which is plenty to spot a regression. Adding
+a value is a few instructions and never allocates, it's fine on the audio path.
+
+*/
+
+#define LATENCY_SUB_BUCKETS  8
+#define LATENCY_BUCKETS  (16 + 28 * LATENCY_SUB_BUCKETS)
+
+typedef struct {
+	size_t buckets[LATENCY_BUCKETS];
+	size_t count;
+	uint64_t max;  // in us
+} latency_histogram_t, *latency_histogram_p;
+
+
+static inline void latency_add(latency_histogram_p histogram, uint64_t us){
+	size_t bucket;
+	if (us < 16) {
+		bucket = us;
+	} else {
+		size_t exponent = 63 - __builtin_clzll(us);
+		size_t sub = (us >> (exponent - 3)) & (LATENCY_SUB_BUCKETS - 1);
+		bucket = 16 + (exponent - 4) * LATENCY_SUB_BUCKETS + sub;
+		if (bucket >= LATENCY_BUCKETS)
+			bucket = LATENCY_BUCKETS - 1;
+	}
+	
+	histogram->buckets[bucket]++;
+	histogram->count++;
+	if (us > histogram->max)
+		histogram->max = us;
+}
+
+// Upper end of the bucket the percentile falls into, in us
+static inline uint64_t latency_percentile(const latency_histogram_t *histogram, double percentile){
+	size_t rank = histogram->count * percentile / 100, seen = 0;
+	for(size_t bucket = 0; bucket < LATENCY_BUCKETS; bucket++){
+		seen += histogram->buckets[bucket];
+		if (seen <= rank)
+			continue;
+		
+		if (bucket < 16)
+			return bucket;
+		size_t exponent = (bucket - 16) / LATENCY_SUB_BUCKETS + 4;
+		size_t sub = (bucket - 16) % LATENCY_SUB_BUCKETS;
+		uint64_t upper = (uint64_t)(LATENCY_SUB_BUCKETS + sub + 1) << (exponent - 3);
+		return (upper < histogram->max) ? upper : histogram->max;
+	}
+	return histogram->max;
+}
\ No newline at end of file
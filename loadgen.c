@@ -0,0 +1,527 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdarg.h>
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/resource.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <getopt.h>
+
+#include "proto.h"
+#include "latency.h"
+
+/*
+
+Headless load generator for the server. It simulates rooms full of clients, each one with its own
+UDP socket. In every room the first few clients talk, they send one DATA packet per frame duration
+just like a real client would. Talkers are 10 dB apart in level, the first one is the loudest.
+Everyone counts what the server delivers. At the end the throughput is compared to what the server
+should have delivered. With the server's active speaker selection (--speakers) tell the load
+generator the same count so it only expects the loudest talkers.
+
+Every payload starts with an Opus TOC byte of 0 (one frame) followed by the time the packet was
+sent. Receivers take the difference to their clock when they read the packet, so the fan-out
+latency includes the time the load generator needs to get to the socket. With the pid of the server
+its CPU time is read from /proc before and after the run and divided by the packets it handled.
+
+Given several servers that are linked with each other (--peer) the members of every room are spread
+over them round robin, talkers included. Each server then only delivers to its share of the
+listeners and the numbers are what all of them delivered together. Give the pids of all servers to
+get their CPU time.
+
+*/
+
+// Max number of servers (and server pids)
+#define SERVERS_MAX  16
+
+typedef struct {
+	char **servers;          // host[:port]
+	size_t server_count;
+	
+	size_t rooms;
+	size_t room_size;
+	size_t talkers;          // per room
+	size_t active_speakers;  // talkers per room the server forwards, 0 if it forwards everyone
+	uint32_t first_room;
+	
+	uint16_t frame_duration;  // in 0.1 ms units
+	size_t payload_size;     // in bytes, about what Opus produces for one frame
+	size_t duration;         // in seconds
+	pid_t server_pids[SERVERS_MAX];  // to measure the CPU time of the servers
+	size_t server_pid_count;
+} options_t, *options_p;
+
+typedef struct {
+	int fd;
+	size_t server;  // index into the servers
+	uint32_t room;
+	uint8_t user;
+	bool talker;
+	uint8_t level;  // in -dBFS, put into every DATA packet
+	uint16_t seq;
+	size_t packets_received;
+} sim_client_t, *sim_client_p;
+
+options_t opts;
+
+void parse_options(int argc, char **argv, options_p opts);
+void show_usage_and_exit(char *program_name);
+void notice(const char *format, ...);
+void die(int status, const char *format, ...);
+void pdie(int status, const char *message);
+
+
+//
+// Output functions
+//
+
+void notice(const char *format, ...){
+	va_list args;
+	va_start(args, format);
+	vfprintf(stderr, format, args);
+	va_end(args);
+}
+
+void die(int status, const char *format, ...){
+	va_list args;
+	va_start(args, format);
+	vfprintf(stderr, format, args);
+	va_end(args);
+	exit(status);
+}
+
+void pdie(int status, const char *message){
+	perror(message);
+	exit(status);
+}
+
+
+//
+// Argument parsing stuff
+//
+
+// The TOC byte and the send time
+#define PAYLOAD_MIN  (1 + sizeof(uint64_t))
+
+void parse_options(int argc, char **argv, options_p opts){
+	// Set default options
+	*opts = (options_t){
+		.servers = NULL, .server_count = 0,
+		.rooms = 100, .room_size = 4, .talkers = 1, .active_speakers = 0, .first_room = 1,
+		.frame_duration = 100, .payload_size = 60, .duration = 10,
+		.server_pid_count = 0
+	};
+	
+	int opt_char;
+	struct option longopts[] = {
+		{"rooms", required_argument, NULL, 'n'},
+		{"room-size", required_argument, NULL, 's'},
+		{"talkers", required_argument, NULL, 't'},
+		{"first-room", required_argument, NULL, 'f'},
+		{"active-speakers", required_argument, NULL, 'a'},
+		{"frame-duration", required_argument, NULL, 'd'},
+		{"payload-size", required_argument, NULL, 'p'},
+		{"length", required_argument, NULL, 'l'},
+		{"server-pid", required_argument, NULL, 'P'},
+		{"help", no_argument, NULL, 'h'},
+		{0, 0, 0, 0}
+	};
+	while( (opt_char = getopt_long(argc, argv, "n:s:t:f:a:d:p:l:P:h", longopts, NULL)) != -1 ){
+		switch(opt_char){
+			case 'n':
+				opts->rooms = strtoul(optarg, NULL, 10);
+				break;
+			case 's':
+				opts->room_size = strtoul(optarg, NULL, 10);
+				break;
+			case 't':
+				opts->talkers = strtoul(optarg, NULL, 10);
+				break;
+			case 'f':
+				opts->first_room = strtoul(optarg, NULL, 10);
+				break;
+			case 'a':
+				opts->active_speakers = strtoul(optarg, NULL, 10);
+				break;
+			case 'd':
+				if ( strcmp(optarg, "2.5") == 0 )
+					opts->frame_duration = 25;
+				else
+					opts->frame_duration = strtol(optarg, NULL, 10) * 10;
+				if (opts->frame_duration == 0)
+					die(1, "Invalid frame duration %s\n", optarg);
+				break;
+			case 'p':
+				opts->payload_size = strtoul(optarg, NULL, 10);
+				if (opts->payload_size < PAYLOAD_MIN || opts->payload_size > PACKET_MAX - PACKET_HEADER_MAX)
+					die(1, "The payload size has to be between %zu and %d bytes\n", PAYLOAD_MIN, PACKET_MAX - PACKET_HEADER_MAX);
+				break;
+			case 'l':
+				opts->duration = strtoul(optarg, NULL, 10);
+				break;
+			case 'P':
+				if (opts->server_pid_count == SERVERS_MAX)
+					die(1, "At most %d server pids are supported\n", SERVERS_MAX);
+				opts->server_pids[opts->server_pid_count++] = strtol(optarg, NULL, 10);
+				break;
+			case '?': case 'h':
+				show_usage_and_exit(argv[0]);
+				break;
+		}
+	}
+	
+	if (optind >= argc)
+		show_usage_and_exit(argv[0]);
+	opts->servers = argv + optind;
+	opts->server_count = argc - optind;
+	if (opts->server_count > SERVERS_MAX)
+		die(1, "At most %d servers are supported\n", SERVERS_MAX);
+	
+	if (opts->talkers > opts->room_size)
+		opts->talkers = opts->room_size;
+	if (opts->active_speakers == 0 || opts->active_speakers > opts->talkers)
+		opts->active_speakers = opts->talkers;
+}
+
+void show_usage_and_exit(char *program_name){
+	die(1,
+		"%s [-n rooms] [-s room-size] [-t talkers-per-room] [-f first-room] [-a active-speakers]\n"
+		"    [-d frame-duration] [-p payload-size] [-l seconds] [-P server-pid]...\n"
+		"    [-h help]\n"
+		"    host[:port]...\n",
+		program_name
+	);
+}
+
+
+// Fan-out latency of the DATA packets, from sending to receiving
+latency_histogram_t latency = { 0 };
+
+
+//
+// Server CPU time
+//
+
+// User and system time of the process in seconds, -1 if it can't be read
+double process_cpu_seconds(pid_t pid){
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+	FILE *file = fopen(path, "r");
+	if (file == NULL)
+		return -1;
+	
+	// The command name can contain spaces, the fields we want follow the last ')'
+	char line[1024];
+	size_t len = fread(line, 1, sizeof(line) - 1, file);
+	fclose(file);
+	line[len] = '\0';
+	
+	char *rest = strrchr(line, ')');
+	unsigned long utime, stime;
+	if (rest == NULL || sscanf(rest + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2)
+		return -1;
+	return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+
+// Reads the CPU time of every server into seconds and returns the sum, -1 if one can't be read
+double servers_cpu_seconds(double *seconds){
+	double sum = 0;
+	for(size_t i = 0; i < opts.server_pid_count; i++){
+		seconds[i] = process_cpu_seconds(opts.server_pids[i]);
+		if (seconds[i] < 0)
+			return -1;
+		sum += seconds[i];
+	}
+	return sum;
+}
+
+
+//
+// Simulated clients
+//
+
+double now_in_seconds(){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+uint64_t now_in_ns(){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+void raise_fd_limit(size_t needed){
+	struct rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == -1)
+		pdie(2, "getrlimit");
+	if (limit.rlim_cur >= needed)
+		return;
+	
+	limit.rlim_cur = (needed < limit.rlim_max) ? needed : limit.rlim_max;
+	if (setrlimit(RLIMIT_NOFILE, &limit) == -1)
+		perror("setrlimit");
+	if (limit.rlim_cur < needed)
+		die(2, "Need %zu file descriptors but only %zu are allowed\n", needed, (size_t)limit.rlim_cur);
+}
+
+// Connects the client to the server and waits for its welcome
+void sim_client_connect(sim_client_p client, const struct sockaddr_in *server_addr){
+	client->fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (client->fd == -1)
+		pdie(3, "socket");
+	if ( connect(client->fd, (const struct sockaddr *)server_addr, sizeof(*server_addr)) == -1 )
+		pdie(3, "connect");
+	
+	struct timeval timeout = { .tv_sec = 0, .tv_usec = 500000 };
+	setsockopt(client->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	
+	uint8_t packet[PACKET_MAX];
+	packet_header_t header;
+	for(size_t attempt = 0; attempt < 4; attempt++){
+		size_t len = packet_pack_header(packet, PACKET_HELLO, 0, 0);
+		len += varint_pack(packet + len, client->room);
+		if ( send(client->fd, packet, len, 0) == -1 )
+			pdie(3, "send");
+		
+		ssize_t received;
+		while ( (received = recv(client->fd, packet, sizeof(packet), 0)) > 0 ){
+			if (packet_unpack_header(packet, received, &header) > 0 && header.type == PACKET_WELCOME){
+				client->user = header.user;
+				return;
+			}
+		}
+	}
+	
+	die(3, "No welcome from server for a client in room %u\n", client->room);
+}
+
+// packet has to be PACKET_MAX bytes, the payload is whatever is in it after the TOC byte and the
+// send time
+void sim_client_send_frame(sim_client_p client, uint8_t *packet){
+	size_t header_len = packet_pack_data_header(packet, client->user, client->seq++, client->level);
+	uint64_t sent = now_in_ns();
+	packet[header_len] = 0;
+	memcpy(packet + header_len + 1, &sent, sizeof(sent));
+	if ( send(client->fd, packet, header_len + opts.payload_size, MSG_DONTWAIT) == -1 && errno != EAGAIN )
+		perror("send");
+}
+
+// Reads all pending packets of the client and returns the number of DATA packets
+size_t sim_client_drain(sim_client_p client, uint8_t *packet){
+	size_t data_packets = 0;
+	packet_header_t header;
+	while (true){
+		ssize_t bytes_received = recv(client->fd, packet, PACKET_MAX, MSG_DONTWAIT);
+		if (bytes_received == -1){
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				perror("recv");
+			break;
+		}
+		
+		size_t header_len = packet_unpack_header(packet, bytes_received, &header);
+		if (header_len == 0 || header.type != PACKET_DATA)
+			continue;
+		data_packets++;
+		
+		uint64_t sent;
+		if ((size_t)bytes_received >= header_len + PAYLOAD_MIN){
+			memcpy(&sent, packet + header_len + 1, sizeof(sent));
+			latency_add(&latency, (now_in_ns() - sent) / 1000);
+		}
+	}
+	
+	client->packets_received += data_packets;
+	return data_packets;
+}
+
+
+int main(int argc, char **argv){
+	parse_options(argc, argv, &opts);
+	
+	size_t client_count = opts.rooms * opts.room_size;
+	raise_fd_limit(client_count + 16);
+	
+	// Search for the servers
+	struct sockaddr_in server_addrs[SERVERS_MAX];
+	for(size_t i = 0; i < opts.server_count; i++){
+		char *host = opts.servers[i], *port = "61234";
+		char *colon = strchr(host, ':');
+		if (colon != NULL){
+			host = strndup(host, colon - host);
+			port = colon + 1;
+		}
+		
+		struct addrinfo hints = {0};
+		hints.ai_family = AF_INET;
+		hints.ai_socktype = SOCK_DGRAM;
+		struct addrinfo *addr_info;
+		int error_code = getaddrinfo(host, port, &hints, &addr_info);
+		if (error_code != 0)
+			die(3, "getaddrinfo failed for %s: %s\n", opts.servers[i], gai_strerror(error_code));
+		memcpy(&server_addrs[i], addr_info->ai_addr, sizeof(server_addrs[i]));
+		freeaddrinfo(addr_info);
+	}
+	
+	// Connect all clients, the first ones of each room talk
+	sim_client_p clients = calloc(client_count, sizeof(sim_client_t));
+	int epoll_fd = epoll_create1(0);
+	if (epoll_fd == -1)
+		pdie(2, "epoll_create1");
+	
+	for(size_t i = 0; i < client_count; i++){
+		sim_client_p client = &clients[i];
+		client->server = (i % opts.room_size) % opts.server_count;
+		client->room = opts.first_room + i / opts.room_size;
+		client->talker = (i % opts.room_size) < opts.talkers;
+		client->level = 10 + 10 * (i % opts.room_size);
+		sim_client_connect(client, &server_addrs[client->server]);
+		
+		struct epoll_event event = { .events = EPOLLIN, .data.ptr = client };
+		if ( epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client->fd, &event) == -1 )
+			pdie(2, "epoll_ctl");
+	}
+	notice("%zu clients connected in %zu rooms, %zu talkers per room, %zu servers\n", client_count, opts.rooms, opts.talkers, opts.server_count);
+	
+	// Frame timer, paces the talkers
+	int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	if (timer_fd == -1)
+		pdie(2, "timerfd_create");
+	long frame_ns = opts.frame_duration * 100000L;
+	struct itimerspec interval = {
+		.it_interval = { frame_ns / 1000000000L, frame_ns % 1000000000L },
+		.it_value = { frame_ns / 1000000000L, frame_ns % 1000000000L }
+	};
+	if ( timerfd_settime(timer_fd, 0, &interval, NULL) == -1 )
+		pdie(2, "timerfd_settime");
+	struct epoll_event timer_event = { .events = EPOLLIN, .data.ptr = NULL };
+	if ( epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &timer_event) == -1 )
+		pdie(2, "epoll_ctl");
+	
+	// Drop JOIN packets of the setup phase
+	uint8_t packet[PACKET_MAX];
+	memset(packet, 0, sizeof(packet));
+	for(size_t i = 0; i < client_count; i++)
+		sim_client_drain(&clients[i], packet);
+	
+	size_t packets_sent = 0, packets_received = 0;
+	double server_cpu_starts[SERVERS_MAX], server_cpu_ends[SERVERS_MAX];
+	double server_cpu_start = opts.server_pid_count ? servers_cpu_seconds(server_cpu_starts) : -1;
+	struct rusage usage_start;
+	getrusage(RUSAGE_SELF, &usage_start);
+	double start = now_in_seconds(), send_end = start + opts.duration, end = send_end + 0.5;
+	double last_keepalive = start;
+	bool sending = true;
+	
+	struct epoll_event events[256];
+	while (true){
+		double now = now_in_seconds();
+		if (sending && now >= send_end){
+			// Stop the talkers and give the last packets some time to arrive
+			struct itimerspec off = { 0 };
+			timerfd_settime(timer_fd, 0, &off, NULL);
+			sending = false;
+		}
+		if (now >= end)
+			break;
+		
+		// Listeners send nothing else, without keepalives the server would drop them on long runs
+		if (now - last_keepalive >= KEEPALIVE_INTERVAL / 1000.0){
+			for(size_t i = 0; i < client_count; i++){
+				if (clients[i].talker && sending)
+					continue;
+				size_t len = packet_pack_header(packet, PACKET_KEEPALIVE, clients[i].user, 0);
+				if ( send(clients[i].fd, packet, len, MSG_DONTWAIT) == -1 && errno != EAGAIN )
+					perror("send");
+			}
+			last_keepalive = now;
+		}
+		
+		int event_count = epoll_wait(epoll_fd, events, sizeof(events) / sizeof(events[0]), 100);
+		if (event_count == -1){
+			if (errno == EINTR)
+				continue;
+			pdie(2, "epoll_wait");
+		}
+		
+		for(int e = 0; e < event_count; e++){
+			if (events[e].data.ptr == NULL){
+				uint64_t expirations = 0;
+				if ( read(timer_fd, &expirations, sizeof(expirations)) != sizeof(expirations) )
+					continue;
+				
+				// Catch up if we fell behind so the offered load stays the same
+				for(uint64_t n = 0; n < expirations; n++){
+					for(size_t i = 0; i < client_count; i++){
+						if (!clients[i].talker)
+							continue;
+						sim_client_send_frame(&clients[i], packet);
+						packets_sent++;
+					}
+				}
+			} else {
+				packets_received += sim_client_drain(events[e].data.ptr, packet);
+			}
+		}
+	}
+	
+	double elapsed = send_end - start;
+	size_t expected = opts.talkers ? packets_sent * (opts.room_size - 1) / opts.talkers * opts.active_speakers : 0;
+	printf("rooms: %zu, room size: %zu, talkers per room: %zu, frame duration: %.1f ms, payload: %zu bytes\n",
+		opts.rooms, opts.room_size, opts.talkers, opts.frame_duration / 10.0, opts.payload_size);
+	printf("sent: %zu packets, %.0f packets/s\n", packets_sent, packets_sent / elapsed);
+	printf("delivered: %zu of %zu packets (%.2f%%), %.0f packets/s\n",
+		packets_received, expected, expected ? packets_received * 100.0 / expected : 0.0, packets_received / elapsed);
+	printf("latency: p50 %lu us, p99 %lu us, p999 %lu us, max %lu us\n",
+		(unsigned long)latency_percentile(&latency, 50), (unsigned long)latency_percentile(&latency, 99),
+		(unsigned long)latency_percentile(&latency, 99.9), (unsigned long)latency.max);
+	
+	// The server handles every sent packet once and every delivered one once more. Linked servers
+	// also pass packets between them, that's part of their cost per packet.
+	double server_cpu_end = opts.server_pid_count ? servers_cpu_seconds(server_cpu_ends) : -1;
+	if (server_cpu_start >= 0 && server_cpu_end >= 0){
+		double cpu = server_cpu_end - server_cpu_start;
+		printf("server cpu: %.2f s (%.1f%% of one core), %.0f ns per packet in or out\n",
+			cpu, cpu * 100 / (end - start), (packets_sent + packets_received) ? cpu * 1e9 / (packets_sent + packets_received) : 0.0);
+		if (opts.server_pid_count > 1){
+			printf("  per server:");
+			for(size_t i = 0; i < opts.server_pid_count; i++)
+				printf(" %.1f%%", (server_cpu_ends[i] - server_cpu_starts[i]) * 100 / (end - start));
+			printf(" of one core\n");
+		}
+	} else if (opts.server_pid_count) {
+		notice("Could not read the CPU time of the server processes\n");
+	}
+	
+	struct rusage usage_end;
+	getrusage(RUSAGE_SELF, &usage_end);
+	double own_cpu = (usage_end.ru_utime.tv_sec - usage_start.ru_utime.tv_sec) + (usage_end.ru_utime.tv_usec - usage_start.ru_utime.tv_usec) / 1e6
+		+ (usage_end.ru_stime.tv_sec - usage_start.ru_stime.tv_sec) + (usage_end.ru_stime.tv_usec - usage_start.ru_stime.tv_usec) / 1e6;
+	printf("loadgen cpu: %.2f s (%.1f%% of one core)\n", own_cpu, own_cpu * 100 / (end - start));
+	
+	// Disconnect everyone
+	for(size_t i = 0; i < client_count; i++){
+		size_t len = packet_pack_header(packet, PACKET_BYE, clients[i].user, 0);
+		send(clients[i].fd, packet, len, 0);
+		close(clients[i].fd);
+	}
+	
+	close(timer_fd);
+	close(epoll_fd);
+	free(clients);
+	
+	return 0;
+}
\ No newline at end of file
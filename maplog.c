@@ -0,0 +1,84 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include "maplog.h"
+
+// Maps the window at offset. The blocks of the window are allocated first: a sparse file would only
+// find out that the disk is full when a page is written back, and a write fault on a page the file
+// system can't back raises SIGBUS.
+static bool maplog_map(maplog_p log, size_t offset){
+	int error = posix_fallocate(log->fd, offset, log->map_size);
+	if (error != 0){
+		errno = error;
+		return false;
+	}
+	
+	uint8_t *map = mmap(NULL, log->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, log->fd, offset);
+	if (map == MAP_FAILED)
+		return false;
+	
+	log->map = map;
+	log->map_offset = offset;
+	log->map_used = 0;
+	return true;
+}
+
+bool maplog_open(maplog_p log, const char *path, size_t map_size){
+	*log = (maplog_t){ .map_size = map_size };
+	log->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (log->fd == -1)
+		return false;
+	
+	if ( !maplog_map(log, 0) ){
+		int error = errno;
+		close(log->fd);
+		unlink(path);
+		errno = error;
+		return false;
+	}
+	
+	return true;
+}
+
+bool maplog_append(maplog_p log, const void *data, size_t len){
+	const uint8_t *bytes = data;
+	while (len > 0){
+		if (log->map == NULL)
+			return false;
+		if (log->map_used == log->map_size){
+			munmap(log->map, log->map_size);
+			log->map = NULL;
+			if ( !maplog_map(log, log->map_offset + log->map_size) )
+				return false;
+		}
+		
+		size_t chunk = log->map_size - log->map_used;
+		if (chunk > len)
+			chunk = len;
+		memcpy(log->map + log->map_used, bytes, chunk);
+		log->map_used += chunk;
+		bytes += chunk;
+		len -= chunk;
+	}
+	
+	return true;
+}
+
+size_t maplog_size(maplog_p log){
+	return log->map_offset + log->map_used;
+}
+
+bool maplog_close(maplog_p log){
+	bool closed = true;
+	if (log->map)
+		munmap(log->map, log->map_size);
+	if ( ftruncate(log->fd, maplog_size(log)) == -1 )
+		closed = false;
+	close(log->fd);
+	log->map = NULL;
+	return closed;
+}
\ No newline at end of file
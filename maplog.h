@@ -0,0 +1,32 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+
+An append only file written through a memory mapped window. The window is moved along (and the
+file extended) as the file grows, so appending is a memcpy() and the kernel writes the data back on
+its own time. The disk blocks of a window are reserved before it's mapped, a full disk or quota
+makes the append fail instead of raising SIGBUS in the writing thread. Closing the log truncates
+the file to the size that was written. A log must only be used by one thread.
+
+*/
+
+typedef struct {
+	int fd;
+	uint8_t *map;
+	size_t map_size;    // of the window, the file grows in steps of this size
+	size_t map_offset;  // file offset of the window
+	size_t map_used;    // bytes written into the window
+} maplog_t, *maplog_p;
+
+// Creates the file, map_size has to be a multiple of the page size. Returns false and sets errno if
+// that failed.
+bool maplog_open(maplog_p log, const char *path, size_t map_size);
+// Returns false on write errors (the file couldn't be extended), every later append fails as well
+bool maplog_append(maplog_p log, const void *data, size_t len);
+// Bytes written so far
+size_t maplog_size(maplog_p log);
+// Truncates the file to what was written and closes it, returns false if that failed
+bool maplog_close(maplog_p log);
\ No newline at end of file
@@ -0,0 +1,249 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdarg.h>
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <getopt.h>
+
+#include "metrics.h"
+
+/*
+
+Reads the metrics a running server keeps in shared memory and prints them in the Prometheus text
+format, ready for the textfile collector of the node exporter or anything that scrapes text. The
+segment is mapped read only, reading never blocks the server. With an interval the counters are
+read twice and per client packet rates are added.
+
+*/
+
+typedef struct {
+	char *port;
+	double interval;  // in seconds, 0 to skip the rates
+} options_t, *options_p;
+
+options_t opts;
+
+void parse_options(int argc, char **argv, options_p opts);
+void show_usage_and_exit(char *program_name);
+void die(int status, const char *format, ...);
+void pdie(int status, const char *message);
+
+
+//
+// Output functions
+//
+
+void die(int status, const char *format, ...){
+	va_list args;
+	va_start(args, format);
+	vfprintf(stderr, format, args);
+	va_end(args);
+	exit(status);
+}
+
+void pdie(int status, const char *message){
+	perror(message);
+	exit(status);
+}
+
+
+//
+// Argument parsing stuff
+//
+
+void parse_options(int argc, char **argv, options_p opts){
+	*opts = (options_t){ .port = NULL, .interval = 0 };
+	
+	int opt_char;
+	struct option longopts[] = {
+		{"interval", required_argument, NULL, 'i'},
+		{"help", no_argument, NULL, 'h'},
+		{0, 0, 0, 0}
+	};
+	while( (opt_char = getopt_long(argc, argv, "i:h", longopts, NULL)) != -1 ){
+		switch(opt_char){
+			case 'i':
+				opts->interval = strtod(optarg, NULL);
+				if (opts->interval < 0)
+					die(1, "The interval can't be negative\n");
+				break;
+			case '?': case 'h':
+				show_usage_and_exit(argv[0]);
+				break;
+		}
+	}
+	
+	if (optind != argc - 1)
+		show_usage_and_exit(argv[0]);
+	opts->port = argv[optind];
+}
+
+void show_usage_and_exit(char *program_name){
+	die(1,
+		"%s [-i interval] [-h help] server-port\n",
+		program_name
+	);
+}
+
+
+//
+// Output
+//
+
+uint64_t now_in_ms(){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000ULL + now.tv_nsec / 1000000;
+}
+
+// Tries to copy a slot that's rewritten right now a few times before giving up on it
+#define READ_CLIENT_ATTEMPTS  4
+
+// Copies the client data and returns false if the slot isn't in use or kept changing while reading.
+// It's the read side of the seqlock in metrics_client_connected() of the server.
+bool read_client(const metrics_client_t *shared, metrics_client_p client){
+	for(size_t attempt = 0; attempt < READ_CLIENT_ATTEMPTS; attempt++){
+		uint64_t generation = __atomic_load_n(&shared->generation, __ATOMIC_ACQUIRE);
+		if (generation & 1)
+			continue;
+		
+		*client = (metrics_client_t){
+			.generation = generation,
+			.addr = __atomic_load_n(&shared->addr, __ATOMIC_RELAXED),
+			.port = __atomic_load_n(&shared->port, __ATOMIC_RELAXED),
+			.user = __atomic_load_n(&shared->user, __ATOMIC_RELAXED),
+			.connected = __atomic_load_n(&shared->connected, __ATOMIC_RELAXED),
+			.room = __atomic_load_n(&shared->room, __ATOMIC_RELAXED),
+			.connected_at = metrics_get(&shared->connected_at), .last_seen = metrics_get(&shared->last_seen),
+			.packets_in = metrics_get(&shared->packets_in), .bytes_in = metrics_get(&shared->bytes_in)
+		};
+		
+		// Keeps the copy ahead of the second load, a changed generation means it may be torn
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (metrics_get(&shared->generation) != generation)
+			continue;
+		// A disconnect doesn't touch the generation, check the flag again after the copy
+		return client->connected && __atomic_load_n(&shared->connected, __ATOMIC_ACQUIRE);
+	}
+	return false;
+}
+
+void print_worker_counter(const char *name, const char *help, const metrics_t *m, size_t offset){
+	printf("# HELP voice_%s %s\n# TYPE voice_%s counter\n", name, help, name);
+	for(size_t w = 0; w < m->worker_count; w++){
+		const uint64_t *counter = (const uint64_t*)((const uint8_t*)&m->workers[w] + offset);
+		printf("voice_%s{worker=\"%zu\"} %lu\n", name, w, (unsigned long)metrics_get(counter));
+	}
+}
+
+int main(int argc, char **argv){
+	parse_options(argc, argv, &opts);
+	
+	char name[32];
+	snprintf(name, sizeof(name), "/voice-server-%s", opts.port);
+	int fd = shm_open(name, O_RDONLY, 0);
+	if (fd == -1)
+		pdie(2, "shm_open");
+	const metrics_t *m = mmap(NULL, sizeof(metrics_t), PROT_READ, MAP_SHARED, fd, 0);
+	if (m == MAP_FAILED)
+		pdie(2, "mmap");
+	close(fd);
+	
+	if (__atomic_load_n(&m->magic, __ATOMIC_ACQUIRE) != METRICS_MAGIC || m->version != METRICS_VERSION)
+		die(2, "%s is not a metrics segment of this server version\n", name);
+	if (m->worker_count > METRICS_WORKERS_MAX)
+		die(2, "Invalid worker count in %s\n", name);
+	
+	// First look at the client counters for the rates
+	static metrics_client_t before[METRICS_CLIENTS_MAX];
+	static bool before_valid[METRICS_CLIENTS_MAX];
+	uint64_t before_time = now_in_ms();
+	if (opts.interval > 0){
+		for(size_t i = 0; i < METRICS_CLIENTS_MAX; i++)
+			before_valid[i] = read_client(&m->clients[i], &before[i]);
+		
+		struct timespec pause = { (time_t)opts.interval, (long)((opts.interval - (time_t)opts.interval) * 1e9) };
+		while ( nanosleep(&pause, &pause) == -1 && errno == EINTR )
+			;
+	}
+	uint64_t now = now_in_ms();
+	
+	bool up = (kill(m->pid, 0) == 0 || errno == EPERM);
+	printf("# HELP voice_server_up 1 if the server process that owns the metrics is running\n# TYPE voice_server_up gauge\n");
+	printf("voice_server_up{port=\"%hu\"} %d\n", m->port, up ? 1 : 0);
+	printf("# HELP voice_server_uptime_seconds Time since the server started\n# TYPE voice_server_uptime_seconds gauge\n");
+	printf("voice_server_uptime_seconds %.3f\n", (now - m->started_at) / 1000.0);
+	
+	print_worker_counter("packets_in_total", "Datagrams received", m, offsetof(metrics_worker_t, packets_in));
+	print_worker_counter("bytes_in_total", "Bytes received", m, offsetof(metrics_worker_t, bytes_in));
+	print_worker_counter("packets_out_total", "Datagrams sent", m, offsetof(metrics_worker_t, packets_out));
+	print_worker_counter("bytes_out_total", "Bytes sent", m, offsetof(metrics_worker_t, bytes_out));
+	print_worker_counter("send_failures_total", "Failed sendmmsg() and sendto() calls", m, offsetof(metrics_worker_t, send_failures));
+	print_worker_counter("truncated_total", "Dropped datagrams larger than a packet", m, offsetof(metrics_worker_t, truncated));
+	print_worker_counter("invalid_total", "Dropped datagrams with an invalid header", m, offsetof(metrics_worker_t, invalid));
+	print_worker_counter("expired_total", "Clients dropped because they weren't heard from", m, offsetof(metrics_worker_t, expired));
+	
+	// Buckets are 0, 1, 2-3, 4-7, ... so the upper bounds are 2^i - 1
+	printf("# HELP voice_fanout_width Recipients of each forwarded packet\n# TYPE voice_fanout_width histogram\n");
+	uint64_t cumulative = 0;
+	for(size_t b = 0; b < METRICS_FANOUT_BUCKETS; b++){
+		for(size_t w = 0; w < m->worker_count; w++)
+			cumulative += metrics_get(&m->workers[w].fanout[b]);
+		if (b < METRICS_FANOUT_BUCKETS - 1)
+			printf("voice_fanout_width_bucket{le=\"%lu\"} %lu\n", (1UL << b) - 1, (unsigned long)cumulative);
+		else
+			printf("voice_fanout_width_bucket{le=\"+Inf\"} %lu\n", (unsigned long)cumulative);
+	}
+	printf("voice_fanout_width_count %lu\n", (unsigned long)cumulative);
+	
+	// Per client, the labels identify the connection
+	size_t client_count = 0;
+	static metrics_client_t clients[METRICS_CLIENTS_MAX];
+	static bool valid[METRICS_CLIENTS_MAX];
+	for(size_t i = 0; i < METRICS_CLIENTS_MAX; i++){
+		valid[i] = read_client(&m->clients[i], &clients[i]);
+		if (valid[i])
+			client_count++;
+	}
+	printf("# HELP voice_clients Connected clients\n# TYPE voice_clients gauge\nvoice_clients %zu\n", client_count);
+	
+	const char *client_metrics[] = { "packets_in_total", "bytes_in_total", "last_seen_seconds", "connected_seconds", "packets_per_second" };
+	const char *client_types[] = { "counter", "counter", "gauge", "gauge", "gauge" };
+	for(size_t k = 0; k < sizeof(client_metrics) / sizeof(client_metrics[0]); k++){
+		bool rate = (k == 4);
+		if (rate && opts.interval == 0)
+			break;
+		
+		printf("# TYPE voice_client_%s %s\n", client_metrics[k], client_types[k]);
+		for(size_t i = 0; i < METRICS_CLIENTS_MAX; i++){
+			metrics_client_p c = &clients[i];
+			if (!valid[i] || (rate && (!before_valid[i] || before[i].generation != c->generation)))
+				continue;
+			
+			struct in_addr addr = { c->addr };
+			printf("voice_client_%s{slot=\"%zu\",addr=\"%s:%hu\",room=\"%u\",user=\"%hhu\"} ",
+				client_metrics[k], i, inet_ntoa(addr), ntohs(c->port), c->room, c->user);
+			switch(k){
+				case 0: printf("%lu\n", (unsigned long)c->packets_in); break;
+				case 1: printf("%lu\n", (unsigned long)c->bytes_in); break;
+				case 2: printf("%.3f\n", (now > c->last_seen) ? (now - c->last_seen) / 1000.0 : 0.0); break;
+				case 3: printf("%.3f\n", (now > c->connected_at) ? (now - c->connected_at) / 1000.0 : 0.0); break;
+				case 4: printf("%.1f\n", (c->packets_in - before[i].packets_in) * 1000.0 / (now - before_time)); break;
+			}
+		}
+	}
+	
+	return 0;
+}
\ No newline at end of file
@@ -0,0 +1,85 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+
+Runtime metrics of the server in a shared memory segment. The server creates it as
+/voice-server-<port> with shm_open() (so it shows up in /dev/shm) and the metrics tool maps it read
+only. Exporters can scrape the tool's output or map the segment themselves. The segment lists the
+addresses of the clients, so it's only readable by the user and group of the server (mode 0640).
+The server removes it when stopped with SIGINT or SIGTERM. A segment left over by a killed server is
+replaced by the next one on that port, the segment of a running server is never touched.
+
+Nothing is locked. Every counter has exactly one writer: each worker has its own block and a client
+slot is only written by the worker that gets the packets of that client (SO_REUSEPORT hashes the
+4-tuple). Writers store with relaxed atomics and readers load the same way, so a reader may see a
+counter a bit behind but never a torn value. The address, user and room of a client slot are
+guarded by a seqlock: the server makes the generation odd before it rewrites a reused slot and even
+again (with release order) afterwards. Readers load the generation with acquire, copy the slot,
+fence with acquire and load the generation again. The copy is only consistent if both loads saw the
+same even value, otherwise retry. The traffic counters of a client keep counting outside of it.
+
+Times are CLOCK_MONOTONIC milliseconds, the clock is system wide so readers can compare them to
+their own.
+
+*/
+
+#define METRICS_MAGIC  0x31766376  // "vcv1"
+#define METRICS_VERSION  3
+#define METRICS_WORKERS_MAX  64
+#define METRICS_CLIENTS_MAX  4096
+// Fan-out widths 0, 1, 2-3, 4-7, ..., 256 and more
+#define METRICS_FANOUT_BUCKETS  10
+
+typedef struct {
+	uint64_t packets_in, bytes_in;
+	uint64_t packets_out, bytes_out;
+	uint64_t send_failures;
+	uint64_t truncated, invalid;  // datagrams dropped because they were too large or not ours
+	uint64_t expired;  // clients dropped after the timeout
+	uint64_t fanout[METRICS_FANOUT_BUCKETS];  // recipients per forwarded packet
+} __attribute__ ((aligned (64))) metrics_worker_t, *metrics_worker_p;
+
+typedef struct {
+	uint64_t generation;  // seqlock, odd while the slot is rewritten on a connect
+	uint32_t addr;        // IPv4 address in network byte order
+	uint16_t port;        // in network byte order
+	uint8_t user, connected;
+	uint32_t room;
+	uint64_t connected_at, last_seen;
+	uint64_t packets_in, bytes_in;
+} __attribute__ ((aligned (64))) metrics_client_t, *metrics_client_p;
+
+typedef struct {
+	uint32_t magic, version;
+	uint32_t pid;
+	uint16_t port;
+	uint16_t worker_count;
+	uint64_t started_at;
+	metrics_worker_t workers[METRICS_WORKERS_MAX];
+	metrics_client_t clients[METRICS_CLIENTS_MAX];
+} metrics_t, *metrics_p;
+
+
+// Only for counters with a single writer, it's a plain load and store instead of a locked add
+static inline void metrics_add(uint64_t *counter, uint64_t value){
+	__atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+}
+
+static inline void metrics_set(uint64_t *value, uint64_t new_value){
+	__atomic_store_n(value, new_value, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t metrics_get(const uint64_t *value){
+	return __atomic_load_n(value, __ATOMIC_RELAXED);
+}
+
+static inline size_t metrics_fanout_bucket(size_t recipients){
+	size_t bucket = 0;
+	while (recipients > 0 && bucket < METRICS_FANOUT_BUCKETS - 1){
+		recipients >>= 1;
+		bucket++;
+	}
+	return bucket;
+}
\ No newline at end of file
@@ -0,0 +1,59 @@
+#include <math.h>
+#include "mix.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+
+static inline int16_t saturate(int32_t sample){
+	if (sample > INT16_MAX)
+		return INT16_MAX;
+	if (sample < INT16_MIN)
+		return INT16_MIN;
+	return sample;
+}
+
+void mix_add2(int16_t *dst, const int16_t *a, const int16_t *b, size_t count){
+	size_t i = 0;
+
+#if defined(__SSE2__)
+	for(; i + 8 <= count; i += 8){
+		__m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+		__m128i vb = _mm_loadu_si128((const __m128i*)(b + i));
+		_mm_storeu_si128((__m128i*)(dst + i), _mm_adds_epi16(va, vb));
+	}
+#elif defined(__ARM_NEON)
+	for(; i + 8 <= count; i += 8)
+		vst1q_s16(dst + i, vqaddq_s16(vld1q_s16(a + i), vld1q_s16(b + i)));
+#endif
+
+	// Remaining samples (or all of them without SIMD)
+	for(; i < count; i++)
+		dst[i] = saturate((int32_t)a[i] + b[i]);
+}
+
+void mix_add(int16_t *dst, const int16_t *src, size_t count){
+	mix_add2(dst, dst, src, count);
+}
+
+double mix_level_dbfs(const int16_t *samples, size_t count){
+	int64_t sum = 0;
+	for(size_t i = 0; i < count; i++)
+		sum += (int32_t)samples[i] * samples[i];
+	if (sum == 0)
+		return -100;
+	return 10 * log10((double)sum / count / (32768.0 * 32768.0));
+}
+
+const char* mix_kernel_name(){
+#if defined(__SSE2__)
+	return "sse2";
+#elif defined(__ARM_NEON)
+	return "neon";
+#else
+	return "scalar";
+#endif
+}
\ No newline at end of file
@@ -0,0 +1,23 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+
+Mixing kernels and the level meter shared by the server (MCU mode) and the client. Samples are
+interleaved int16 and mixed with saturating adds so a loud room clips instead of wrapping around.
+The kernels use SSE2 or NEON when the compiler targets them and fall back to plain C otherwise.
+
+*/
+
+// dst[i] = saturate(dst[i] + src[i]) for count samples
+void mix_add(int16_t *dst, const int16_t *src, size_t count);
+
+// dst[i] = saturate(a[i] + b[i]) for count samples
+void mix_add2(int16_t *dst, const int16_t *a, const int16_t *b, size_t count);
+
+// Level of the samples in dBFS (RMS relative to full scale), -100 for digital silence
+double mix_level_dbfs(const int16_t *samples, size_t count);
+
+// Name of the kernel variant that was compiled in, for benchmark output
+const char* mix_kernel_name();
\ No newline at end of file
@@ -0,0 +1,144 @@
+#include <string.h>
+#include <errno.h>
+
+#include "ogg.h"
+
+// Samples the decoder drops at the start, what libopus encoders put in (at 48 kHz)
+#define OPUS_PRE_SKIP  312
+
+#define PAGE_FLAG_BOS  0x02
+#define PAGE_FLAG_EOS  0x04
+
+
+//
+// Pages
+//
+
+static uint32_t crc_table[256];
+
+// CRC-32 of Ogg: polynomial 0x04c11db7, no reflection, starts at 0
+static void crc_init(){
+	for(uint32_t i = 0; i < 256; i++){
+		uint32_t r = i << 24;
+		for(int bit = 0; bit < 8; bit++)
+			r = (r & 0x80000000) ? (r << 1) ^ 0x04c11db7 : (r << 1);
+		crc_table[i] = r;
+	}
+}
+
+static uint32_t crc_update(uint32_t crc, const uint8_t *data, size_t len){
+	for(size_t i = 0; i < len; i++)
+		crc = (crc << 8) ^ crc_table[((crc >> 24) ^ data[i]) & 0xff];
+	return crc;
+}
+
+static void put_le32(uint8_t *buffer, uint32_t value){
+	for(int i = 0; i < 4; i++)
+		buffer[i] = value >> (8 * i);
+}
+
+static void put_le64(uint8_t *buffer, uint64_t value){
+	for(int i = 0; i < 8; i++)
+		buffer[i] = value >> (8 * i);
+}
+
+// Writes the collected packets as one page, the granule position is the end of its last packet
+static bool page_flush(ogg_opus_p ogg, uint8_t flags){
+	uint8_t header[27 + 255];
+	memcpy(header, "OggS", 4);
+	header[4] = 0;
+	header[5] = flags;
+	put_le64(header + 6, ogg->granule);
+	put_le32(header + 14, ogg->serial);
+	put_le32(header + 18, ogg->page_seq++);
+	put_le32(header + 22, 0);
+	header[26] = ogg->segment_count;
+	memcpy(header + 27, ogg->segments, ogg->segment_count);
+	size_t header_len = 27 + ogg->segment_count;
+	
+	uint32_t crc = crc_update(0, header, header_len);
+	crc = crc_update(crc, ogg->page_data, ogg->page_len);
+	put_le32(header + 22, crc);
+	
+	bool written = maplog_append(&ogg->log, header, header_len) && maplog_append(&ogg->log, ogg->page_data, ogg->page_len);
+	ogg->segment_count = ogg->page_len = ogg->page_packets = 0;
+	return written;
+}
+
+// Adds the packet to the current page, a packet is split into lacing values of 255 bytes
+static void page_add(ogg_opus_p ogg, const uint8_t *packet, size_t len){
+	size_t remaining = len;
+	while (remaining >= 255){
+		ogg->segments[ogg->segment_count++] = 255;
+		remaining -= 255;
+	}
+	ogg->segments[ogg->segment_count++] = remaining;
+	
+	memcpy(ogg->page_data + ogg->page_len, packet, len);
+	ogg->page_len += len;
+	ogg->page_packets++;
+}
+
+
+//
+// Ogg Opus streams
+//
+
+bool ogg_opus_open(ogg_opus_p ogg, const char *path, uint8_t channel_count, uint32_t serial){
+	if (crc_table[1] == 0)
+		crc_init();
+	
+	*ogg = (ogg_opus_t){ .serial = serial };
+	if ( !maplog_open(&ogg->log, path, OGG_MAP_SIZE) )
+		return false;
+	
+	// Identification header, mapping family 0 (mono or stereo), the input rate is unknown to us
+	uint8_t head[19];
+	memcpy(head, "OpusHead", 8);
+	head[8] = 1;
+	head[9] = channel_count;
+	head[10] = OPUS_PRE_SKIP & 0xff;
+	head[11] = OPUS_PRE_SKIP >> 8;
+	put_le32(head + 12, 48000);
+	head[16] = head[17] = 0;
+	head[18] = 0;
+	page_add(ogg, head, sizeof(head));
+	page_flush(ogg, PAGE_FLAG_BOS);
+	
+	// Comment header without comments
+	const char vendor[] = "arkanis voice chat";
+	uint8_t tags[8 + 4 + sizeof(vendor) - 1 + 4];
+	memcpy(tags, "OpusTags", 8);
+	put_le32(tags + 8, sizeof(vendor) - 1);
+	memcpy(tags + 12, vendor, sizeof(vendor) - 1);
+	put_le32(tags + 12 + sizeof(vendor) - 1, 0);
+	page_add(ogg, tags, sizeof(tags));
+	if ( !page_flush(ogg, 0) ){
+		int error = errno;
+		maplog_close(&ogg->log);
+		errno = error;
+		return false;
+	}
+	
+	return true;
+}
+
+bool ogg_opus_write(ogg_opus_p ogg, const uint8_t *packet, size_t len, uint32_t samples){
+	if (len > OGG_PAGE_DATA_MAX - OGG_PAGE_TARGET)
+		return false;
+	
+	// A packet never spans two pages, the page is flushed before it would get too large
+	bool written = true;
+	if (ogg->page_packets > 0 && (ogg->page_len + len > OGG_PAGE_TARGET || ogg->segment_count + len / 255 + 1 > 255))
+		written = page_flush(ogg, 0);
+	
+	page_add(ogg, packet, len);
+	ogg->granule += samples;
+	return written;
+}
+
+bool ogg_opus_close(ogg_opus_p ogg){
+	// The last page carries the end of stream flag, an empty one if there is nothing left
+	bool written = page_flush(ogg, PAGE_FLAG_EOS);
+	return maplog_close(&ogg->log) && written;
+}
\ No newline at end of file
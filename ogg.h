@@ -0,0 +1,39 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "maplog.h"
+
+/*
+
+Writes Ogg Opus files (RFC 7845) from Opus packets as they came in, nothing is decoded or encoded.
+Several packets are collected into one page to keep the container overhead low.
+
+The file is written through a memory mapped append log (see maplog.h), so appending a page is a
+memcpy(). A file must only be used by one thread.
+
+*/
+
+// Size of the mapped window, the file grows in steps of this size
+#define OGG_MAP_SIZE  (1024 * 1024)
+// Pages are flushed once they'd get larger than this
+#define OGG_PAGE_TARGET  4096
+#define OGG_PAGE_DATA_MAX  (OGG_PAGE_TARGET + 2048)
+
+typedef struct {
+	maplog_t log;
+	
+	uint32_t serial, page_seq;
+	uint64_t granule;  // end of the last packet in 48 kHz samples
+	uint8_t segments[255];
+	size_t segment_count, page_len, page_packets;
+	uint8_t page_data[OGG_PAGE_DATA_MAX];
+} ogg_opus_t, *ogg_opus_p;
+
+// Creates the file and writes the Opus headers. Returns false and sets errno if that failed.
+bool ogg_opus_open(ogg_opus_p ogg, const char *path, uint8_t channel_count, uint32_t serial);
+// Appends one Opus packet that decodes to samples (at 48 kHz). Returns false on write errors.
+bool ogg_opus_write(ogg_opus_p ogg, const uint8_t *packet, size_t len, uint32_t samples);
+// Writes the last page and closes the file, returns false if not everything could be written
+bool ogg_opus_close(ogg_opus_p ogg);
\ No newline at end of file
@@ -1,16 +1,239 @@
 #pragma once
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
-typedef struct {
-	uint8_t type;
-	uint8_t user;
-	uint16_t seq;
-	uint16_t len;
-	uint8_t data[8192];
-} packet_t, *packet_p;
+/*
+
+Wire format, version 2
+
+Every datagram starts with a compact header, the payload is the rest of the datagram. There is no
+length field, the length follows from the datagram size.
+
+	byte 0    protocol version (upper 3 bits) and packet type (lower 5 bits)
+	byte 1    user id, only unique within a room
+	byte 2-3  sequence number (little endian), DATA and SILENCE packets only
+	byte 4    audio level of the frames in -dBFS (0 to 127, 127 is silence), DATA packets only
+
+Datagrams with another version are ignored. Numbers in control payloads are varints: 7 bits per
+byte, least significant group first, the high bit is set if another byte follows.
+
+	HELLO    [room varint], clients that send no room end up in room 0
+	REPORT   [loss percent byte][jitter varint], see report_t
+	SILENCE  [noise level int8], background level in dBFS while the sender is silent
+	PING     [opaque data, up to PING_PAYLOAD_MAX bytes]
+	PONG     the data of the PING it answers
+	KEEPALIVE  no payload
+
+A sender that stops talking sends SILENCE instead of DATA, its seq is the one the next DATA packet
+will have. It's repeated as keepalive while the sender stays silent but the server only forwards
+the first one. The next DATA packet ends the silence.
+
+The audio level is measured by the sender before encoding, like the RTP header extension of RFC
+6464, for packets with several frames it's the one of the loudest frame. The server uses it to
+pick the active speakers without decoding anything. Receivers can ignore it.
+
+Clients send PING packets to measure the round trip time to the server. The server answers right
+away with a PONG that carries the same data, usually the send time of the client. Only connected
+clients get an answer so the server can't be used to reflect traffic to someone else.
+
+The server drops clients it hasn't heard from for a while (they crashed or lost the network without
+a BYE) and tells their room with a BYE. Any packet counts, clients that have nothing else to send
+send a KEEPALIVE every KEEPALIVE_INTERVAL. That also keeps the mapping of NAT routers between
+client and server open.
+
+Servers (nodes) can link up to spread a room over several machines. Every node has a random
+nonzero node id. A node links to another one by sending PEER_HELLO every KEEPALIVE_INTERVAL, the
+other node answers each with its own PEER_HELLO, but only if the address of the first one is on its
+list of accepted peers. Hellos of unknown addresses get no answer. Both nodes then tell each other
+which rooms they want with PEER_ROOMS and traffic of talkers in those rooms travels over the link
+wrapped into PEER packets:
+
+	PEER_HELLO  [node id varint]
+	PEER_ROOMS  [room varint][distance byte]...
+	PEER        [origin node id, 4 bytes little endian][room varint][client datagram]
+
+The distance is the number of links between the sender and its nearest client of the room, 0 if
+it has clients in the room itself. A distance of PEER_HOPS_MAX or more withdraws the room. The
+rooms are announced again with every hello, the others are forgotten after a while.
+
+The user byte of a PEER header is the number of links the packet already crossed. The wrapped
+datagram is a DATA, SILENCE or BYE packet as the talker sent it, with the user id it has on its
+origin node. Each node gives remote talkers an id of its own room. PEER packets can be up to
+PEER_HEADER_MAX bytes larger than PACKET_MAX.
+
+*/
+
+#define PROTO_VERSION  2
 
 #define PACKET_HELLO    1
 #define PACKET_WELCOME  2
 #define PACKET_DATA     3
 #define PACKET_JOIN     4
-#define PACKET_BYE      5
\ No newline at end of file
+#define PACKET_BYE      5
+#define PACKET_REPORT   6
+#define PACKET_SILENCE  7
+#define PACKET_PING     8
+#define PACKET_PONG     9
+#define PACKET_KEEPALIVE  10
+#define PACKET_PEER_HELLO  11
+#define PACKET_PEER  12
+#define PACKET_PEER_ROOMS  13
+
+// User id of the stream a mixing server (MCU mode) sends, it contains everyone but the receiver
+#define PACKET_USER_MIX  255
+
+// Audio level of digital silence (or anything below -127 dBFS)
+#define PACKET_LEVEL_SILENT  127
+
+// Largest datagram we send or expect, an Ethernet MTU of 1500 bytes minus IPv4 and UDP headers
+#define PACKET_MAX  1472
+#define PACKET_HEADER_MAX  5
+#define VARINT_MAX  5
+// Header, origin and room of a PEER packet
+#define PEER_HEADER_MAX  (2 + 4 + VARINT_MAX)
+#define PEER_PACKET_MAX  (PACKET_MAX + PEER_HEADER_MAX)
+// Links a room is announced over at most, PEER packets crossing more links are dropped as well
+#define PEER_HOPS_MAX  8
+#define PING_PAYLOAD_MAX  16
+// In ms, well below the timeout of the server and of common NAT routers (30 s and more)
+#define KEEPALIVE_INTERVAL  5000
+
+typedef struct {
+	uint8_t type;
+	uint8_t user;
+	uint16_t seq;
+	uint8_t level;  // in -dBFS, DATA packets only
+} packet_header_t, *packet_header_p;
+
+// Payload of a REPORT packet. Every receiver periodically reports how well it receives each
+// speaker. The user in the header is the speaker the report is about, the server only delivers the
+// report to that speaker and replaces the user with the id of the receiver that sent it.
+typedef struct {
+	uint8_t loss_percent;  // frames lost or too late since the last report
+	uint16_t jitter;       // interarrival jitter in 0.1 ms units
+} report_t, *report_p;
+
+
+static inline bool packet_has_seq(uint8_t type){
+	return type == PACKET_DATA || type == PACKET_SILENCE;
+}
+
+static inline size_t packet_header_size(uint8_t type){
+	if (type == PACKET_DATA)
+		return 5;
+	return packet_has_seq(type) ? 4 : 2;
+}
+
+// Writes the header into buffer and returns its size, seq is ignored for packets without one. DATA
+// packets get the level of silence, use packet_pack_data_header() for them.
+static inline size_t packet_pack_header(uint8_t *buffer, uint8_t type, uint8_t user, uint16_t seq){
+	buffer[0] = (PROTO_VERSION << 5) | (type & 0x1f);
+	buffer[1] = user;
+	if ( packet_has_seq(type) ){
+		buffer[2] = seq & 0xff;
+		buffer[3] = seq >> 8;
+	}
+	if (type == PACKET_DATA)
+		buffer[4] = PACKET_LEVEL_SILENT;
+	return packet_header_size(type);
+}
+
+static inline size_t packet_pack_data_header(uint8_t *buffer, uint8_t user, uint16_t seq, uint8_t level){
+	size_t size = packet_pack_header(buffer, PACKET_DATA, user, seq);
+	buffer[4] = (level < PACKET_LEVEL_SILENT) ? level : PACKET_LEVEL_SILENT;
+	return size;
+}
+
+// Converts a level in dBFS (0 or below) into the one of the header
+static inline uint8_t packet_level_from_dbfs(double dbfs){
+	if (dbfs >= 0)
+		return 0;
+	if (dbfs <= -PACKET_LEVEL_SILENT)
+		return PACKET_LEVEL_SILENT;
+	return (uint8_t)(-dbfs + 0.5);
+}
+
+// Reads the header of a datagram and returns its size. Returns 0 if the datagram is too short or
+// uses another protocol version.
+static inline size_t packet_unpack_header(const uint8_t *buffer, size_t size, packet_header_p header){
+	if (size < 2 || (buffer[0] >> 5) != PROTO_VERSION)
+		return 0;
+	
+	header->type = buffer[0] & 0x1f;
+	header->user = buffer[1];
+	header->seq = 0;
+	header->level = PACKET_LEVEL_SILENT;
+	
+	size_t header_size = packet_header_size(header->type);
+	if (size < header_size)
+		return 0;
+	if ( packet_has_seq(header->type) )
+		header->seq = buffer[2] | (buffer[3] << 8);
+	if (header->type == PACKET_DATA)
+		header->level = buffer[4];
+	return header_size;
+}
+
+// Writes value into buffer (up to VARINT_MAX bytes) and returns the number of bytes written
+static inline size_t varint_pack(uint8_t *buffer, uint32_t value){
+	size_t len = 0;
+	while (value >= 0x80){
+		buffer[len++] = (value & 0x7f) | 0x80;
+		value >>= 7;
+	}
+	buffer[len++] = value;
+	return len;
+}
+
+// Reads a varint and returns the number of bytes it used, 0 if it's truncated or too long
+static inline size_t varint_unpack(const uint8_t *buffer, size_t size, uint32_t *value){
+	uint32_t result = 0;
+	for(size_t i = 0; i < size && i < VARINT_MAX; i++){
+		// The last byte only has room for the upper 4 bits of a 32 bit value
+		if (i == VARINT_MAX - 1 && (buffer[i] & 0x70))
+			return 0;
+		result |= (uint32_t)(buffer[i] & 0x7f) << (7 * i);
+		if ( !(buffer[i] & 0x80) ){
+			*value = result;
+			return i + 1;
+		}
+	}
+	return 0;
+}
+
+static inline size_t report_pack(uint8_t *buffer, const report_t *report){
+	buffer[0] = report->loss_percent;
+	return 1 + varint_pack(buffer + 1, report->jitter);
+}
+
+// Returns false if the payload is too short
+static inline bool report_unpack(const uint8_t *buffer, size_t size, report_p report){
+	uint32_t jitter = 0;
+	if (size < 2 || varint_unpack(buffer + 1, size - 1, &jitter) == 0)
+		return false;
+	
+	report->loss_percent = buffer[0];
+	report->jitter = (jitter > UINT16_MAX) ? UINT16_MAX : jitter;
+	return true;
+}
+
+// Writes the header of a PEER packet into buffer and returns its size, the client datagram follows
+static inline size_t peer_pack_header(uint8_t *buffer, uint32_t origin, uint8_t hops, uint32_t room){
+	size_t len = packet_pack_header(buffer, PACKET_PEER, hops, 0);
+	for(size_t i = 0; i < 4; i++)
+		buffer[len++] = origin >> (8 * i);
+	return len + varint_pack(buffer + len, room);
+}
+
+// Reads the origin and room of a PEER packet whose header was already unpacked (the hops are its
+// user). Returns the size of everything in front of the client datagram, 0 if it's truncated.
+static inline size_t peer_unpack_header(const uint8_t *buffer, size_t size, uint32_t *origin, uint32_t *room){
+	if (size < 2 + 4)
+		return 0;
+	*origin = buffer[2] | (buffer[3] << 8) | (buffer[4] << 16) | ((uint32_t)buffer[5] << 24);
+	size_t room_len = varint_unpack(buffer + 6, size - 6, room);
+	if (room_len == 0)
+		return 0;
+	return 6 + room_len;
+}
\ No newline at end of file
@@ -0,0 +1,411 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdarg.h>
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <getopt.h>
+
+#include "proto.h"
+#include "trace.h"
+#include "latency.h"
+
+/*
+
+Plays traces captured by the server (--capture) back at a server. The traces of all workers are
+mapped and merged by time. Every source address of the trace gets its own UDP socket so the server
+sees as many clients as there were, they send exactly the datagrams of the trace, HELLO and BYE
+included. A source whose BYE went out gets a new socket if it shows up again.
+
+By default the datagrams go out with their original timing, the lag shows how well we kept up.
+With --fast they go out as fast as we can send them. What the server sends back is counted and
+dropped. Sources still connected at the end of the trace say BYE so the server is clean for the
+next run. With the pid of the server its CPU time per packet is printed like the load generator
+does.
+
+*/
+
+typedef struct {
+	char *host;
+	char *port;
+	char **traces;
+	size_t trace_count;
+	bool fast;          // send as fast as possible instead of at the original times
+	pid_t server_pid;   // to measure the CPU time of the server, 0 to skip that
+} options_t, *options_p;
+
+typedef struct {
+	const uint8_t *data;
+	size_t size, offset;
+	const trace_record_t *next;  // NULL once the trace is done
+} trace_t, *trace_p;
+
+// A source address of the trace and the socket that replays it
+typedef struct {
+	uint64_t key;  // address and port, 0 for a free entry
+	int fd;        // -1 after its BYE
+} source_t, *source_p;
+
+options_t opts;
+
+void parse_options(int argc, char **argv, options_p opts);
+void show_usage_and_exit(char *program_name);
+void notice(const char *format, ...);
+void die(int status, const char *format, ...);
+void pdie(int status, const char *message);
+
+
+//
+// Output functions
+//
+
+void notice(const char *format, ...){
+	va_list args;
+	va_start(args, format);
+	vfprintf(stderr, format, args);
+	va_end(args);
+}
+
+void die(int status, const char *format, ...){
+	va_list args;
+	va_start(args, format);
+	vfprintf(stderr, format, args);
+	va_end(args);
+	exit(status);
+}
+
+void pdie(int status, const char *message){
+	perror(message);
+	exit(status);
+}
+
+
+//
+// Argument parsing stuff
+//
+
+void parse_options(int argc, char **argv, options_p opts){
+	*opts = (options_t){ .host = NULL, .port = "61234", .fast = false, .server_pid = 0 };
+	
+	int opt_char;
+	struct option longopts[] = {
+		{"fast", no_argument, NULL, 'f'},
+		{"server-pid", required_argument, NULL, 'P'},
+		{"help", no_argument, NULL, 'h'},
+		{0, 0, 0, 0}
+	};
+	while( (opt_char = getopt_long(argc, argv, "fP:h", longopts, NULL)) != -1 ){
+		switch(opt_char){
+			case 'f':
+				opts->fast = true;
+				break;
+			case 'P':
+				opts->server_pid = strtol(optarg, NULL, 10);
+				break;
+			case '?': case 'h':
+				show_usage_and_exit(argv[0]);
+				break;
+		}
+	}
+	
+	if (optind > argc - 2)
+		show_usage_and_exit(argv[0]);
+	
+	char *colon = strchr(argv[optind], ':');
+	if (colon != NULL){
+		opts->host = strndup(argv[optind], colon - argv[optind]);
+		opts->port = strdup(colon + 1);
+	} else {
+		opts->host = argv[optind];
+	}
+	
+	opts->traces = argv + optind + 1;
+	opts->trace_count = argc - optind - 1;
+}
+
+void show_usage_and_exit(char *program_name){
+	die(1,
+		"%s [-f fast] [-P server-pid] [-h help] host[:port] trace-file...\n"
+		"    trace files are what the server wrote with --capture, e.g. peak.0 peak.1\n",
+		program_name
+	);
+}
+
+
+//
+// Traces
+//
+
+void trace_open(trace_p trace, const char *path){
+	int fd = open(path, O_RDONLY);
+	if (fd == -1)
+		pdie(2, path);
+	struct stat stats;
+	if (fstat(fd, &stats) == -1)
+		pdie(2, "fstat");
+	
+	trace->size = stats.st_size;
+	if (trace->size < sizeof(trace_file_t))
+		die(2, "%s is not a trace\n", path);
+	trace->data = mmap(NULL, trace->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (trace->data == MAP_FAILED)
+		pdie(2, "mmap");
+	close(fd);
+	madvise((void*)trace->data, trace->size, MADV_SEQUENTIAL);
+	
+	const trace_file_t *header = (const trace_file_t*)trace->data;
+	if (header->magic != TRACE_MAGIC || header->version != TRACE_VERSION)
+		die(2, "%s is not a trace of this server version\n", path);
+	
+	trace->offset = sizeof(trace_file_t);
+	trace->next = trace_record_at(trace->data, trace->size, trace->offset);
+}
+
+void trace_advance(trace_p trace){
+	trace->offset += trace_record_size(trace->next->len);
+	trace->next = trace_record_at(trace->data, trace->size, trace->offset);
+}
+
+// Returns the trace with the earliest next record or NULL if all are done
+trace_p traces_earliest(trace_p traces, size_t count){
+	trace_p earliest = NULL;
+	for(size_t i = 0; i < count; i++){
+		if (traces[i].next && (earliest == NULL || traces[i].next->time < earliest->next->time))
+			earliest = &traces[i];
+	}
+	return earliest;
+}
+
+
+//
+// Sources
+//
+// Open addressing hash table of the source addresses, kept at most half full. Entries are never
+// removed, a source that said BYE keeps its entry with a closed socket.
+//
+
+source_p sources = NULL;
+size_t source_capacity = 0, source_count = 0;
+int epoll_fd = -1;
+struct sockaddr_in server_addr;
+
+source_p source_find(uint64_t key){
+	size_t index = (key * 0x9e3779b97f4a7c15ULL) >> 32;
+	while (true){
+		source_p source = &sources[index & (source_capacity - 1)];
+		if (source->key == key || source->key == 0)
+			return source;
+		index++;
+	}
+}
+
+void sources_grow(){
+	source_p old_sources = sources;
+	size_t old_capacity = source_capacity;
+	source_capacity = old_capacity ? old_capacity * 2 : 1024;
+	sources = calloc(source_capacity, sizeof(source_t));
+	for(size_t i = 0; i < old_capacity; i++){
+		if (old_sources[i].key != 0)
+			*source_find(old_sources[i].key) = old_sources[i];
+	}
+	free(old_sources);
+}
+
+void raise_fd_limit(){
+	struct rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max){
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+}
+
+// Returns the socket of the source the record came from, opens one if it doesn't have one
+int source_socket(const trace_record_t *record){
+	if ((source_count + 1) * 2 > source_capacity)
+		sources_grow();
+	
+	uint64_t key = ((uint64_t)record->addr << 16 | record->port) + 1;
+	source_p source = source_find(key);
+	if (source->key == 0){
+		source->key = key;
+		source->fd = -1;
+		source_count++;
+	}
+	
+	if (source->fd == -1){
+		source->fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+		if (source->fd == -1)
+			pdie(3, "socket");
+		if ( connect(source->fd, (const struct sockaddr *)&server_addr, sizeof(server_addr)) == -1 )
+			pdie(3, "connect");
+		struct epoll_event event = { .events = EPOLLIN, .data.fd = source->fd };
+		if ( epoll_ctl(epoll_fd, EPOLL_CTL_ADD, source->fd, &event) == -1 )
+			pdie(2, "epoll_ctl");
+	}
+	
+	int fd = source->fd;
+	if (record->type == PACKET_BYE)
+		source->fd = -1;
+	return fd;
+}
+
+
+//
+// Replay
+//
+
+uint64_t now_in_ns(){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// User and system time of the process in seconds, -1 if it can't be read
+double process_cpu_seconds(pid_t pid){
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+	FILE *file = fopen(path, "r");
+	if (file == NULL)
+		return -1;
+	
+	// The command name can contain spaces, the fields we want follow the last ')'
+	char line[1024];
+	size_t len = fread(line, 1, sizeof(line) - 1, file);
+	fclose(file);
+	line[len] = '\0';
+	
+	char *rest = strrchr(line, ')');
+	unsigned long utime, stime;
+	if (rest == NULL || sscanf(rest + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2)
+		return -1;
+	return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+size_t packets_received = 0;
+
+// Reads everything the server sent us, waits up to timeout ms for it
+void receive_replies(int timeout){
+	static uint8_t packet[PACKET_MAX];
+	struct epoll_event events[256];
+	int event_count = epoll_wait(epoll_fd, events, sizeof(events) / sizeof(events[0]), timeout);
+	for(int e = 0; e < event_count; e++){
+		while ( recv(events[e].data.fd, packet, sizeof(packet), MSG_DONTWAIT) >= 0 )
+			packets_received++;
+	}
+}
+
+int main(int argc, char **argv){
+	parse_options(argc, argv, &opts);
+	raise_fd_limit();
+	
+	struct addrinfo hints = {0};
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_DGRAM;
+	struct addrinfo *addr_info;
+	int error_code = getaddrinfo(opts.host, opts.port, &hints, &addr_info);
+	if (error_code != 0)
+		die(3, "getaddrinfo failed: %s\n", gai_strerror(error_code));
+	memcpy(&server_addr, addr_info->ai_addr, sizeof(server_addr));
+	freeaddrinfo(addr_info);
+	
+	epoll_fd = epoll_create1(0);
+	if (epoll_fd == -1)
+		pdie(2, "epoll_create1");
+	
+	trace_p traces = calloc(opts.trace_count, sizeof(trace_t));
+	for(size_t i = 0; i < opts.trace_count; i++)
+		trace_open(&traces[i], opts.traces[i]);
+	
+	trace_p trace = traces_earliest(traces, opts.trace_count);
+	if (trace == NULL)
+		die(2, "The traces are empty\n");
+	uint64_t trace_start = trace->next->time, trace_end = trace_start;
+	
+	size_t packets_sent = 0, bytes_sent = 0, send_failures = 0, packet_types[32] = { 0 };
+	latency_histogram_t lag = { 0 };
+	double server_cpu_start = opts.server_pid ? process_cpu_seconds(opts.server_pid) : -1;
+	uint64_t start = now_in_ns();
+	
+	for(; trace != NULL; trace = traces_earliest(traces, opts.trace_count)){
+		const trace_record_t *record = trace->next;
+		trace_end = record->time;
+		
+		// Wait for the time the datagram arrived at the original server, reading replies meanwhile
+		if (!opts.fast){
+			uint64_t due = start + (record->time - trace_start), now = now_in_ns();
+			while (due > now + 1000000){
+				receive_replies((due - now) / 1000000);
+				now = now_in_ns();
+			}
+			if (due > now){
+				struct timespec until = { due / 1000000000ULL, due % 1000000000ULL };
+				clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL);
+			} else {
+				latency_add(&lag, (now - due) / 1000);
+			}
+		} else if (packets_sent % 64 == 0) {
+			receive_replies(0);
+		}
+		
+		int fd = source_socket(record);
+		if ( send(fd, (const uint8_t*)(record + 1), record->len, 0) == -1 )
+			send_failures++;
+		if (record->type == PACKET_BYE)
+			close(fd);
+		
+		packets_sent++;
+		bytes_sent += record->len;
+		if (record->type < 32)
+			packet_types[record->type]++;
+		trace_advance(trace);
+	}
+	
+	// Say BYE for everyone who is still there and give the last replies some time to arrive
+	uint8_t packet[PACKET_HEADER_MAX];
+	size_t bye_len = packet_pack_header(packet, PACKET_BYE, 0, 0);
+	for(size_t i = 0; i < source_capacity; i++){
+		if (sources[i].key != 0 && sources[i].fd != -1)
+			send(sources[i].fd, packet, bye_len, 0);
+	}
+	double elapsed = (now_in_ns() - start) / 1e9;
+	receive_replies(200);
+	
+	printf("trace: %.3f s, %zu sources, replayed in %.3f s (%s)\n",
+		(trace_end - trace_start) / 1e9, source_count, elapsed, opts.fast ? "as fast as possible" : "original timing");
+	printf("sent: %zu packets, %zu bytes, %.0f packets/s, %zu failed\n",
+		packets_sent, bytes_sent, packets_sent / elapsed, send_failures);
+	printf("  HELLO %zu, DATA %zu, SILENCE %zu, REPORT %zu, PING %zu, KEEPALIVE %zu, BYE %zu\n",
+		packet_types[PACKET_HELLO], packet_types[PACKET_DATA], packet_types[PACKET_SILENCE], packet_types[PACKET_REPORT],
+		packet_types[PACKET_PING], packet_types[PACKET_KEEPALIVE], packet_types[PACKET_BYE]);
+	printf("received: %zu packets, %.0f packets/s\n", packets_received, packets_received / elapsed);
+	if (!opts.fast)
+		printf("lag behind the trace: %zu late packets, p50 %lu us, p99 %lu us, max %lu us\n",
+			lag.count, (unsigned long)latency_percentile(&lag, 50), (unsigned long)latency_percentile(&lag, 99),
+			(unsigned long)lag.max);
+	
+	// The server handles every sent packet once and every delivered one once more
+	double server_cpu_end = opts.server_pid ? process_cpu_seconds(opts.server_pid) : -1;
+	if (server_cpu_start >= 0 && server_cpu_end >= 0){
+		double cpu = server_cpu_end - server_cpu_start;
+		printf("server cpu: %.2f s (%.1f%% of one core), %.0f ns per packet in or out\n",
+			cpu, cpu * 100 / elapsed, (packets_sent + packets_received) ? cpu * 1e9 / (packets_sent + packets_received) : 0.0);
+	} else if (opts.server_pid) {
+		notice("Could not read the CPU time of server process %d\n", (int)opts.server_pid);
+	}
+	
+	return 0;
+}
\ No newline at end of file
@@ -0,0 +1,109 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/eventfd.h>
+
+#include "ring.h"
+
+
+bool ring_init(ring_p ring, size_t frame_size, size_t frame_count){
+	*ring = (ring_t){ .frame_size = frame_size, .frame_count = frame_count };
+	ring->frames = malloc(frame_size * frame_count);
+	ring->times = calloc(frame_count, sizeof(uint64_t));
+	if (ring->frames == NULL || ring->times == NULL){
+		free(ring->frames);
+		free(ring->times);
+		return false;
+	}
+	
+	ring->event_fd = eventfd(0, EFD_CLOEXEC);
+	if (ring->event_fd == -1){
+		free(ring->frames);
+		free(ring->times);
+		return false;
+	}
+	
+	return true;
+}
+
+void ring_destroy(ring_p ring){
+	close(ring->event_fd);
+	free(ring->frames);
+	free(ring->times);
+}
+
+size_t ring_fill(ring_p ring){
+	size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	return head - tail;
+}
+
+
+//
+// Producer side
+//
+
+uint8_t* ring_write_frame(ring_p ring){
+	size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	if (ring->head - tail >= ring->frame_count){
+		ring->overruns++;
+		return NULL;
+	}
+	
+	return ring->frames + (ring->head % ring->frame_count) * ring->frame_size;
+}
+
+void ring_write_commit(ring_p ring){
+	// vDSO clock, cheap enough to stamp every frame
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ring->times[ring->head % ring->frame_count] = now.tv_sec * 1000000000ULL + now.tv_nsec;
+	
+	// Publish the frame before looking at the waiting flag, pairs with the fence in ring_arm()
+	__atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_SEQ_CST);
+	if ( __atomic_exchange_n(&ring->consumer_waiting, 0, __ATOMIC_SEQ_CST) ){
+		uint64_t one = 1;
+		write(ring->event_fd, &one, sizeof(one));
+	}
+}
+
+
+//
+// Consumer side
+//
+
+uint8_t* ring_read_frame(ring_p ring){
+	size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	if (head == ring->tail)
+		return NULL;
+	
+	return ring->frames + (ring->tail % ring->frame_count) * ring->frame_size;
+}
+
+uint64_t ring_read_time(ring_p ring){
+	return ring->times[ring->tail % ring->frame_count];
+}
+
+void ring_read_release(ring_p ring){
+	__atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+}
+
+bool ring_arm(ring_p ring){
+	__atomic_store_n(&ring->consumer_waiting, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) != ring->tail){
+		__atomic_store_n(&ring->consumer_waiting, 0, __ATOMIC_RELAXED);
+		return false;
+	}
+	
+	return true;
+}
+
+void ring_clear_event(ring_p ring){
+	uint64_t count;
+	read(ring->event_fd, &count, sizeof(count));
+}
+
+void ring_wait(ring_p ring){
+	while ( ring_arm(ring) )
+		ring_clear_event(ring);
+}
\ No newline at end of file
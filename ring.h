@@ -0,0 +1,56 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+
+Single-producer/single-consumer ring of fixed size audio frames in shared memory. The audio threads
+and the main loop hand frames over without going through the kernel: the producer fills a frame
+in place and commits it, the consumer uses it in place and releases it.
+
+The eventfd is only used for wakeups and only when the consumer announced that it's about to sleep.
+The consumer can either poll event_fd (main loop) or block in ring_wait() (audio threads). While
+frames keep flowing no syscalls are needed at all.
+
+*/
+
+typedef struct {
+	uint8_t *frames;
+	uint64_t *times;  // when each frame was committed, CLOCK_MONOTONIC in ns
+	size_t frame_size, frame_count;
+	int event_fd;
+	
+	// Written by the producer only, on its own cache line to avoid false sharing with tail
+	size_t head __attribute__((aligned(64)));
+	size_t overruns;  // frames the producer couldn't write because the ring was full
+	
+	// Written by the consumer only
+	size_t tail __attribute__((aligned(64)));
+	int consumer_waiting;
+} ring_t, *ring_p;
+
+// Returns false if the memory or the eventfd couldn't be allocated
+bool ring_init(ring_p ring, size_t frame_size, size_t frame_count);
+void ring_destroy(ring_p ring);
+
+// Number of frames in the ring, can be called from any thread for monitoring
+size_t ring_fill(ring_p ring);
+
+// Producer: next free frame or NULL if the ring is full (counted as overrun), commit it when done
+uint8_t* ring_write_frame(ring_p ring);
+void ring_write_commit(ring_p ring);
+
+// Consumer: oldest frame or NULL if the ring is empty, release it when done
+uint8_t* ring_read_frame(ring_p ring);
+void ring_read_release(ring_p ring);
+// Consumer: commit time of the oldest frame, only valid after ring_read_frame() returned it
+uint64_t ring_read_time(ring_p ring);
+
+// Consumer: asks for a wakeup via event_fd. Returns false if frames are already there, then there
+// is no need to sleep.
+bool ring_arm(ring_p ring);
+// Consumer: resets event_fd after poll() reported it readable
+void ring_clear_event(ring_p ring);
+// Consumer: blocks until at least one frame is in the ring
+void ring_wait(ring_p ring);
\ No newline at end of file
@@ -1,116 +1,3220 @@
+#define _GNU_SOURCE
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stddef.h>
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <limits.h>
+#include <errno.h>
 
 #include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <poll.h>
+#include <signal.h>
 #include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/random.h>
+#include <fcntl.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netdb.h>
 
 
+#include <opus.h>
 #include "proto.h"
+#include "mix.h"
+#include "metrics.h"
+#include "ogg.h"
+#include "trace.h"
 
 
-int main(int argc, char **argv){
-	if (argc != 2){
-		fprintf(stderr, "usage: %s port\n", argv[0]);
+// Max number of datagrams drained by one recvmmsg() call
+#define RECV_BATCH_MAX  64
+// Max number of datagrams handed to one sendmmsg() call (UIO_MAXIOV is the kernel limit)
+#define SEND_BATCH_MAX  1024
+// Batch sizes are counted in power of two buckets: 1, 2-3, 4-7, ..., 512-1023, 1024
+#define BATCH_STATS_BUCKETS  11
+// Max number of links to other servers, the ones we make and the ones others make to us
+#define MAX_PEERS  16
+
+
+typedef struct {
+	in_port_t port;
+	size_t recv_batch;       // datagrams per recvmmsg() call, 1 to RECV_BATCH_MAX
+	size_t stats_interval;   // in seconds, 0 disables the batch stats
+	size_t workers;          // number of threads, each with its own SO_REUSEPORT socket
+	size_t timeout;          // in seconds, clients not heard from for this long are dropped, 0 never
+	
+	size_t speakers;          // forward only the loudest talkers of each room, 0 forwards everyone
+	char *record_dir;         // write the DATA packets of every client into Ogg Opus files there, NULL to not record
+	char *capture_path;       // write every received datagram into the trace path.<worker>, NULL to not capture
+	char *peers[MAX_PEERS];   // host:port of the servers we link to
+	size_t peer_count;
+	char *accept_peers[MAX_PEERS];  // host or host:port of servers that may link to us
+	size_t accept_peer_count;
+	
+	bool mix;                 // decode, mix and re-encode instead of forwarding (MCU mode)
+	uint32_t mix_rate;        // in Hz
+	uint8_t mix_channels;     // 1 or 2
+	uint16_t mix_frame_duration;  // in 0.1 ms units, has to match what the clients send
+	size_t bench_mix;         // run the mixing benchmark with up to this many participants and exit
+} options_t, *options_p;
+
+options_t opts;
+// Set by SIGINT and SIGTERM, recordings, traces and the metrics segment are finished before we exit
+volatile sig_atomic_t stop_requested = 0;
+// Set by the main thread once all workers returned, nothing goes into the record queues after that
+bool workers_stopped = false;
+
+void parse_options(int argc, char **argv, options_p opts);
+void show_usage_and_exit(char *program_name);
+
+
+//
+// Argument parsing stuff
+//
+
+enum {
+	OPT_MIX_RATE = 256, OPT_MIX_CHANNELS, OPT_MIX_FRAME_DURATION, OPT_BENCH_MIX, OPT_CAPTURE, OPT_PEER, OPT_ACCEPT_PEER
+};
+
+void parse_options(int argc, char **argv, options_p opts){
+	// Set default options, the mixing format matches the client defaults
+	*opts = (options_t){
+		.port = 0,
+		.recv_batch = RECV_BATCH_MAX,
+		.stats_interval = 10,
+		.workers = 1,
+		.timeout = 15,
+		.speakers = 0,
+		.record_dir = NULL,
+		.capture_path = NULL,
+		.peer_count = 0,
+		.accept_peer_count = 0,
+		.mix = false, .mix_rate = 48000, .mix_channels = 2, .mix_frame_duration = 100,
+		.bench_mix = 0
+	};
+	
+	int opt_char;
+	struct option longopts[] = {
+		{"batch", required_argument, NULL, 'b'},
+		{"stats-interval", required_argument, NULL, 's'},
+		{"workers", required_argument, NULL, 'w'},
+		{"timeout", required_argument, NULL, 't'},
+		{"speakers", required_argument, NULL, 'n'},
+		{"record", required_argument, NULL, 'r'},
+		{"mix", no_argument, NULL, 'm'},
+		{"mix-rate", required_argument, NULL, OPT_MIX_RATE},
+		{"mix-channels", required_argument, NULL, OPT_MIX_CHANNELS},
+		{"mix-frame-duration", required_argument, NULL, OPT_MIX_FRAME_DURATION},
+		{"bench-mix", required_argument, NULL, OPT_BENCH_MIX},
+		{"capture", required_argument, NULL, OPT_CAPTURE},
+		{"peer", required_argument, NULL, OPT_PEER},
+		{"accept-peer", required_argument, NULL, OPT_ACCEPT_PEER},
+		{"help", no_argument, NULL, 'h'},
+		{0, 0, 0, 0}
+	};
+	while( (opt_char = getopt_long(argc, argv, "b:s:w:t:n:r:mh", longopts, NULL)) != -1 ){
+		switch(opt_char){
+			case 'b':
+				opts->recv_batch = strtoul(optarg, NULL, 10);
+				if (opts->recv_batch < 1 || opts->recv_batch > RECV_BATCH_MAX){
+					fprintf(stderr, "The batch size has to be between 1 and %d\n", RECV_BATCH_MAX);
+					exit(1);
+				}
+				break;
+			case 's':
+				opts->stats_interval = strtoul(optarg, NULL, 10);
+				break;
+			case 'w':
+				opts->workers = strtoul(optarg, NULL, 10);
+				if (opts->workers < 1 || opts->workers > METRICS_WORKERS_MAX){
+					fprintf(stderr, "The number of workers has to be between 1 and %d\n", METRICS_WORKERS_MAX);
+					exit(1);
+				}
+				break;
+			case 't':
+				opts->timeout = strtoul(optarg, NULL, 10);
+				break;
+			case 'n':
+				opts->speakers = strtoul(optarg, NULL, 10);
+				break;
+			case 'r':
+				opts->record_dir = optarg;
+				break;
+			case OPT_CAPTURE:
+				opts->capture_path = optarg;
+				break;
+			case OPT_PEER:
+				if (opts->peer_count == MAX_PEERS){
+					fprintf(stderr, "At most %d peers are supported\n", MAX_PEERS);
+					exit(1);
+				}
+				opts->peers[opts->peer_count++] = optarg;
+				break;
+			case OPT_ACCEPT_PEER:
+				if (opts->accept_peer_count == MAX_PEERS){
+					fprintf(stderr, "At most %d accepted peers are supported\n", MAX_PEERS);
+					exit(1);
+				}
+				opts->accept_peers[opts->accept_peer_count++] = optarg;
+				break;
+			case 'm':
+				opts->mix = true;
+				break;
+			case OPT_MIX_RATE:
+				opts->mix_rate = strtoul(optarg, NULL, 10);
+				switch(opts->mix_rate){
+					case 8000: case 12000: case 16000: case 24000: case 48000:
+						break;
+					default:
+						fprintf(stderr, "The sample rate %u is not supported, only 8000, 12000, 16000, 24000 or 48000 work\n", opts->mix_rate);
+						exit(1);
+				}
+				break;
+			case OPT_MIX_CHANNELS:
+				opts->mix_channels = strtoul(optarg, NULL, 10);
+				if (opts->mix_channels != 1 && opts->mix_channels != 2){
+					fprintf(stderr, "Only mono (channel count of 1) and stereo (2) are supported\n");
+					exit(1);
+				}
+				break;
+			case OPT_MIX_FRAME_DURATION:
+				if ( strcmp(optarg, "2.5") == 0 )
+					opts->mix_frame_duration = 25;
+				else
+					opts->mix_frame_duration = strtol(optarg, NULL, 10) * 10;
+				switch(opts->mix_frame_duration){
+					case 25: case 50: case 100: case 200: case 400: case 600:
+						break;
+					default:
+						fprintf(stderr, "Only the following frame durations are supported: 2.5, 5, 10, 20, 40 or 60 ms\n");
+						exit(1);
+				}
+				break;
+			case OPT_BENCH_MIX:
+				opts->bench_mix = strtoul(optarg, NULL, 10);
+				break;
+			case '?': case 'h':
+				show_usage_and_exit(argv[0]);
+				break;
+		}
+	}
+	
+	if (opts->mix && opts->workers > 1){
+		fprintf(stderr, "Mixing only works with one worker\n");
+		exit(1);
+	}
+	if (opts->mix && (opts->peer_count > 0 || opts->accept_peer_count > 0)){
+		fprintf(stderr, "Mixing servers can't be linked to other servers\n");
+		exit(1);
+	}
+	
+	// The benchmark runs offline and needs no port
+	if (opts->bench_mix > 0)
+		return;
+	
+	// After option parsing we're at the port argument
+	if (optind != argc - 1)
+		show_usage_and_exit(argv[0]);
+	opts->port = strtoul(argv[optind], NULL, 10);
+}
+
+void show_usage_and_exit(char *program_name){
+	fprintf(stderr,
+		"usage: %s [-b recv-batch] [-s stats-interval] [-w workers] [-t timeout] [-n active-speakers]\n"
+		"    [-r record-dir] [--capture trace-path] [--peer host:port]... [--accept-peer host[:port]]...\n"
+		"    [-m mix] [--mix-rate hz] [--mix-channels count] [--mix-frame-duration ms]\n"
+		"    [-h help]\n"
+		"    port\n"
+		"       %s --bench-mix max-participants [--mix-rate hz] [--mix-channels count] [--mix-frame-duration ms]\n",
+		program_name, program_name
+	);
+	exit(1);
+}
+
+
+//
+// Batched I/O
+//
+// Incoming datagrams are drained with recvmmsg() and every broadcast is collected into one
+// mmsghdr vector so it leaves with a single sendmmsg(). The stats track how many datagrams
+// each of these syscalls actually moved.
+//
+
+typedef struct {
+	size_t calls;
+	size_t messages;
+	size_t max;
+	size_t histogram[BATCH_STATS_BUCKETS];
+} batch_stats_t, *batch_stats_p;
+
+void batch_stats_add(batch_stats_p stats, size_t batch_size){
+	size_t bucket = 0;
+	while (bucket < BATCH_STATS_BUCKETS - 1 && (batch_size >> (bucket + 1)) > 0)
+		bucket++;
+	
+	stats->calls++;
+	stats->messages += batch_size;
+	stats->histogram[bucket]++;
+	if (batch_size > stats->max)
+		stats->max = batch_size;
+}
+
+void batch_stats_print(const char *name, batch_stats_p stats){
+	printf("%s: %zu datagrams in %zu calls, avg %.2f, max %zu, histogram:",
+		name, stats->messages, stats->calls, stats->calls ? (double)stats->messages / stats->calls : 0.0, stats->max);
+	for(size_t i = 0; i < BATCH_STATS_BUCKETS; i++)
+		printf(" %zu", stats->histogram[i]);
+	printf("\n");
+}
+
+//
+// Client registry
+//
+// The registry is shared by all workers and read on every packet. Readers never lock: they load
+// the current table pointer and use it until they go back to sleep in recvmmsg(). Writers
+// (HELLO and BYE, rare compared to DATA) serialize on a mutex, copy the table, modify the copy
+// and publish it with an atomic pointer store. The old table is freed once every worker has
+// passed a quiescent state (was asleep or started a new batch) after the swap.
+//
+// A table keeps the live clients in a dense array so fan-out only touches actual listeners. The
+// array is grouped by room and each room knows its range, so a packet is only sent to the members
+// of the sender's room. The hash index maps an address to its position in the array. Updates patch
+// the copy in place: a client is added to or removed from its room's range and every room behind it
+// moves by one position, which takes at most two moved entries per room (their own clients and
+// their remote talkers). Only the index buckets of moved entries change.
+//
+// Each client gets a slot from a free list (owned by the writers). The slot stays the same while
+// the client is connected and identifies its per client state. A removed client's slot only goes
+// back on the list after the worker that removed it released that state. The user id seen by
+// other clients is only unique within the room.
+//
+// Talkers of linked servers (remote talkers, see Peer links) are in the table too so they get a
+// slot and an id of their room. They follow our own clients in the range of the room and are keyed
+// by their origin instead of an address. The links to other servers are kept here as well, they
+// change just as rarely. So are the subscriptions: for every room that we have clients in or that a
+// link wants, which links want it. They're in their own open addressing hash by room id with a
+// slot for the per link state that changes more often.
+//
+
+#define MAX_CLIENTS  4096
+// User ids are sent as one byte and PACKET_USER_MIX is reserved
+#define MAX_ROOM_CLIENTS  255
+// Open addressing hash index, kept at most half full
+#define CLIENT_INDEX_SIZE  (MAX_CLIENTS * 2)
+#define CLIENT_INDEX_EMPTY  UINT16_MAX
+// Rooms we hold subscriptions for, the hash is kept at most half full as well
+#define MAX_SUBSCRIPTIONS  MAX_CLIENTS
+#define SUBSCRIPTION_INDEX_SIZE  (MAX_SUBSCRIPTIONS * 2)
+#define SUBSCRIPTION_EMPTY  UINT16_MAX
+
+_Static_assert(MAX_PEERS <= 16, "the links of a subscription are a 16 bit mask");
+
+typedef struct {
+	struct sockaddr_in addr;  // for remote talkers the one of the link they arrive over
+	uint32_t room_id;
+	uint16_t room;  // index into the rooms array
+	uint16_t slot;
+	uint8_t user;
+	// Remote talkers only: the node they are connected to (0 for our own clients), their id there
+	// and the id of the link
+	uint32_t origin;
+	uint8_t origin_user, peer;
+} client_t, *client_p;
+
+typedef struct {
+	uint32_t id;
+	uint16_t first, count;  // range of our own clients in the clients array
+	uint16_t remotes;       // remote talkers, they follow our clients
+} room_t, *room_p;
+
+typedef struct {
+	struct sockaddr_in addr;
+	uint8_t id;  // index into peer_states, stays the same while the link exists
+	bool configured;  // we made the link (--peer), otherwise the other server did
+} peer_t, *peer_p;
+
+typedef struct {
+	uint32_t room_id;
+	uint16_t slot;   // into subscription_states, SUBSCRIPTION_EMPTY for an empty bucket
+	uint16_t links;  // bit per link id that wants the room
+	bool local;      // we have clients of our own in the room
+} subscription_t, *subscription_p;
+
+typedef struct client_table_s client_table_t, *client_table_p;
+struct client_table_s {
+	client_table_p retired_next;  // list of replaced tables waiting to be freed
+	uint64_t retired_epoch;       // epoch at which this table was replaced
+	
+	size_t count, room_count;
+	client_t clients[MAX_CLIENTS];
+	room_t rooms[MAX_CLIENTS];
+	uint16_t index[CLIENT_INDEX_SIZE];  // position in clients or CLIENT_INDEX_EMPTY
+	
+	size_t peer_count;
+	peer_t peers[MAX_PEERS];
+	
+	subscription_t subscriptions[SUBSCRIPTION_INDEX_SIZE];
+};
+
+client_table_p client_table = NULL;
+uint64_t client_table_epoch = 1;
+pthread_mutex_t client_table_lock = PTHREAD_MUTEX_INITIALIZER;
+client_table_p client_table_retired = NULL;
+
+// Free slots, only touched with client_table_lock held
+uint16_t free_slots[MAX_CLIENTS];
+size_t free_slot_count = 0;
+uint16_t free_subscription_slots[MAX_SUBSCRIPTIONS];
+size_t free_subscription_slot_count = 0;
+
+// Mutable per client state that doesn't belong into the copy-on-write table, indexed by slot. All
+// packets of a client arrive at the same worker so only that worker writes it. The workers of other
+// clients in the room read loudness and last_data for the active speaker selection.
+typedef struct {
+	bool silent;  // sent SILENCE and no DATA since
+	
+	struct sockaddr_in addr;
+	uint64_t session;  // unique for every HELLO, recordings are split by it
+	uint64_t last_seen;  // time of the last packet in ms
+	bool in_wheel;  // in the timer wheel of its worker
+	uint8_t wheel_bucket;
+	uint16_t wheel_prev, wheel_next;  // slots, WHEEL_NONE at the ends of the bucket
+	
+	bool active;  // one of the loudest talkers of the room
+	uint16_t loudness;  // smoothed level in 1/16 dB above -127 dBFS
+	uint64_t last_data;  // time of the last DATA packet in ms
+	uint64_t active_since, next_selection;  // in ms
+	
+	// Remote talkers only, the key of their entry
+	bool remote;
+	uint32_t origin, origin_room;
+	uint8_t origin_user;
+} client_state_t, *client_state_p;
+
+client_state_t client_states[MAX_CLIENTS];
+
+// Mutable state of a link, indexed by its id. All packets of a link arrive at the same worker, only
+// that one and worker 0 (marks it down when it times out) write it.
+typedef struct {
+	uint32_t node;  // id of the server on the other side, 0 until it said hello
+	uint64_t last_seen;  // time of its last packet in ms
+	bool up;
+} peer_state_t, *peer_state_p;
+
+peer_state_t peer_states[MAX_PEERS];
+
+// Per link state of a subscription, indexed by its slot. Only the worker that gets the packets of
+// the link writes it, except when the subscription expires (worker 0) or is dropped.
+typedef struct {
+	uint8_t distances[MAX_PEERS];  // links between the link and its nearest listener of the room
+	uint64_t seen[MAX_PEERS];  // time the link last announced the room in ms
+} subscription_state_t, *subscription_state_p;
+
+subscription_state_t subscription_states[MAX_SUBSCRIPTIONS];
+
+bool same_addr(const struct sockaddr_in *a, const struct sockaddr_in *b){
+	return a->sin_addr.s_addr == b->sin_addr.s_addr && a->sin_port == b->sin_port;
+}
+
+size_t addr_hash(const struct sockaddr_in *addr){
+	uint32_t hash = addr->sin_addr.s_addr * 2654435761u;
+	hash ^= (addr->sin_port * 2246822519u) >> 7;
+	return hash & (CLIENT_INDEX_SIZE - 1);
+}
+
+size_t remote_hash(uint32_t origin, uint32_t room_id, uint8_t origin_user){
+	uint32_t hash = origin * 2654435761u;
+	hash ^= ((room_id << 8 | origin_user) * 2246822519u) >> 7;
+	return hash & (CLIENT_INDEX_SIZE - 1);
+}
+
+size_t room_hash(uint32_t room_id){
+	return (room_id * 2654435761u) & (SUBSCRIPTION_INDEX_SIZE - 1);
+}
+
+client_table_p client_table_get(){
+	return __atomic_load_n(&client_table, __ATOMIC_SEQ_CST);
+}
+
+// Returns the position of the client in the dense clients array or -1 if it's not connected
+ssize_t client_table_find(client_table_p table, const struct sockaddr_in *addr){
+	for(size_t i = addr_hash(addr); table->index[i] != CLIENT_INDEX_EMPTY; i = (i + 1) & (CLIENT_INDEX_SIZE - 1)){
+		client_p client = &table->clients[table->index[i]];
+		if (client->origin == 0 && same_addr(&client->addr, addr))
+			return table->index[i];
+	}
+	
+	return -1;
+}
+
+// Same for a remote talker
+ssize_t client_table_find_remote(client_table_p table, uint32_t origin, uint32_t room_id, uint8_t origin_user){
+	for(size_t i = remote_hash(origin, room_id, origin_user); table->index[i] != CLIENT_INDEX_EMPTY; i = (i + 1) & (CLIENT_INDEX_SIZE - 1)){
+		client_p client = &table->clients[table->index[i]];
+		if (client->origin == origin && client->room_id == room_id && client->origin_user == origin_user)
+			return table->index[i];
+	}
+	
+	return -1;
+}
+
+// Returns the link to the address or NULL
+peer_p client_table_find_peer(client_table_p table, const struct sockaddr_in *addr){
+	for(size_t i = 0; i < table->peer_count; i++){
+		if ( same_addr(&table->peers[i].addr, addr) )
+			return &table->peers[i];
+	}
+	
+	return NULL;
+}
+
+// Returns the room or NULL if nobody is in it. Walks all rooms, only meant for the control path.
+room_p client_table_find_room(client_table_p table, uint32_t room_id){
+	for(size_t i = 0; i < table->room_count; i++){
+		if (table->rooms[i].id == room_id)
+			return &table->rooms[i];
+	}
+	
+	return NULL;
+}
+
+// Returns the subscription of the room or NULL if neither we nor a link want it
+subscription_p client_table_find_subscription(client_table_p table, uint32_t room_id){
+	for(size_t i = room_hash(room_id); table->subscriptions[i].slot != SUBSCRIPTION_EMPTY; i = (i + 1) & (SUBSCRIPTION_INDEX_SIZE - 1)){
+		if (table->subscriptions[i].room_id == room_id)
+			return &table->subscriptions[i];
+	}
+	
+	return NULL;
+}
+
+// Must be called on a private copy. Returns the subscription of the room, a new one wanted by
+// nobody yet if there is none. NULL if there are already MAX_SUBSCRIPTIONS.
+subscription_p client_table_add_subscription(client_table_p table, uint32_t room_id){
+	size_t i = room_hash(room_id);
+	for(; table->subscriptions[i].slot != SUBSCRIPTION_EMPTY; i = (i + 1) & (SUBSCRIPTION_INDEX_SIZE - 1)){
+		if (table->subscriptions[i].room_id == room_id)
+			return &table->subscriptions[i];
+	}
+	if (free_subscription_slot_count == 0)
+		return NULL;
+	
+	uint16_t slot = free_subscription_slots[--free_subscription_slot_count];
+	subscription_state_p state = &subscription_states[slot];
+	memset(state->distances, PEER_HOPS_MAX, sizeof(state->distances));
+	table->subscriptions[i] = (subscription_t){ room_id, slot, 0, false };
+	return &table->subscriptions[i];
+}
+
+// Must be called on a private copy. Drops the subscription once neither we nor a link want the
+// room anymore, with the same backward shift deletion as the client index.
+void client_table_release_subscription(client_table_p table, subscription_p subscription){
+	if (subscription->local || subscription->links != 0)
+		return;
+	
+	free_subscription_slots[free_subscription_slot_count++] = subscription->slot;
+	size_t gap = subscription - table->subscriptions;
+	table->subscriptions[gap].slot = SUBSCRIPTION_EMPTY;
+	for(size_t i = (gap + 1) & (SUBSCRIPTION_INDEX_SIZE - 1); table->subscriptions[i].slot != SUBSCRIPTION_EMPTY; i = (i + 1) & (SUBSCRIPTION_INDEX_SIZE - 1)){
+		size_t home = room_hash(table->subscriptions[i].room_id);
+		if ( ((i - home) & (SUBSCRIPTION_INDEX_SIZE - 1)) >= ((i - gap) & (SUBSCRIPTION_INDEX_SIZE - 1)) ){
+			table->subscriptions[gap] = table->subscriptions[i];
+			table->subscriptions[i].slot = SUBSCRIPTION_EMPTY;
+			gap = i;
+		}
+	}
+}
+
+// Must be called on a private copy. Takes the link out of the subscription.
+void client_table_unsubscribe(client_table_p table, subscription_p subscription, uint8_t link){
+	subscription->links &= ~(1 << link);
+	__atomic_store_n(&subscription_states[subscription->slot].distances[link], PEER_HOPS_MAX, __ATOMIC_RELAXED);
+	client_table_release_subscription(table, subscription);
+}
+
+// Must be called on a private copy. Marks that we have clients of our own in the room or not
+// anymore, the links get to know it from the subscriptions.
+void client_table_set_local(client_table_p table, uint32_t room_id, bool local){
+	subscription_p subscription = local ? client_table_add_subscription(table, room_id) : client_table_find_subscription(table, room_id);
+	if (subscription == NULL){
+		if (local)
+			printf("room %u isn't announced to the links, already %d rooms\n", room_id, MAX_SUBSCRIPTIONS);
+		return;
+	}
+	subscription->local = local;
+	client_table_release_subscription(table, subscription);
+}
+
+// Bucket the entry hashes to, by address for our own clients and by origin for remote talkers
+size_t client_index_home(const client_t *client){
+	return client->origin ? remote_hash(client->origin, client->room_id, client->origin_user) : addr_hash(&client->addr);
+}
+
+// Returns the bucket that points to the entry at pos
+size_t client_index_find(client_table_p table, size_t pos){
+	size_t i = client_index_home(&table->clients[pos]);
+	while (table->index[i] != pos)
+		i = (i + 1) & (CLIENT_INDEX_SIZE - 1);
+	return i;
+}
+
+void client_index_insert(client_table_p table, size_t pos){
+	size_t i = client_index_home(&table->clients[pos]);
+	while (table->index[i] != CLIENT_INDEX_EMPTY)
+		i = (i + 1) & (CLIENT_INDEX_SIZE - 1);
+	table->index[i] = pos;
+}
+
+// Drops the bucket of the entry at pos. Later buckets of the same probe sequence are pulled into
+// the gap so lookups don't stop early (backward shift deletion, no tombstones).
+void client_index_remove(client_table_p table, size_t pos){
+	size_t gap = client_index_find(table, pos);
+	table->index[gap] = CLIENT_INDEX_EMPTY;
+	for(size_t i = (gap + 1) & (CLIENT_INDEX_SIZE - 1); table->index[i] != CLIENT_INDEX_EMPTY; i = (i + 1) & (CLIENT_INDEX_SIZE - 1)){
+		// The entry can fill the gap if the gap lies between its home bucket and where it is now
+		size_t home = client_index_home(&table->clients[table->index[i]]);
+		if ( ((i - home) & (CLIENT_INDEX_SIZE - 1)) >= ((i - gap) & (CLIENT_INDEX_SIZE - 1)) ){
+			table->index[gap] = table->index[i];
+			table->index[i] = CLIENT_INDEX_EMPTY;
+			gap = i;
+		}
+	}
+}
+
+// Moves the entry at from into the free position to and updates its bucket
+void client_table_move(client_table_p table, size_t from, size_t to){
+	if (from == to)
+		return;
+	size_t i = client_index_find(table, from);
+	table->clients[to] = table->clients[from];
+	table->index[i] = to;
+}
+
+// Must be called on a private copy. Puts the client at the end of its part of the room (a new room
+// goes to the end of the array) and sets its room.
+void client_table_insert(client_table_p table, client_p client){
+	room_p room = client_table_find_room(table, client->room_id);
+	if (!room){
+		room = &table->rooms[table->room_count++];
+		*room = (room_t){ client->room_id, table->count, 0, 0 };
+	}
+	
+	// Make a gap at the end of the room, every room behind it moves one position to the right
+	size_t gap = table->count;
+	while (gap != (size_t)room->first + room->count + room->remotes){
+		room_p prev = &table->rooms[table->clients[gap - 1].room];
+		if (prev->remotes > 0){
+			client_table_move(table, prev->first + prev->count, gap);
+			gap = prev->first + prev->count;
+		}
+		if (prev->count > 0){
+			client_table_move(table, prev->first, gap);
+			gap = prev->first;
+		}
+		prev->first++;
+	}
+	
+	// Our own clients go before the remote talkers
+	if (client->origin == 0 && room->remotes > 0){
+		client_table_move(table, room->first + room->count, gap);
+		gap = room->first + room->count;
+	}
+	if (client->origin == 0)
+		room->count++;
+	else
+		room->remotes++;
+	if (client->origin == 0 && room->count == 1)
+		client_table_set_local(table, client->room_id, true);
+	
+	client->room = room - table->rooms;
+	table->clients[gap] = *client;
+	table->count++;
+	client_index_insert(table, gap);
+}
+
+// Must be called on a private copy. Takes the entry at pos out of its room, the room is dropped
+// when it's empty.
+void client_table_delete(client_table_p table, size_t pos){
+	client_t client = table->clients[pos];
+	room_p room = &table->rooms[client.room];
+	size_t room_end = room->first + room->count + room->remotes;
+	client_index_remove(table, pos);
+	
+	// Fill the gap with the last entry of the same part of the room, then the gap of our own
+	// clients with the last remote talker
+	size_t gap = pos;
+	if (client.origin == 0){
+		client_table_move(table, room->first + room->count - 1, gap);
+		gap = room->first + room->count - 1;
+		room->count--;
+	} else {
+		room->remotes--;
+	}
+	if (gap != room_end - 1){
+		client_table_move(table, room_end - 1, gap);
+		gap = room_end - 1;
+	}
+	
+	// Move the gap to the end of the array, every room behind it moves one position to the left
+	while (gap + 1 < table->count){
+		room_p next = &table->rooms[table->clients[gap + 1].room];
+		size_t next_end = next->first + next->count + next->remotes;
+		next->first--;
+		if (next->count > 0){
+			client_table_move(table, next->first + next->count, gap);
+			gap = next->first + next->count;
+		}
+		if (next->remotes > 0){
+			client_table_move(table, next_end - 1, gap);
+			gap = next_end - 1;
+		}
+	}
+	table->count--;
+	if (client.origin == 0 && room->count == 0)
+		client_table_set_local(table, client.room_id, false);
+	
+	// The last room takes the place of an empty one
+	if (room->count + room->remotes == 0){
+		room_p last = &table->rooms[--table->room_count];
+		if (room != last){
+			*room = *last;
+			for(size_t i = room->first; i < (size_t)room->first + room->count + room->remotes; i++)
+				table->clients[i].room = room - table->rooms;
+		}
+	}
+}
+
+void client_table_init(){
+	client_table = malloc(sizeof(client_table_t));
+	client_table->retired_next = NULL;
+	client_table->retired_epoch = 0;
+	client_table->count = 0;
+	client_table->room_count = 0;
+	client_table->peer_count = 0;
+	memset(client_table->index, 0xff, sizeof(client_table->index));
+	for(size_t i = 0; i < SUBSCRIPTION_INDEX_SIZE; i++)
+		client_table->subscriptions[i].slot = SUBSCRIPTION_EMPTY;
+	
+	// Push in reverse so the lowest slots are handed out first
+	for(size_t i = 0; i < MAX_CLIENTS; i++)
+		free_slots[i] = MAX_CLIENTS - 1 - i;
+	free_slot_count = MAX_CLIENTS;
+	for(size_t i = 0; i < MAX_SUBSCRIPTIONS; i++)
+		free_subscription_slots[i] = MAX_SUBSCRIPTIONS - 1 - i;
+	free_subscription_slot_count = MAX_SUBSCRIPTIONS;
+}
+
+// Must be called with client_table_lock held. Returns a private copy of the current table, NULL if
+// there is no memory for it. Callers then leave the table as it is.
+client_table_p client_table_copy(){
+	client_table_p copy = malloc(sizeof(client_table_t));
+	if (copy == NULL){
+		perror("client table copy");
+		return NULL;
+	}
+	*copy = *client_table;
+	copy->retired_next = NULL;
+	copy->retired_epoch = 0;
+	return copy;
+}
+
+void client_table_reclaim();
+
+// Must be called with client_table_lock held. Makes the copy visible to all workers.
+void client_table_publish(client_table_p table){
+	client_table_p old = client_table;
+	__atomic_store_n(&client_table, table, __ATOMIC_SEQ_CST);
+	uint64_t epoch = __atomic_add_fetch(&client_table_epoch, 1, __ATOMIC_SEQ_CST);
+	
+	old->retired_epoch = epoch;
+	old->retired_next = client_table_retired;
+	client_table_retired = old;
+	
+	client_table_reclaim();
+}
+
+// Must be called with client_table_lock held. Returns the lowest user id that is free in the room,
+// MAX_ROOM_CLIENTS if the room is full.
+size_t client_table_free_user(uint32_t room_id){
+	bool user_taken[MAX_ROOM_CLIENTS] = { false };
+	room_p room = client_table_find_room(client_table, room_id);
+	for(size_t i = 0; room && i < room->count + room->remotes; i++)
+		user_taken[client_table->clients[room->first + i].user] = true;
+	
+	size_t user = 0;
+	while (user < MAX_ROOM_CLIENTS && user_taken[user])
+		user++;
+	return user;
+}
+
+// Registers the address in a room and stores its entry in client. A client that is already
+// connected keeps its room and id. Returns false if the server or the room is full or the table
+// couldn't be copied.
+bool client_table_add(const struct sockaddr_in *addr, uint32_t room_id, client_p client){
+	pthread_mutex_lock(&client_table_lock);
+	
+	bool added = false;
+	ssize_t pos = client_table_find(client_table, addr);
+	if (pos != -1){
+		*client = client_table->clients[pos];
+		added = true;
+	} else if (free_slot_count > 0) {
+		size_t user = client_table_free_user(room_id);
+		client_table_p table = (user < MAX_ROOM_CLIENTS) ? client_table_copy() : NULL;
+		if (table){
+			*client = (client_t){ *addr, room_id, 0, free_slots[--free_slot_count], user };
+			client_table_insert(table, client);
+			client_table_publish(table);
+			added = true;
+		}
+	}
+	
+	pthread_mutex_unlock(&client_table_lock);
+	return added;
+}
+
+// Registers a remote talker that arrived over the link, see client_table_add(). A talker that is
+// already known keeps its entry, even if that came over another link.
+bool client_table_add_remote(uint32_t origin, uint32_t room_id, uint8_t origin_user, const peer_t *peer, client_p client){
+	pthread_mutex_lock(&client_table_lock);
+	
+	bool added = false;
+	ssize_t pos = client_table_find_remote(client_table, origin, room_id, origin_user);
+	if (pos != -1){
+		*client = client_table->clients[pos];
+		added = true;
+	} else if (free_slot_count > 0) {
+		size_t user = client_table_free_user(room_id);
+		client_table_p table = (user < MAX_ROOM_CLIENTS) ? client_table_copy() : NULL;
+		if (table){
+			*client = (client_t){ peer->addr, room_id, 0, free_slots[--free_slot_count], user, origin, origin_user, peer->id };
+			client_table_insert(table, client);
+			client_table_publish(table);
+			added = true;
+		}
+	}
+	
+	pthread_mutex_unlock(&client_table_lock);
+	return added;
+}
+
+// Must be called with client_table_lock held. Removes the entry at pos and stores it in client.
+// Returns false if the table couldn't be copied, the client stays then. The slot isn't handed out
+// again until it's given back with client_table_free_slots().
+bool client_table_remove_at(ssize_t pos, client_p client){
+	client_table_p table = client_table_copy();
+	if (table == NULL)
+		return false;
+	*client = table->clients[pos];
+	client_table_delete(table, pos);
+	client_table_publish(table);
+	return true;
+}
+
+// Puts the slots of removed clients back on the free list, once the worker that removed them
+// released their per client state
+void client_table_free_slots(const uint16_t *slots, size_t count){
+	pthread_mutex_lock(&client_table_lock);
+	for(size_t i = 0; i < count; i++)
+		free_slots[free_slot_count++] = slots[i];
+	pthread_mutex_unlock(&client_table_lock);
+}
+
+// Removes the client and stores its last entry in client. Returns false if it wasn't connected or
+// couldn't be removed.
+bool client_table_remove(const struct sockaddr_in *addr, client_p client){
+	pthread_mutex_lock(&client_table_lock);
+	
+	ssize_t pos = client_table_find(client_table, addr);
+	bool removed = (pos != -1) && client_table_remove_at(pos, client);
+	
+	pthread_mutex_unlock(&client_table_lock);
+	return removed;
+}
+
+// Same for a remote talker
+bool client_table_remove_remote(uint32_t origin, uint32_t room_id, uint8_t origin_user, client_p client){
+	pthread_mutex_lock(&client_table_lock);
+	
+	ssize_t pos = client_table_find_remote(client_table, origin, room_id, origin_user);
+	bool removed = (pos != -1) && client_table_remove_at(pos, client);
+	
+	pthread_mutex_unlock(&client_table_lock);
+	return removed;
+}
+
+// Removes the clients of the slots with a single copy of the table, the expired clients of a worker
+// go together. Each slot is looked up by the key in its client state. The entries are stored in
+// clients, returns how many of them were still connected. Give their slots back with
+// client_table_free_slots().
+size_t client_table_remove_slots(const uint16_t *slots, size_t count, client_p clients){
+	pthread_mutex_lock(&client_table_lock);
+	
+	client_table_p table = client_table_copy();
+	size_t removed = 0;
+	for(size_t i = 0; table && i < count; i++){
+		client_state_p state = &client_states[slots[i]];
+		ssize_t pos = state->remote
+			? client_table_find_remote(table, state->origin, state->origin_room, state->origin_user)
+			: client_table_find(table, &state->addr);
+		if (pos == -1 || table->clients[pos].slot != slots[i])
+			continue;
+		
+		clients[removed++] = table->clients[pos];
+		client_table_delete(table, pos);
+	}
+	
+	if (removed > 0)
+		client_table_publish(table);
+	else
+		free(table);  // NULL if the copy failed, then nothing was removed
+	
+	pthread_mutex_unlock(&client_table_lock);
+	return removed;
+}
+
+// Adds a link to the address and stores it in peer, an existing link is kept. Returns false if
+// there are already MAX_PEERS links or the table couldn't be copied.
+bool client_table_add_peer(const struct sockaddr_in *addr, bool configured, peer_p peer){
+	pthread_mutex_lock(&client_table_lock);
+	
+	bool added = true;
+	client_table_p table = NULL;
+	peer_p existing = client_table_find_peer(client_table, addr);
+	if (existing){
+		*peer = *existing;
+	} else if ( client_table->peer_count < MAX_PEERS && (table = client_table_copy()) ) {
+		// Take the lowest free id
+		bool id_taken[MAX_PEERS] = { false };
+		for(size_t i = 0; i < client_table->peer_count; i++)
+			id_taken[client_table->peers[i].id] = true;
+		uint8_t id = 0;
+		while (id_taken[id])
+			id++;
+		
+		*peer = (peer_t){ *addr, id, configured };
+		peer_states[id] = (peer_state_t){ .node = 0, .last_seen = 0, .up = false };
+		table->peers[table->peer_count++] = *peer;
+		client_table_publish(table);
+	} else {
+		added = false;
+	}
+	
+	pthread_mutex_unlock(&client_table_lock);
+	return added;
+}
+
+void client_table_remove_peer(const struct sockaddr_in *addr){
+	pthread_mutex_lock(&client_table_lock);
+	
+	peer_p peer = client_table_find_peer(client_table, addr);
+	client_table_p table = peer ? client_table_copy() : NULL;
+	if (table){
+		table->peers[peer - client_table->peers] = table->peers[--table->peer_count];
+		
+		// A later link can get the same id. Walk the old table, the copy changes as we go.
+		for(size_t i = 0; i < SUBSCRIPTION_INDEX_SIZE; i++){
+			subscription_p subscription = &client_table->subscriptions[i];
+			if (subscription->slot != SUBSCRIPTION_EMPTY && (subscription->links & (1 << peer->id)))
+				client_table_unsubscribe(table, client_table_find_subscription(table, subscription->room_id), peer->id);
+		}
+		client_table_publish(table);
+	}
+	
+	pthread_mutex_unlock(&client_table_lock);
+}
+
+// Takes the rooms a link announced with the distance of its nearest listener, PEER_HOPS_MAX
+// withdraws the room. The table is only copied when the link starts or stops to want a room.
+// Stores the rooms whose distance changed in changed and returns their number.
+size_t client_table_subscribe(uint8_t link, const uint32_t *rooms, const uint8_t *distances, size_t count, uint64_t now, uint32_t *changed){
+	pthread_mutex_lock(&client_table_lock);
+	
+	client_table_p table = client_table;
+	size_t changed_count = 0;
+	for(size_t i = 0; i < count; i++){
+		subscription_p subscription = client_table_find_subscription(table, rooms[i]);
+		bool wanted = distances[i] < PEER_HOPS_MAX;
+		bool subscribed = subscription && (subscription->links & (1 << link));
+		if (!wanted && !subscribed)
+			continue;
+		
+		if (wanted != subscribed){
+			// Without a copy the rest waits for the next announcement
+			if (table == client_table && (table = client_table_copy()) == NULL){
+				table = client_table;
+				break;
+			}
+			if (!wanted){
+				client_table_unsubscribe(table, client_table_find_subscription(table, rooms[i]), link);
+				changed[changed_count++] = rooms[i];
+				continue;
+			}
+			subscription = client_table_add_subscription(table, rooms[i]);
+			if (subscription == NULL){
+				printf("room %u of link %hhu not subscribed, already %d rooms\n", rooms[i], link, MAX_SUBSCRIPTIONS);
+				continue;
+			}
+			subscription->links |= 1 << link;
+		}
+		
+		subscription_state_p state = &subscription_states[subscription->slot];
+		if (state->distances[link] != distances[i]){
+			__atomic_store_n(&state->distances[link], distances[i], __ATOMIC_RELAXED);
+			changed[changed_count++] = rooms[i];
+		}
+		__atomic_store_n(&state->seen[link], now, __ATOMIC_RELAXED);
+	}
+	
+	if (table != client_table)
+		client_table_publish(table);
+	
+	pthread_mutex_unlock(&client_table_lock);
+	return changed_count;
+}
+
+// Drops the rooms links haven't announced again since before, the announcement that withdrew them
+// may have been lost. Stores the rooms in changed and returns their number.
+size_t client_table_expire_subscriptions(uint64_t before, uint32_t *changed){
+	pthread_mutex_lock(&client_table_lock);
+	
+	// Walk the old table, the copy changes as we go
+	client_table_p table = client_table;
+	size_t changed_count = 0;
+	bool copy_failed = false;
+	for(size_t i = 0; i < SUBSCRIPTION_INDEX_SIZE && !copy_failed; i++){
+		subscription_t subscription = client_table->subscriptions[i];
+		if (subscription.slot == SUBSCRIPTION_EMPTY)
+			continue;
+		
+		bool expired = false;
+		for(uint8_t link = 0; link < MAX_PEERS; link++){
+			if ( !(subscription.links & (1 << link)) || __atomic_load_n(&subscription_states[subscription.slot].seen[link], __ATOMIC_RELAXED) >= before )
+				continue;
+			// Without a copy they expire on the next round
+			if (table == client_table && (table = client_table_copy()) == NULL){
+				table = client_table;
+				copy_failed = true;
+				break;
+			}
+			client_table_unsubscribe(table, client_table_find_subscription(table, subscription.room_id), link);
+			expired = true;
+		}
+		if (expired)
+			changed[changed_count++] = subscription.room_id;
+	}
+	
+	if (table != client_table)
+		client_table_publish(table);
+	
+	pthread_mutex_unlock(&client_table_lock);
+	return changed_count;
+}
+
+
+//
+// Metrics
+//
+// Counters for monitoring in a shared memory segment, see metrics.h for the layout and the metrics
+// tool to read them. Workers update them without locks, a reader never blocks the relay.
+//
+
+_Static_assert(MAX_CLIENTS <= METRICS_CLIENTS_MAX, "metrics need a block for every client slot");
+
+metrics_p metrics = NULL;
+char metrics_name[32];  // of our segment, empty if we don't own one
+
+// Removes our segment, registered with atexit()
+void metrics_unlink(){
+	if (metrics_name[0] != '\0')
+		shm_unlink(metrics_name);
+	metrics_name[0] = '\0';
+}
+
+// Creates the segment, only the owner and its group (e.g. an exporter) may read it since it lists
+// the addresses of all clients. A segment that is already there is only replaced if the server
+// that made it is gone. With SO_REUSEPORT a second server can bind the same port and must not wipe
+// the metrics of a running one. Returns -1 and sets errno on failure.
+int metrics_create(const char *name){
+	int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0640);
+	if (fd != -1 || errno != EEXIST)
+		return fd;
+	
+	fd = shm_open(name, O_RDONLY, 0);
+	if (fd == -1)
 		return -1;
+	struct stat segment;
+	uint32_t magic = 0, pid = 0;
+	if (fstat(fd, &segment) == 0 && (size_t)segment.st_size >= sizeof(metrics_t)){
+		const metrics_t *old = mmap(NULL, sizeof(metrics_t), PROT_READ, MAP_SHARED, fd, 0);
+		if (old != MAP_FAILED){
+			magic = __atomic_load_n(&old->magic, __ATOMIC_ACQUIRE);
+			pid = old->pid;
+			munmap((void*)old, sizeof(metrics_t));
+		}
+	}
+	close(fd);
+	
+	if (magic == METRICS_MAGIC && pid != 0 && (kill(pid, 0) == 0 || errno == EPERM)){
+		fprintf(stderr, "%s belongs to the running server %u\n", name, pid);
+		errno = EEXIST;
+		return -1;
+	}
+	
+	shm_unlink(name);
+	return shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0640);
+}
+
+// Maps the metrics segment of the port and removes it again on exit. Without shared memory the
+// counters still work, they just can't be read from outside.
+void metrics_init(){
+	char name[32];
+	snprintf(name, sizeof(name), "/voice-server-%hu", opts.port);
+	
+	metrics = MAP_FAILED;
+	int fd = metrics_create(name);
+	if (fd != -1){
+		snprintf(metrics_name, sizeof(metrics_name), "%s", name);
+		atexit(metrics_unlink);
+		if (ftruncate(fd, sizeof(metrics_t)) == 0)
+			metrics = mmap(NULL, sizeof(metrics_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	}
+	if (metrics == MAP_FAILED){
+		perror("metrics in shared memory not available");
+		metrics_unlink();
+		metrics = mmap(NULL, sizeof(metrics_t), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (metrics == MAP_FAILED){
+			perror("mmap");
+			exit(1);
+		}
+	}
+	if (fd != -1)
+		close(fd);
+	
+	// Readers check the magic last
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	memset(metrics, 0, sizeof(metrics_t));
+	metrics->version = METRICS_VERSION;
+	metrics->pid = getpid();
+	metrics->port = opts.port;
+	metrics->worker_count = opts.workers;
+	metrics->started_at = now.tv_sec * 1000ULL + now.tv_nsec / 1000000;
+	__atomic_store_n(&metrics->magic, METRICS_MAGIC, __ATOMIC_RELEASE);
+}
+
+void metrics_client_connected(const client_t *client, uint64_t now){
+	metrics_client_p m = &metrics->clients[client->slot];
+	if (m->connected)
+		return;
+	
+	// Seqlock write: the generation is odd while the slot is rewritten, the fence keeps the odd
+	// generation ahead of the new fields
+	uint64_t generation = metrics_get(&m->generation);
+	metrics_set(&m->generation, generation + 1);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&m->addr, client->addr.sin_addr.s_addr, __ATOMIC_RELAXED);
+	__atomic_store_n(&m->port, client->addr.sin_port, __ATOMIC_RELAXED);
+	__atomic_store_n(&m->user, client->user, __ATOMIC_RELAXED);
+	__atomic_store_n(&m->room, client->room_id, __ATOMIC_RELAXED);
+	metrics_set(&m->connected_at, now);
+	metrics_set(&m->last_seen, now);
+	metrics_set(&m->packets_in, 0);
+	metrics_set(&m->bytes_in, 0);
+	__atomic_store_n(&m->connected, 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&m->generation, generation + 2, __ATOMIC_RELEASE);
+}
+
+void metrics_client_seen(uint16_t slot, size_t packet_len, uint64_t now){
+	metrics_client_p m = &metrics->clients[slot];
+	metrics_add(&m->packets_in, 1);
+	metrics_add(&m->bytes_in, packet_len);
+	metrics_set(&m->last_seen, now);
+}
+
+void metrics_client_disconnected(uint16_t slot){
+	__atomic_store_n(&metrics->clients[slot].connected, 0, __ATOMIC_RELEASE);
+}
+
+
+//
+// Active speakers
+//
+// With --speakers N only the N loudest talkers of a room are forwarded (or mixed), no matter how
+// many unmute at once. Clients put the level of their frames into the DATA header so nothing has
+// to be decoded. The worker of each talker keeps its smoothed loudness and every
+// SPEAKER_SELECT_INTERVAL compares it with the other talkers of the room. A talker replaces an
+// active one only if it's SPEAKER_HYSTERESIS dB louder and stays active for at least SPEAKER_HOLD,
+// so the set doesn't flap between talkers of about the same level. The other talkers may belong to
+// other workers, their state is only read (a slightly stale value doesn't hurt).
+//
+// With linked servers remote talkers compete for the same places. Every node only forwards the
+// active ones of its own talkers over the links, those are ranked again with the talkers of the
+// receiving node before they go to its clients. The N loudest of a room are among the ones that
+// reach each node, so listeners still get at most N streams.
+//
+
+// In ms
+#define SPEAKER_SELECT_INTERVAL  100
+#define SPEAKER_HOLD  1000
+// Talkers without a DATA packet for this long don't count, in ms
+#define SPEAKER_TIMEOUT  300
+// In dB
+#define SPEAKER_HYSTERESIS  6
+
+// Updates the loudness of the sender and returns true if its packet should be forwarded.
+// deactivated is set when the sender just lost its place.
+bool speaker_select(client_table_p table, size_t sender_pos, uint8_t level, uint64_t now, bool *deactivated){
+	client_p sender = &table->clients[sender_pos];
+	client_state_p state = &client_states[sender->slot];
+	*deactivated = false;
+	
+	// Exponential average over about 8 packets, a new talkspurt starts at its first level
+	int32_t loudness = (PACKET_LEVEL_SILENT - level) * 16;
+	if ((int64_t)(now - state->last_data) <= SPEAKER_TIMEOUT)
+		loudness = state->loudness + (loudness - state->loudness) / 8;
+	__atomic_store_n(&state->loudness, (uint16_t)loudness, __ATOMIC_RELAXED);
+	__atomic_store_n(&state->last_data, now, __ATOMIC_RELAXED);
+	
+	if (opts.speakers == 0)
+		return true;
+	if (now < state->next_selection)
+		return state->active;
+	state->next_selection = now + SPEAKER_SELECT_INTERVAL;
+	
+	// Count the talkers that beat the sender. An active sender is only pushed out by clearly louder
+	// ones, an inactive one has to be clearly louder than the others to get in.
+	int32_t margin = state->active ? SPEAKER_HYSTERESIS * 16 : -SPEAKER_HYSTERESIS * 16;
+	room_p room = &table->rooms[sender->room];
+	size_t louder = 0;
+	for(size_t i = room->first; i < room->first + room->count + room->remotes && louder < opts.speakers; i++){
+		if (i == sender_pos)
+			continue;
+		
+		client_state_p other = &client_states[table->clients[i].slot];
+		if ((int64_t)(now - __atomic_load_n(&other->last_data, __ATOMIC_RELAXED)) > SPEAKER_TIMEOUT)
+			continue;
+		if (__atomic_load_n(&other->loudness, __ATOMIC_RELAXED) > loudness + margin)
+			louder++;
+	}
+	
+	bool active = (louder < opts.speakers);
+	if (state->active && !active && now - state->active_since < SPEAKER_HOLD)
+		active = true;
+	if (active && !state->active)
+		state->active_since = now;
+	
+	*deactivated = (state->active && !active);
+	state->active = active;
+	return active;
+}
+
+
+//
+// Liveness
+//
+// Clients that crash or lose the network never send a BYE. They are dropped after opts.timeout
+// without a packet and their room gets the BYE instead. Each worker keeps the clients whose packets
+// it receives in a timer wheel: WHEEL_BUCKETS buckets of WHEEL_TICK ms, a client sits in the bucket
+// of its deadline. Packets only update last_seen and don't touch the wheel. When the bucket of a
+// client comes up it's either expired or, if it was heard from in the meantime, moved to the bucket
+// of its new deadline. That's O(1) per client and timeout period no matter how many packets it sends
+// and the client table is never scanned. Deadlines beyond the wheel just take a few rounds.
+//
+
+// In ms
+#define WHEEL_TICK  250
+// Power of two, 16 s with 250 ms ticks
+#define WHEEL_BUCKETS  64
+#define WHEEL_NONE  UINT16_MAX
+
+typedef struct {
+	uint16_t heads[WHEEL_BUCKETS];  // first slot in each bucket
+	uint64_t tick;  // next tick to process, the time divided by WHEEL_TICK
+} wheel_t, *wheel_p;
+
+void wheel_init(wheel_p wheel){
+	for(size_t i = 0; i < WHEEL_BUCKETS; i++)
+		wheel->heads[i] = WHEEL_NONE;
+	wheel->tick = 0;
+}
+
+// Puts the slot into the bucket of the deadline (in ms), at least one tick ahead of the current one
+void wheel_insert(wheel_p wheel, uint16_t slot, uint64_t deadline){
+	uint64_t tick = deadline / WHEEL_TICK;
+	if (tick <= wheel->tick)
+		tick = wheel->tick + 1;
+	if (tick >= wheel->tick + WHEEL_BUCKETS)
+		tick = wheel->tick + WHEEL_BUCKETS - 1;
+	
+	client_state_p state = &client_states[slot];
+	uint8_t bucket = tick & (WHEEL_BUCKETS - 1);
+	state->in_wheel = true;
+	state->wheel_bucket = bucket;
+	state->wheel_prev = WHEEL_NONE;
+	state->wheel_next = wheel->heads[bucket];
+	if (state->wheel_next != WHEEL_NONE)
+		client_states[state->wheel_next].wheel_prev = slot;
+	wheel->heads[bucket] = slot;
+}
+
+void wheel_remove(wheel_p wheel, uint16_t slot){
+	client_state_p state = &client_states[slot];
+	if (!state->in_wheel)
+		return;
+	
+	if (state->wheel_prev != WHEEL_NONE)
+		client_states[state->wheel_prev].wheel_next = state->wheel_next;
+	else
+		wheel->heads[state->wheel_bucket] = state->wheel_next;
+	if (state->wheel_next != WHEEL_NONE)
+		client_states[state->wheel_next].wheel_prev = state->wheel_prev;
+	state->in_wheel = false;
+}
+
+
+//
+// Recording
+//
+// With --record every client gets its own Ogg Opus file with the DATA packets it sent, as they
+// arrived (no transcoding). Workers never touch the disk: they copy the packet into a lock-free
+// single producer single consumer queue and move on. If the queue is full the packet is dropped
+// from the recording, never from the relay. A writer thread drains the queues of all workers and
+// appends the pages to memory mapped files (see ogg.h), page faults and write back only ever block
+// that thread.
+//
+// Clients don't send anything while silent (VAD or DTX), such gaps are filled with empty frames
+// (only the TOC byte, decoded as silence or concealment) so the recording keeps the timing. A slot
+// can be reused by another client on another worker right after a disconnect, so the entries carry
+// the session of the client and entries of older sessions are ignored.
+//
+
+// Bytes per worker queue, a power of two
+#define RECORD_QUEUE_SIZE  (1024 * 1024)
+// How long the writer sleeps when all queues are empty, in ms
+#define RECORD_POLL_INTERVAL  10
+// Arrival gaps longer than this are filled with empty frames, in ms
+#define RECORD_GAP_MIN  100
+
+typedef struct {
+	uint64_t session;
+	uint64_t time;   // arrival in ms
+	uint32_t room_id;
+	uint16_t slot;
+	uint16_t len;    // payload bytes, 0 marks the end of the session
+	uint8_t user;
+} record_entry_t;
+
+typedef struct {
+	uint8_t *buffer;
+	// Written by the worker only, byte positions that only grow
+	size_t head __attribute__((aligned(64)));
+	size_t dropped, queued;
+	// Written by the writer thread only
+	size_t tail __attribute__((aligned(64)));
+} record_queue_t, *record_queue_p;
+
+typedef struct {
+	uint64_t session;  // last session written, older ones are ignored
+	bool open;
+	bool failed;  // writing the session failed (disk full), the rest of it isn't recorded
+	ogg_opus_t ogg;
+	uint64_t start_time;  // arrival of the first packet in ms
+	uint8_t toc;  // of the last packet, gap frames use its configuration
+	uint32_t frame_samples;  // of the last packet at 48 kHz
+} record_stream_t, *record_stream_p;
+
+record_queue_p record_queues = NULL;
+size_t record_queue_count = 0;
+record_stream_p record_streams[MAX_CLIENTS];  // by slot, allocated when a slot is first recorded
+uint64_t record_session_count = 0;
+pthread_t record_writer;
+
+static size_t record_entry_size(size_t len){
+	return (sizeof(record_entry_t) + len + 7) & ~(size_t)7;
+}
+
+// Worker side, copies the entry and its payload into the queue. Returns false if it's full.
+bool record_push(record_queue_p queue, const record_entry_t *entry, const uint8_t *payload){
+	size_t size = record_entry_size(entry->len);
+	size_t tail = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+	size_t offset = queue->head & (RECORD_QUEUE_SIZE - 1);
+	// Entries don't wrap around, the rest of the buffer is skipped instead
+	size_t skip = (RECORD_QUEUE_SIZE - offset < size) ? RECORD_QUEUE_SIZE - offset : 0;
+	if (queue->head + skip + size - tail > RECORD_QUEUE_SIZE){
+		queue->dropped++;
+		return false;
+	}
+	
+	if (skip > 0 && skip >= sizeof(record_entry_t))
+		((record_entry_t*)(queue->buffer + offset))->len = UINT16_MAX;
+	size_t head = queue->head + skip;
+	uint8_t *target = queue->buffer + (head & (RECORD_QUEUE_SIZE - 1));
+	memcpy(target, entry, sizeof(*entry));
+	if (entry->len > 0)
+		memcpy(target + sizeof(*entry), payload, entry->len);
+	
+	queue->queued++;
+	__atomic_store_n(&queue->head, head + size, __ATOMIC_RELEASE);
+	return true;
+}
+
+// Finishes the file, a stream that failed was already reported
+void record_close(record_stream_p stream){
+	if (stream->open && !ogg_opus_close(&stream->ogg) && !stream->failed)
+		perror("recording incomplete");
+	stream->open = false;
+}
+
+// Writer side, appends the packet to the file of the client's session
+void record_write(const record_entry_t *entry, const uint8_t *payload){
+	record_stream_p stream = record_streams[entry->slot];
+	if (entry->len == 0){
+		if (stream && stream->session == entry->session)
+			record_close(stream);
+		return;
+	}
+	
+	if (stream == NULL){
+		stream = record_streams[entry->slot] = calloc(1, sizeof(record_stream_t));
+		if (stream == NULL)
+			return;
+	}
+	if (entry->session < stream->session || (entry->session == stream->session && (!stream->open || stream->failed)))
+		return;
+	
+	int samples = opus_packet_get_nb_samples(payload, entry->len, 48000);
+	if (samples <= 0)
+		return;
+	
+	if (entry->session != stream->session){
+		record_close(stream);
+		stream->session = entry->session;
+		stream->failed = false;
+		
+		char name[64], path[PATH_MAX];
+		time_t now = time(NULL);
+		strftime(name, sizeof(name), "%Y%m%d-%H%M%S", localtime(&now));
+		snprintf(path, sizeof(path), "%s/%s-room%u-user%hhu-%lu.opus", opts.record_dir, name, entry->room_id, entry->user, (unsigned long)entry->session);
+		if ( !ogg_opus_open(&stream->ogg, path, opus_packet_get_nb_channels(payload), entry->session) ){
+			perror(path);
+			return;
+		}
+		
+		stream->open = true;
+		stream->start_time = entry->time;
+		stream->frame_samples = 0;
+		printf("recording %s\n", path);
+	}
+	
+	// Fill pauses with empty frames until the packet is at its arrival time
+	bool written = true;
+	uint64_t arrival = (entry->time - stream->start_time) * 48;
+	if (stream->frame_samples > 0 && arrival > stream->ogg.granule + RECORD_GAP_MIN * 48){
+		uint8_t empty_frame = stream->toc & 0xfc;
+		while (written && stream->ogg.granule + stream->frame_samples <= arrival)
+			written = ogg_opus_write(&stream->ogg, &empty_frame, 1, stream->frame_samples);
+	}
+	
+	// A full disk ends the recording of the session, the relay never notices
+	if ( !written || !ogg_opus_write(&stream->ogg, payload, entry->len, samples) ){
+		perror("recording stopped");
+		stream->failed = true;
+		record_close(stream);
+		return;
+	}
+	stream->toc = payload[0];
+	stream->frame_samples = opus_packet_get_samples_per_frame(payload, 48000);
+}
+
+// Takes everything out of the queue, returns the number of entries
+size_t record_drain(record_queue_p queue){
+	size_t head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+	size_t tail = queue->tail, count = 0;
+	while (tail != head){
+		size_t offset = tail & (RECORD_QUEUE_SIZE - 1);
+		record_entry_t *entry = (record_entry_t*)(queue->buffer + offset);
+		if (RECORD_QUEUE_SIZE - offset < sizeof(record_entry_t) || entry->len == UINT16_MAX){
+			tail += RECORD_QUEUE_SIZE - offset;
+			continue;
+		}
+		
+		record_write(entry, queue->buffer + offset + sizeof(record_entry_t));
+		tail += record_entry_size(entry->len);
+		count++;
+	}
+	
+	__atomic_store_n(&queue->tail, tail, __ATOMIC_RELEASE);
+	return count;
+}
+
+void* record_thread(void *data){
+	while (true){
+		// Look before draining so the last pass sees everything the workers pushed
+		bool stopping = __atomic_load_n(&workers_stopped, __ATOMIC_ACQUIRE);
+		size_t count = 0;
+		for(size_t i = 0; i < record_queue_count; i++)
+			count += record_drain(&record_queues[i]);
+		
+		// Finish all files on SIGINT or SIGTERM so they end properly
+		if (stopping){
+			for(size_t i = 0; i < MAX_CLIENTS; i++){
+				if (record_streams[i])
+					record_close(record_streams[i]);
+			}
+			printf("recordings closed\n");
+			break;
+		}
+		
+		if (count == 0){
+			struct timespec pause = { 0, RECORD_POLL_INTERVAL * 1000000L };
+			nanosleep(&pause, NULL);
+		}
+	}
+	
+	return NULL;
+}
+
+void record_start(size_t worker_count){
+	record_queue_count = worker_count;
+	record_queues = calloc(worker_count, sizeof(record_queue_t));
+	for(size_t i = 0; i < worker_count; i++){
+		record_queues[i].buffer = malloc(RECORD_QUEUE_SIZE);
+		if (record_queues[i].buffer == NULL){
+			perror("malloc");
+			exit(1);
+		}
+	}
+	
+	if ( pthread_create(&record_writer, NULL, record_thread, NULL) != 0 ){
+		fprintf(stderr, "failed to create recording thread\n");
+		exit(1);
+	}
+	printf("recording into %s\n", opts.record_dir);
+}
+
+
+//
+// Capture
+//
+// With --capture every worker appends each datagram it receives to its own trace (see trace.h),
+// the replay tool plays them back. The kernel timestamps the datagrams (SO_TIMESTAMPNS) so the
+// trace has the arrival times and not when a batch got processed. Appending is a memcpy() into
+// the mapped window of the file, only moving the window (every CAPTURE_MAP_SIZE bytes) and page
+// faults go to the kernel. The traces grow as long as the server runs, by about 60 bytes plus the
+// datagram size per packet.
+//
+
+// Size of the mapped window of each trace
+#define CAPTURE_MAP_SIZE  (16 * 1024 * 1024)
+// Control buffer of one datagram, room for its timestamp
+#define CAPTURE_CONTROL_SIZE  CMSG_SPACE(sizeof(struct timespec))
+
+maplog_p capture_traces = NULL;
+size_t capture_trace_count = 0;
+
+void capture_start(size_t worker_count){
+	capture_trace_count = worker_count;
+	capture_traces = calloc(worker_count, sizeof(maplog_t));
+	
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	for(size_t i = 0; i < worker_count; i++){
+		char path[PATH_MAX];
+		snprintf(path, sizeof(path), "%s.%zu", opts.capture_path, i);
+		if ( !maplog_open(&capture_traces[i], path, CAPTURE_MAP_SIZE) ){
+			perror(path);
+			exit(1);
+		}
+		
+		trace_file_t header = {
+			.magic = TRACE_MAGIC, .version = TRACE_VERSION, .port = opts.port, .worker = i,
+			.started_at = now.tv_sec * 1000000000ULL + now.tv_nsec
+		};
+		maplog_append(&capture_traces[i], &header, sizeof(header));
+	}
+	printf("capturing into %s.0 to %s.%zu\n", opts.capture_path, opts.capture_path, worker_count - 1);
+}
+
+// Appends the datagram msg received with len bytes. Returns false if the trace can't grow.
+bool capture_datagram(maplog_p trace, const struct msghdr *msg, size_t len){
+	trace_record_t record = { .len = len, .type = TRACE_TYPE_INVALID };
+	
+	struct cmsghdr *cmsg;
+	for(cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR((struct msghdr *)msg, cmsg)){
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS){
+			struct timespec stamp;
+			memcpy(&stamp, CMSG_DATA(cmsg), sizeof(stamp));
+			record.time = stamp.tv_sec * 1000000000ULL + stamp.tv_nsec;
+		}
+	}
+	if (record.time == 0){
+		struct timespec now;
+		clock_gettime(CLOCK_REALTIME, &now);
+		record.time = now.tv_sec * 1000000000ULL + now.tv_nsec;
+	}
+	
+	const struct sockaddr_in *addr = msg->msg_name;
+	record.addr = addr->sin_addr.s_addr;
+	record.port = addr->sin_port;
+	
+	const uint8_t *data = msg->msg_iov[0].iov_base;
+	packet_header_t header;
+	if ( packet_unpack_header(data, len, &header) > 0 ){
+		record.type = header.type;
+		record.user = header.user;
+		record.seq = header.seq;
+		record.level = header.level;
+	}
+	
+	static const uint8_t padding[8] = { 0 };
+	return maplog_append(trace, &record, sizeof(record)) && maplog_append(trace, data, len)
+		&& maplog_append(trace, padding, trace_record_size(len) - sizeof(record) - len);
+}
+
+// Truncates the traces to what was written. Only call it after the workers returned, they append
+// without any locking.
+void capture_stop(){
+	for(size_t i = 0; i < capture_trace_count; i++){
+		size_t size = maplog_size(&capture_traces[i]);
+		if ( !maplog_close(&capture_traces[i]) )
+			perror("capture");
+		printf("trace %s.%zu: %zu bytes\n", opts.capture_path, i, size);
+	}
+}
+
+
+//
+// Workers
+//
+// Each worker owns a socket bound to the same port with SO_REUSEPORT. The kernel hashes the
+// 4-tuple so all packets of one client end up at the same worker, keeping them in order.
+//
+
+typedef struct {
+	size_t index;
+	pthread_t thread;
+	int fd;
+	int timer_fd;  // frame timer in mixing mode, -1 otherwise
+	
+	// Epoch of the client table the worker is currently using, 0 while it's blocked in
+	// recvmmsg() and holds no table
+	uint64_t active_epoch;
+	
+	batch_stats_t recv_stats, send_stats;
+	metrics_worker_p metrics;  // the worker's block in the shared metrics
+	wheel_t wheel;  // clients of this worker by deadline
+	record_queue_p record_queue;  // NULL if not recording
+	maplog_p trace;  // NULL if not capturing
+	size_t capture_failures;
+	// Received DATA packets and the Opus frames in them, to see how many frames clients pack
+	size_t data_packets, data_frames;
+	// SILENCE packets that started a pause and were forwarded, and keepalives that were not
+	size_t silence_forwarded, silence_absorbed;
+	// DATA packets of talkers that aren't among the active speakers, and how often one lost its place
+	size_t speaker_dropped, speaker_switches;
+	// PEER packets sent over links, received, and dropped because they came around a loop
+	size_t peer_sent, peer_received, peer_dropped;
+	// In ms, taken once per received batch
+	uint64_t now;
+	// Counter values at the last stats output, for the rates
+	size_t last_received, last_sent, last_data_packets, last_data_frames;
+	
+	uint8_t packets[RECV_BATCH_MAX][PEER_PACKET_MAX];
+	struct sockaddr_in packet_addrs[RECV_BATCH_MAX];
+	struct iovec iovecs[RECV_BATCH_MAX];
+	struct mmsghdr msgs[RECV_BATCH_MAX];
+	struct mmsghdr send_msgs[SEND_BATCH_MAX];
+	uint8_t controls[RECV_BATCH_MAX][CAPTURE_CONTROL_SIZE];  // receive timestamps while capturing
+	// Clients that timed out in one pass over the wheel, removed together
+	uint16_t expired_slots[MAX_CLIENTS];
+	client_t expired_clients[MAX_CLIENTS];
+	// Rooms whose subscriptions changed, to be announced to the links
+	uint32_t changed_rooms[MAX_SUBSCRIPTIONS];
+} worker_t, *worker_p;
+
+size_t worker_count = 0;
+worker_p workers = NULL;
+
+// Must be called with client_table_lock held. Frees all retired tables no worker can still see.
+void client_table_reclaim(){
+	uint64_t oldest_active = UINT64_MAX;
+	for(size_t i = 0; i < worker_count; i++){
+		uint64_t epoch = __atomic_load_n(&workers[i].active_epoch, __ATOMIC_SEQ_CST);
+		if (epoch != 0 && epoch < oldest_active)
+			oldest_active = epoch;
+	}
+	
+	client_table_p *link = &client_table_retired;
+	while (*link){
+		client_table_p table = *link;
+		if (table->retired_epoch <= oldest_active){
+			*link = table->retired_next;
+			free(table);
+		} else {
+			link = &table->retired_next;
+		}
+	}
+}
+
+// Sends all messages, a failed message is reported and skipped so the rest still goes out
+void send_batch(worker_p worker, struct mmsghdr *msgs, size_t msg_count){
+	size_t sent = 0;
+	while (sent < msg_count){
+		int count = sendmmsg(worker->fd, msgs + sent, msg_count - sent, 0);
+		if (count == -1){
+			perror("sendmmsg");
+			metrics_add(&worker->metrics->send_failures, 1);
+			sent++;
+			continue;
+		}
+		
+		batch_stats_add(&worker->send_stats, count);
+		size_t bytes = 0;
+		for(int i = 0; i < count; i++)
+			bytes += msgs[sent + i].msg_len;
+		metrics_add(&worker->metrics->packets_out, count);
+		metrics_add(&worker->metrics->bytes_out, bytes);
+		sent += count;
+	}
+}
+
+// Sends the datagram to all clients in the room except the one at sender_pos (-1 to send to all)
+void broadcast(worker_p worker, client_table_p table, room_p room, const void *data, size_t len, ssize_t sender_pos){
+	struct mmsghdr *msgs = worker->send_msgs;
+	struct iovec iov = { (void*)data, len };
+	size_t recipients = room->count - (sender_pos >= room->first && sender_pos < room->first + room->count ? 1 : 0);
+	metrics_add(&worker->metrics->fanout[metrics_fanout_bucket(recipients)], 1);
+	
+	size_t msg_count = 0;
+	for(size_t i = room->first; i < room->first + room->count; i++){
+		if ((ssize_t)i == sender_pos)
+			continue;
+		
+		msgs[msg_count++].msg_hdr = (struct msghdr){
+			.msg_name = &table->clients[i].addr, .msg_namelen = sizeof(table->clients[i].addr),
+			.msg_iov = &iov, .msg_iovlen = 1
+		};
+		if (msg_count == SEND_BATCH_MAX){
+			send_batch(worker, msgs, msg_count);
+			msg_count = 0;
+		}
+	}
+	
+	send_batch(worker, msgs, msg_count);
+}
+
+
+//
+// Mixing (MCU mode)
+//
+// With --mix the server doesn't forward DATA packets. It decodes every talker and on each frame
+// tick mixes every room. Each listener gets one stream with all talkers except itself, sent as
+// user PACKET_USER_MIX. Clients then only have to receive and decode one stream. Listeners that
+// don't talk all hear the same mix so it's only summed and encoded once per room, every one of them
+// gets that payload behind its own header. Only talkers use the encoder of their own. The sequence
+// numbers are per listener either way, a listener that starts or stops talking just switches
+// between the encoders within its stream. Only one worker is supported since the Opus states live
+// in that worker.
+//
+
+// Decoded frames a participant can have waiting for the next tick, absorbs a bit of jitter. Clients
+// that pack several frames into one packet may queue one more frame than they pack.
+#define MIX_QUEUE_LENGTH  2
+#define MIX_QUEUE_MAX  8
+// Max size of a re-encoded frame
+#define MIX_PACKET_MAX  (PACKET_MAX - PACKET_HEADER_MAX)
+
+// The stream of the silent participants of a room. All participants of the room point to it, the
+// last one to leave frees it.
+typedef struct {
+	OpusEncoder *enc;
+	size_t participants;
+	uint8_t loss_percent;  // the encoder is tuned to, highest report of the listeners
+	uint8_t level;
+	uint8_t payload[MIX_PACKET_MAX];
+	size_t payload_len;  // 0 if there is nothing to send in the current tick
+} mix_room_t, *mix_room_p;
+
+typedef struct {
+	bool active;
+	OpusDecoder *dec;
+	OpusEncoder *enc;  // only used while talking, silent participants get the room stream
+	mix_room_p room;
+	uint8_t loss_percent;  // of the last report
+	uint16_t seq;
+	
+	// Ring of decoded frames waiting for the next tick
+	int16_t *queue[MIX_QUEUE_MAX];
+	size_t queue_start, queue_length;
+	size_t frames_dropped;
+	
+	// Frame this participant contributes to the current tick, NULL if it's silent
+	const int16_t *frame;
+	// What this participant hears in the current tick, NULL if there is nothing
+	const int16_t *mix;
+	int16_t *mix_buffer;
+	
+	// The packet of the current tick, only the header if the payload is the one of the room
+	uint8_t packet[PACKET_MAX];
+	size_t packet_len;
+	const uint8_t *payload;
+	size_t payload_len;
+} mix_participant_t, *mix_participant_p;
+
+mix_participant_t mix_participants[MAX_CLIENTS];  // indexed by slot
+size_t mix_frame_samples;  // per channel
+size_t mix_frame_len;      // in samples of all channels
+int16_t *mix_room_buffer;  // what the silent participants of a room hear
+OpusRepacketizer *mix_repacketizer;  // splits packets with several frames
+
+void mixer_init(){
+	mix_frame_samples = (opts.mix_rate * opts.mix_frame_duration) / 10000LL;
+	mix_frame_len = mix_frame_samples * opts.mix_channels;
+	mix_room_buffer = malloc(mix_frame_len * sizeof(int16_t));
+	mix_repacketizer = opus_repacketizer_create();
+}
+
+// Frees the room stream once nobody uses it anymore
+void mixer_release_room(mix_room_p room){
+	if (room->participants > 0)
+		return;
+	
+	opus_encoder_destroy(room->enc);
+	free(room);
+}
+
+// Returns the room stream of the first active participant of the room, NULL if there is none yet
+mix_room_p mixer_find_room(client_table_p table, uint32_t room_id){
+	room_p room = client_table_find_room(table, room_id);
+	for(size_t i = 0; room && i < room->count; i++){
+		mix_participant_p other = &mix_participants[table->clients[room->first + i].slot];
+		if (other->active)
+			return other->room;
+	}
+	
+	return NULL;
+}
+
+// Activates the participant, it joins the stream of its room or creates it if room is NULL
+void mixer_add(mix_participant_p p, mix_room_p room){
+	if (p->active)
+		return;
+	
+	int error_code = 0;
+	if (room == NULL){
+		room = calloc(1, sizeof(mix_room_t));
+		room->enc = opus_encoder_create(opts.mix_rate, opts.mix_channels, OPUS_APPLICATION_VOIP, &error_code);
+		if (error_code != OPUS_OK){
+			fprintf(stderr, "opus_encoder_create failed: %s\n", opus_strerror(error_code));
+			free(room);
+			return;
+		}
 	}
 	
-	const in_port_t port = strtoul(argv[1], NULL, 10);
+	p->dec = opus_decoder_create(opts.mix_rate, opts.mix_channels, &error_code);
+	if (error_code != OPUS_OK){
+		fprintf(stderr, "opus_decoder_create failed: %s\n", opus_strerror(error_code));
+		mixer_release_room(room);
+		return;
+	}
+	p->enc = opus_encoder_create(opts.mix_rate, opts.mix_channels, OPUS_APPLICATION_VOIP, &error_code);
+	if (error_code != OPUS_OK){
+		fprintf(stderr, "opus_encoder_create failed: %s\n", opus_strerror(error_code));
+		opus_decoder_destroy(p->dec);
+		mixer_release_room(room);
+		return;
+	}
+	room->participants++;
+	p->room = room;
 	
+	for(size_t i = 0; i < MIX_QUEUE_MAX; i++)
+		p->queue[i] = malloc(mix_frame_len * sizeof(int16_t));
+	p->mix_buffer = malloc(mix_frame_len * sizeof(int16_t));
+	p->queue_start = p->queue_length = 0;
+	p->frames_dropped = 0;
+	p->seq = 0;
+	p->loss_percent = 0;
+	p->frame = p->mix = NULL;
+	p->packet_len = p->payload_len = 0;
+	p->active = true;
+}
+
+void mixer_remove(mix_participant_p p){
+	if (!p->active)
+		return;
 	
-	int server_fd = socket(AF_INET, SOCK_DGRAM, 0);
-	if (server_fd == -1){
-		perror("socket");
-		return -1;
+	opus_decoder_destroy(p->dec);
+	opus_encoder_destroy(p->enc);
+	p->room->participants--;
+	mixer_release_room(p->room);
+	p->room = NULL;
+	for(size_t i = 0; i < MIX_QUEUE_MAX; i++)
+		free(p->queue[i]);
+	free(p->mix_buffer);
+	p->active = false;
+}
+
+// Decodes a received frame into the participants queue, drops the oldest frame if more than
+// queue_limit frames are waiting
+void mixer_push_frame(mix_participant_p p, const uint8_t *data, size_t len, size_t queue_limit){
+	if (p->queue_length >= queue_limit){
+		p->queue_start = (p->queue_start + 1) % MIX_QUEUE_MAX;
+		p->queue_length--;
+		p->frames_dropped++;
 	}
 	
-	struct sockaddr_in addr = (struct sockaddr_in){ AF_INET, htons(port), .sin_addr = { INADDR_ANY } };
-	if (bind(server_fd, (const struct sockaddr *)&addr, sizeof(addr)) == -1){
-		perror("bind");
-		return -1;
+	int16_t *frame = p->queue[(p->queue_start + p->queue_length) % MIX_QUEUE_MAX];
+	int decoded_samples = opus_decode(p->dec, data, len, frame, mix_frame_samples, 0);
+	if (decoded_samples < 0){
+		fprintf(stderr, "opus_decode error: %s\n", opus_strerror(decoded_samples));
+		return;
 	}
 	
+	// Clients with shorter frames than the mix leave a gap, fill it with silence
+	if ((size_t)decoded_samples < mix_frame_samples)
+		memset(frame + decoded_samples * opts.mix_channels, 0, (mix_frame_samples - decoded_samples) * opts.mix_channels * sizeof(int16_t));
+	
+	p->queue_length++;
+}
+
+// Queues every frame of a received packet
+void mixer_push(mix_participant_p p, const uint8_t *data, size_t len){
+	if (!p->active)
+		return;
+	
+	int frame_count = opus_packet_get_nb_frames(data, len);
+	if (frame_count <= 1){
+		mixer_push_frame(p, data, len, MIX_QUEUE_LENGTH);
+		return;
+	}
+	
+	size_t queue_limit = (frame_count + 1 < MIX_QUEUE_MAX) ? frame_count + 1 : MIX_QUEUE_MAX;
+	opus_repacketizer_init(mix_repacketizer);
+	if ( opus_repacketizer_cat(mix_repacketizer, data, len) != OPUS_OK ){
+		fprintf(stderr, "invalid packet with %d frames\n", frame_count);
+		return;
+	}
+	
+	uint8_t frame_data[MIX_PACKET_MAX];
+	for(int i = 0; i < frame_count; i++){
+		int frame_len = opus_repacketizer_out_range(mix_repacketizer, i, i + 1, frame_data, sizeof(frame_data));
+		if (frame_len > 0)
+			mixer_push_frame(p, frame_data, frame_len, queue_limit);
+	}
+}
+
+// Takes one frame from every participant and calculates what each of them hears
+void mixer_mix(mix_participant_p *participants, size_t count){
+	size_t talker_count = 0;
+	for(size_t i = 0; i < count; i++){
+		mix_participant_p p = participants[i];
+		p->frame = NULL;
+		if (p->queue_length > 0){
+			p->frame = p->queue[p->queue_start];
+			p->queue_start = (p->queue_start + 1) % MIX_QUEUE_MAX;
+			p->queue_length--;
+			talker_count++;
+		}
+	}
 	
-	printf("starting server on port %hu\n", port);
+	// Sum of all talkers, that is what every silent participant hears
+	bool room_mix_empty = true;
+	for(size_t i = 0; i < count; i++){
+		const int16_t *frame = participants[i]->frame;
+		if (frame == NULL)
+			continue;
+		
+		if (room_mix_empty)
+			memcpy(mix_room_buffer, frame, mix_frame_len * sizeof(int16_t));
+		else
+			mix_add(mix_room_buffer, frame, mix_frame_len);
+		room_mix_empty = false;
+	}
 	
-	size_t client_count = 0;
-	struct sockaddr_in *clients = NULL;
-	packet_t packet;
-	while(true){
-		struct sockaddr_in client_addr;
-		socklen_t client_addr_len = sizeof(client_addr);
-		ssize_t bytes_received = recvfrom(server_fd, &packet, sizeof(packet), 0, (struct sockaddr *)&client_addr, &client_addr_len);
-		if (bytes_received == -1){
-			perror("recvfrom");
+	// Talkers hear everyone but themselves. It's summed again instead of subtracted from the
+	// room mix because the room mix might already be saturated.
+	for(size_t i = 0; i < count; i++){
+		mix_participant_p p = participants[i];
+		if (p->frame == NULL){
+			p->mix = room_mix_empty ? NULL : mix_room_buffer;
 			continue;
 		}
 		
-		size_t data_len = bytes_received - offsetof(packet_t, data);
-		switch(packet.type){
-			case PACKET_HELLO: {
-				size_t client_idx = client_count;
-				printf("client from %s:%hu connected as %zu\n",
-					inet_ntoa(client_addr.sin_addr), client_addr.sin_port, client_idx);
-				
-				// Add client to the client list
-				client_count++;
-				clients = realloc(clients, client_count * sizeof(struct sockaddr_in));
-				clients[client_idx] = client_addr;
-				
-				// Send a welcome packet with its client number
-				packet = (packet_t){PACKET_WELCOME, client_idx, 0, 0};
-				ssize_t bytes_send = sendto(server_fd, &packet, offsetof(packet_t, seq), 0, (const struct sockaddr *)&client_addr, sizeof(client_addr));
-				if (bytes_send == -1)
-					perror("sendto");
-				
-				// Send a join packet to all other clients
-				packet = (packet_t){PACKET_JOIN, client_idx, 0, 0};
-				for(size_t i = 0; i < client_count; i++){
-					if (clients[i].sin_addr.s_addr == client_addr.sin_addr.s_addr && clients[i].sin_port == client_addr.sin_port)
-						continue;
-					if (clients[i].sin_addr.s_addr == 0)
-						continue;
-					
-					bytes_send = sendto(server_fd, &packet, offsetof(packet_t, seq), 0, (const struct sockaddr *)&clients[i], sizeof(clients[i]));
-					if (bytes_send == -1)
-						perror("sendto");
-				}
+		p->mix = NULL;
+		for(size_t j = 0; j < count; j++){
+			const int16_t *frame = participants[j]->frame;
+			if (j == i || frame == NULL)
+				continue;
+			
+			if (p->mix == NULL)
+				memcpy(p->mix_buffer, frame, mix_frame_len * sizeof(int16_t));
+			else
+				mix_add(p->mix_buffer, frame, mix_frame_len);
+			p->mix = p->mix_buffer;
+		}
+	}
+}
+
+// Tunes an encoder to the loss its listeners report, see the client for the full adaptation with
+// bitrate changes
+void mixer_tune_encoder(OpusEncoder *enc, uint8_t loss_percent){
+	opus_encoder_ctl(enc, OPUS_SET_PACKET_LOSS_PERC(loss_percent));
+	opus_encoder_ctl(enc, OPUS_SET_INBAND_FEC(loss_percent >= 2 ? 1 : 0));
+}
+
+// Tunes the encoder of the participants own mix, the room stream follows the worst listener on the
+// next tick
+void mixer_apply_report(mix_participant_p p, report_p report){
+	if (!p->active)
+		return;
+	
+	p->loss_percent = report->loss_percent;
+	mixer_tune_encoder(p->enc, report->loss_percent);
+}
+
+// Encodes the room mix once for all silent participants after mixer_mix(), payload_len stays 0 if
+// they have nothing to hear
+void mixer_encode_room(mix_room_p room, mix_participant_p *participants, size_t count){
+	room->payload_len = 0;
+	const int16_t *mix = NULL;
+	uint8_t loss_percent = 0;
+	for(size_t i = 0; i < count; i++){
+		mix_participant_p p = participants[i];
+		if (!p->active || p->frame != NULL)
+			continue;
+		mix = p->mix;
+		if (p->loss_percent > loss_percent)
+			loss_percent = p->loss_percent;
+	}
+	if (mix == NULL)
+		return;
+	
+	if (loss_percent != room->loss_percent){
+		mixer_tune_encoder(room->enc, loss_percent);
+		room->loss_percent = loss_percent;
+	}
+	
+	room->level = packet_level_from_dbfs( mix_level_dbfs(mix, mix_frame_len) );
+	int32_t len = opus_encode(room->enc, mix, mix_frame_samples, room->payload, MIX_PACKET_MAX);
+	if (len < 0){
+		fprintf(stderr, "opus_encode error: %s\n", opus_strerror(len));
+		return;
+	}
+	room->payload_len = len;
+}
+
+// Encodes what the participant hears into its packet, packet_len is 0 if there is nothing to send.
+// Silent participants only get a header, their payload is the one of the room stream.
+void mixer_encode(mix_participant_p p){
+	p->packet_len = p->payload_len = 0;
+	if (p->mix == NULL)
+		return;
+	
+	if (p->frame == NULL){
+		if (p->room->payload_len == 0)
+			return;
+		p->packet_len = packet_pack_data_header(p->packet, PACKET_USER_MIX, p->seq, p->room->level);
+		p->payload = p->room->payload;
+		p->payload_len = p->room->payload_len;
+		p->seq++;
+		return;
+	}
+	
+	uint8_t level = packet_level_from_dbfs( mix_level_dbfs(p->mix, mix_frame_len) );
+	size_t header_len = packet_pack_data_header(p->packet, PACKET_USER_MIX, p->seq, level);
+	int32_t len = opus_encode(p->enc, p->mix, mix_frame_samples, p->packet + header_len, MIX_PACKET_MAX);
+	if (len < 0){
+		fprintf(stderr, "opus_encode error: %s\n", opus_strerror(len));
+		return;
+	}
+	
+	p->seq++;
+	p->packet_len = header_len + len;
+}
+
+// Mixes every room and sends each listener its stream
+void mixer_tick(worker_p worker){
+	static mix_participant_p participants[MAX_ROOM_CLIENTS];
+	client_table_p table = client_table_get();
+	
+	for(size_t r = 0; r < table->room_count; r++){
+		room_p room = &table->rooms[r];
+		mix_room_p stream = NULL;
+		for(size_t i = 0; i < room->count; i++){
+			participants[i] = &mix_participants[table->clients[room->first + i].slot];
+			if (stream == NULL && participants[i]->active)
+				stream = participants[i]->room;
+		}
+		
+		mixer_mix(participants, room->count);
+		if (stream)
+			mixer_encode_room(stream, participants, room->count);
+		
+		// Header and payload of every packet, the payload may be the shared one of the room
+		size_t msg_count = 0;
+		struct iovec iovecs[MAX_ROOM_CLIENTS][2];
+		for(size_t i = 0; i < room->count; i++){
+			mix_participant_p p = participants[i];
+			if (!p->active)
+				continue;
+			
+			mixer_encode(p);
+			if (p->packet_len == 0)
+				continue;
+			
+			iovecs[msg_count][0] = (struct iovec){ p->packet, p->packet_len };
+			iovecs[msg_count][1] = (struct iovec){ (void*)p->payload, p->payload_len };
+			worker->send_msgs[msg_count].msg_hdr = (struct msghdr){
+				.msg_name = &table->clients[room->first + i].addr, .msg_namelen = sizeof(struct sockaddr_in),
+				.msg_iov = iovecs[msg_count], .msg_iovlen = (p->payload_len > 0) ? 2 : 1
+			};
+			msg_count++;
+		}
+		
+		send_batch(worker, worker->send_msgs, msg_count);
+	}
+}
+
+double elapsed_ns(struct timespec *start){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	double ns = (now.tv_sec - start->tv_sec) * 1e9 + (now.tv_nsec - start->tv_nsec);
+	*start = now;
+	return ns;
+}
+
+// Offline benchmark: runs ticks with the given number of talkers, the others only listen. The
+// time per tick of each stage is printed as one row.
+void mixer_benchmark_run(size_t count, size_t talkers, size_t ticks){
+	int16_t *source = malloc(mix_frame_len * sizeof(int16_t));
+	uint8_t input[MIX_PACKET_MAX];
+	mix_participant_p *participants = calloc(count, sizeof(mix_participant_p));
+	OpusEncoder **sources = calloc(count, sizeof(OpusEncoder*));
+	for(size_t i = 0; i < count; i++){
+		participants[i] = calloc(1, sizeof(mix_participant_t));
+		mixer_add(participants[i], (i > 0) ? participants[0]->room : NULL);
+		
+		int error_code = 0;
+		sources[i] = opus_encoder_create(opts.mix_rate, opts.mix_channels, OPUS_APPLICATION_VOIP, &error_code);
+	}
+	
+	double decode_ns = 0, mix_ns = 0, encode_ns = 0;
+	for(size_t t = 0; t < ticks; t++){
+		// Every talker hums its own tone, producing its packets isn't part of the measurement
+		struct timespec start;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for(size_t i = 0; i < talkers; i++){
+			for(size_t s = 0; s < mix_frame_len; s++)
+				source[s] = ((t * mix_frame_len + s) * (i + 3) * 37) % 8192 - 4096;
+			int32_t len = opus_encode(sources[i], source, mix_frame_samples, input, sizeof(input));
+			
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			if (len > 0)
+				mixer_push(participants[i], input, len);
+			decode_ns += elapsed_ns(&start);
+		}
+		
+		mixer_mix(participants, count);
+		mix_ns += elapsed_ns(&start);
+		
+		mixer_encode_room(participants[0]->room, participants, count);
+		for(size_t i = 0; i < count; i++)
+			mixer_encode(participants[i]);
+		encode_ns += elapsed_ns(&start);
+	}
+	
+	printf("%12zu  %7zu  %14.0f  %11.0f  %14.0f  %20.0f  %18.0f\n", count, talkers,
+		decode_ns / ticks, mix_ns / ticks, encode_ns / ticks,
+		(decode_ns + mix_ns + encode_ns) / ticks / count, mix_ns / ticks / count);
+	
+	for(size_t i = 0; i < count; i++){
+		mixer_remove(participants[i]);
+		free(participants[i]);
+		opus_encoder_destroy(sources[i]);
+	}
+	free(participants);
+	free(sources);
+	free(source);
+}
+
+// Doubles the participants until max_participants is reached. Each size runs once with everyone
+// talking (worst case, an encoder per participant) and once with two talkers, where the listeners
+// share the room stream.
+void mixer_benchmark(size_t max_participants){
+	const size_t ticks = 500;
+	mixer_init();
+	
+	printf("mixing benchmark, %u Hz, %hhu channels, %.1f ms frames, %s kernel, %zu ticks per run\n",
+		opts.mix_rate, opts.mix_channels, opts.mix_frame_duration / 10.0, mix_kernel_name(), ticks);
+	printf("participants  talkers  decode ns/tick  mix ns/tick  encode ns/tick  total ns/participant  mix ns/participant\n");
+	
+	for(size_t count = 2; true; count *= 2){
+		if (count > max_participants)
+			count = max_participants;
+		
+		mixer_benchmark_run(count, count, ticks);
+		if (count > 2)
+			mixer_benchmark_run(count, 2, ticks);
+		
+		if (count == max_participants)
+			break;
+	}
+}
+
+//
+// Peer links
+//
+// Servers (nodes) can link up to spread a room over several machines, see proto.h for the packets.
+// A node links to others with --peer and accepts links only from the addresses given with
+// --accept-peer, a PEER_HELLO from anywhere else is ignored. Without that list nobody can link to
+// us, otherwise anyone could listen to every room or inject talkers into it.
+//
+// Over every link a node announces the rooms it wants with PEER_ROOMS: the ones it has clients in
+// and the ones its other links want. Each DATA, SILENCE and BYE of our own clients goes out wrapped
+// into a PEER packet, once to every link that wants its room. A received PEER packet is passed on
+// to the other links that want the room and its datagram is fanned out to our own clients of the
+// room. So every node only sends to its own listeners plus one packet per link that leads to more
+// of them, the fan-out of a room is split between the nodes and rooms stay off links nobody behind
+// needs them.
+//
+// Rooms are announced with the distance of the nearest listener, we add one for the link when we
+// pass a room on. All rooms go out again every hello interval and a room we don't hear about again
+// within the timeout is dropped. Changes (a room gets its first or loses its last client here, a
+// link starts or stops to want a room) are announced right away, a room nobody wants anymore with
+// a distance of PEER_HOPS_MAX.
+//
+// Talkers of other nodes (remote talkers) get an entry in the client table with an id of their
+// room on this node, their datagrams are rewritten to it. The entry is keyed by the origin node,
+// room and id on the origin, so it's the same no matter which way the packets took. Remote talkers
+// time out like clients, the origin keeps forwarding the SILENCE keepalives of its talkers for that.
+// Listeners only cost the node they're connected to, other nodes just learn which rooms it wants.
+// With --speakers the origin forwards only the active ones of its talkers and every node ranks them
+// again with its own talkers (see Active speakers). Mixing servers can't be linked.
+//
+// Links should form a tree (e.g. every node links to one parent). Loops are broken anyway: links to
+// ourselves and a second link to a node we're already linked with are refused, nothing is sent back
+// over the link it came from and PEER packets are dropped when they come back to their origin, when
+// a known talker arrives over another link than its first one (reverse path check) or after
+// PEER_HOPS_MAX links. A room that is only wanted around a loop is announced with a growing distance
+// until it reaches PEER_HOPS_MAX and is dropped.
+//
+
+// In ms, how long the rooms of a link are kept without the timeout option
+#define PEER_ROOMS_TIMEOUT  (3 * KEEPALIVE_INTERVAL)
+// Most rooms in one PEER_ROOMS packet, each takes at least two bytes
+#define PEER_ROOMS_MAX  (PACKET_MAX / 2)
+
+// Random, see main()
+uint32_t node_id = 0;
+// Resolved --accept-peer addresses, a port of 0 accepts every port of the host
+struct sockaddr_in peer_accepted[MAX_PEERS];
+size_t peer_accepted_count = 0;
+// Only used by worker 0, in ms
+uint64_t peer_next_hello = 0;
+
+// Sends a PEER packet over the links with a bit in links that are up
+void peer_send(worker_p worker, client_table_p table, uint16_t links, const uint8_t *packet, size_t packet_len){
+	struct mmsghdr *msgs = worker->send_msgs;
+	struct iovec iov = { (void*)packet, packet_len };
+	
+	size_t msg_count = 0;
+	for(size_t i = 0; i < table->peer_count; i++){
+		peer_p peer = &table->peers[i];
+		if ( !(links & (1 << peer->id)) || !__atomic_load_n(&peer_states[peer->id].up, __ATOMIC_RELAXED) )
+			continue;
+		
+		msgs[msg_count++].msg_hdr = (struct msghdr){
+			.msg_name = &peer->addr, .msg_namelen = sizeof(peer->addr),
+			.msg_iov = &iov, .msg_iovlen = 1
+		};
+	}
+	
+	send_batch(worker, msgs, msg_count);
+	worker->peer_sent += msg_count;
+}
+
+// Sends a datagram of one of our clients to the links that want its room, with the id the client
+// has here
+void peer_forward(worker_p worker, client_table_p table, const client_t *sender, const uint8_t *packet, size_t packet_len){
+	if (table->peer_count == 0)
+		return;
+	subscription_p subscription = client_table_find_subscription(table, sender->room_id);
+	if (subscription == NULL || subscription->links == 0)
+		return;
+	
+	uint8_t wrapped[PEER_PACKET_MAX];
+	size_t header_len = peer_pack_header(wrapped, node_id, 0, sender->room_id);
+	memcpy(wrapped + header_len, packet, packet_len);
+	wrapped[header_len + 1] = sender->user;
+	peer_send(worker, table, subscription->links, wrapped, header_len + packet_len);
+}
+
+// Distance of our nearest listener of the room as announced to the link: 0 if we have clients in
+// it, otherwise one more than the nearest one behind our other links. PEER_HOPS_MAX if the link
+// shouldn't send us the room.
+uint8_t peer_room_distance(const subscription_t *subscription, uint8_t link){
+	if (subscription->local)
+		return 0;
+	
+	uint8_t distance = PEER_HOPS_MAX;
+	for(uint8_t id = 0; id < MAX_PEERS; id++){
+		if (id == link || !(subscription->links & (1 << id)) || !__atomic_load_n(&peer_states[id].up, __ATOMIC_RELAXED))
+			continue;
+		uint8_t behind = __atomic_load_n(&subscription_states[subscription->slot].distances[id], __ATOMIC_RELAXED) + 1;
+		if (behind < distance)
+			distance = behind;
+	}
+	return distance;
+}
+
+void peer_send_rooms(worker_p worker, const peer_t *link, const uint8_t *packet, size_t packet_len){
+	ssize_t bytes_send = sendto(worker->fd, packet, packet_len, 0, (const struct sockaddr *)&link->addr, sizeof(link->addr));
+	if (bytes_send == -1){
+		perror("sendto");
+		metrics_add(&worker->metrics->send_failures, 1);
+	}
+}
+
+// Tells the link which of the rooms we want, as many PEER_ROOMS packets as needed. Without rooms
+// (NULL) all the rooms we want go out, otherwise the given ones including those we don't want
+// anymore.
+void peer_announce(worker_p worker, client_table_p table, const peer_t *link, const uint32_t *rooms, size_t room_count){
+	uint8_t packet[PACKET_MAX];
+	size_t header_len = packet_pack_header(packet, PACKET_PEER_ROOMS, 0, 0);
+	size_t packet_len = header_len;
+	size_t count = rooms ? room_count : SUBSCRIPTION_INDEX_SIZE;
+	for(size_t i = 0; i < count; i++){
+		uint32_t room_id;
+		uint8_t distance;
+		if (rooms){
+			subscription_p subscription = client_table_find_subscription(table, rooms[i]);
+			room_id = rooms[i];
+			distance = subscription ? peer_room_distance(subscription, link->id) : PEER_HOPS_MAX;
+		} else {
+			subscription_p subscription = &table->subscriptions[i];
+			if (subscription->slot == SUBSCRIPTION_EMPTY)
+				continue;
+			room_id = subscription->room_id;
+			distance = peer_room_distance(subscription, link->id);
+			if (distance >= PEER_HOPS_MAX)
+				continue;
+		}
+		
+		if (packet_len + VARINT_MAX + 1 > sizeof(packet)){
+			peer_send_rooms(worker, link, packet, packet_len);
+			packet_len = header_len;
+		}
+		packet_len += varint_pack(packet + packet_len, room_id);
+		packet[packet_len++] = distance;
+	}
+	if (packet_len > header_len)
+		peer_send_rooms(worker, link, packet, packet_len);
+}
+
+// Announces the rooms over all links that are up, except the one with the id except (-1 for all)
+void peer_announce_changes(worker_p worker, const uint32_t *rooms, size_t room_count, int except){
+	client_table_p table = client_table_get();
+	for(size_t i = 0; i < table->peer_count && room_count > 0; i++){
+		peer_p link = &table->peers[i];
+		if (link->id != except && __atomic_load_n(&peer_states[link->id].up, __ATOMIC_RELAXED))
+			peer_announce(worker, table, link, rooms, room_count);
+	}
+}
+
+// Takes the PEER_ROOMS data of the link and passes the changes on to our other links
+void peer_rooms_receive(worker_p worker, const peer_t *link, const uint8_t *data, size_t data_len){
+	uint32_t rooms[PEER_ROOMS_MAX];
+	uint8_t distances[PEER_ROOMS_MAX];
+	size_t count = 0, pos = 0;
+	while (pos < data_len && count < PEER_ROOMS_MAX){
+		size_t len = varint_unpack(data + pos, data_len - pos, &rooms[count]);
+		if (len == 0 || pos + len >= data_len){
+			printf("invalid PEER_ROOMS packet from %s:%hu\n", inet_ntoa(link->addr.sin_addr), link->addr.sin_port);
+			metrics_add(&worker->metrics->invalid, 1);
+			return;
+		}
+		distances[count++] = data[pos + len];
+		pos += len + 1;
+	}
+	
+	size_t changed = client_table_subscribe(link->id, rooms, distances, count, worker->now, worker->changed_rooms);
+	peer_announce_changes(worker, worker->changed_rooms, changed, link->id);
+}
+
+void peer_send_hello(worker_p worker, const struct sockaddr_in *addr){
+	uint8_t packet[PACKET_HEADER_MAX + VARINT_MAX];
+	size_t packet_len = packet_pack_header(packet, PACKET_PEER_HELLO, 0, 0);
+	packet_len += varint_pack(packet + packet_len, node_id);
+	ssize_t bytes_send = sendto(worker->fd, packet, packet_len, 0, (const struct sockaddr *)addr, sizeof(*addr));
+	if (bytes_send == -1){
+		perror("sendto");
+		metrics_add(&worker->metrics->send_failures, 1);
+	}
+}
+
+// True if the address was given with --accept-peer
+bool peer_is_accepted(const struct sockaddr_in *addr){
+	for(size_t i = 0; i < peer_accepted_count; i++){
+		const struct sockaddr_in *accepted = &peer_accepted[i];
+		if ( accepted->sin_addr.s_addr == addr->sin_addr.s_addr && (accepted->sin_port == 0 || accepted->sin_port == addr->sin_port) )
+			return true;
+	}
+	return false;
+}
+
+// Takes a PEER_HELLO of the node, sets up the link if it's a new one. Links the other node made
+// get an answer, it's how that node knows the link is up.
+void peer_hello(worker_p worker, const struct sockaddr_in *addr, uint32_t node){
+	if (node == node_id){
+		printf("link from %s:%hu refused, that's ourselves\n", inet_ntoa(addr->sin_addr), addr->sin_port);
+		return;
+	}
+	
+	client_table_p table = client_table_get();
+	peer_p link = client_table_find_peer(table, addr);
+	if (link == NULL){
+		if ( !peer_is_accepted(addr) ){
+			// No message, it's just as cheap to send as to log
+			metrics_add(&worker->metrics->invalid, 1);
+			return;
+		}
+		for(size_t i = 0; i < table->peer_count; i++){
+			if (__atomic_load_n(&peer_states[table->peers[i].id].node, __ATOMIC_RELAXED) == node){
+				printf("link from %s:%hu refused, already linked to node %08x\n", inet_ntoa(addr->sin_addr), addr->sin_port, node);
+				return;
+			}
+		}
+		
+		peer_t peer;
+		if ( !client_table_add_peer(addr, false, &peer) ){
+			printf("link from %s:%hu refused, already %d links\n", inet_ntoa(addr->sin_addr), addr->sin_port, MAX_PEERS);
+			return;
+		}
+		table = client_table_get();
+		link = client_table_find_peer(table, addr);
+		if (link == NULL)
+			return;
+	}
+	
+	peer_state_p state = &peer_states[link->id];
+	__atomic_store_n(&state->node, node, __ATOMIC_RELAXED);
+	__atomic_store_n(&state->last_seen, worker->now, __ATOMIC_RELAXED);
+	if (!link->configured)
+		peer_send_hello(worker, addr);
+	// Tell a new link right away what we want, not only at the next hello
+	if ( !__atomic_exchange_n(&state->up, true, __ATOMIC_RELAXED) ){
+		printf("link %hhu to %s:%hu (node %08x) up, %s\n", link->id, inet_ntoa(addr->sin_addr), addr->sin_port, node,
+			link->configured ? "we linked to it" : "it linked to us");
+		peer_announce(worker, table, link, NULL, 0);
+	}
+}
+
+// Resolves host:port, or just host if the port isn't required (it's 0 then). Exits on errors.
+struct sockaddr_in peer_resolve(const char *name, bool port_required){
+	char *host = strdup(name), *port = strrchr(host, ':');
+	if (port == NULL && port_required){
+		fprintf(stderr, "The peer %s needs a port (host:port)\n", name);
+		exit(1);
+	}
+	if (port)
+		*port++ = '\0';
+	
+	struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_DGRAM };
+	struct addrinfo *addr_info;
+	int error_code = getaddrinfo(host, port, &hints, &addr_info);
+	if (error_code != 0){
+		fprintf(stderr, "Can't resolve the peer %s: %s\n", name, gai_strerror(error_code));
+		exit(1);
+	}
+	
+	struct sockaddr_in addr = *(const struct sockaddr_in *)addr_info->ai_addr;
+	freeaddrinfo(addr_info);
+	free(host);
+	return addr;
+}
+
+// Resolves the servers given with --peer and sets up their links, worker 0 starts saying hello.
+// The ones given with --accept-peer may link to us.
+void peers_start(){
+	for(size_t i = 0; i < opts.peer_count; i++){
+		struct sockaddr_in addr = peer_resolve(opts.peers[i], true);
+		peer_t peer;
+		client_table_add_peer(&addr, true, &peer);
+	}
+	for(size_t i = 0; i < opts.accept_peer_count; i++)
+		peer_accepted[peer_accepted_count++] = peer_resolve(opts.accept_peers[i], false);
+}
+
+// Worker 0 calls this on every wakeup. It says hello over the links we made and marks links down
+// that weren't heard from for opts.timeout. The links other nodes made are dropped then, their
+// remote talkers time out on their own. With the hellos our rooms go out over every link and the
+// rooms links didn't announce again in time are dropped.
+void peers_tick(worker_p worker){
+	client_table_p table = client_table_get();
+	uint64_t timeout = opts.timeout * 1000;
+	for(size_t i = 0; i < table->peer_count && timeout > 0; i++){
+		peer_p peer = &table->peers[i];
+		peer_state_p state = &peer_states[peer->id];
+		if (__atomic_load_n(&state->last_seen, __ATOMIC_RELAXED) + timeout > worker->now)
+			continue;
+		
+		if ( __atomic_exchange_n(&state->up, false, __ATOMIC_RELAXED) )
+			printf("link %hhu to %s:%hu (node %08x) timed out\n", peer->id, inet_ntoa(peer->addr.sin_addr), peer->addr.sin_port, state->node);
+		if (!peer->configured)
+			client_table_remove_peer(&peer->addr);
+	}
+	
+	if (worker->now >= peer_next_hello){
+		uint64_t rooms_timeout = (timeout > 0) ? timeout : PEER_ROOMS_TIMEOUT;
+		if (worker->now > rooms_timeout){
+			size_t expired = client_table_expire_subscriptions(worker->now - rooms_timeout, worker->changed_rooms);
+			peer_announce_changes(worker, worker->changed_rooms, expired, -1);
+			table = client_table_get();
+		}
+		
+		for(size_t i = 0; i < table->peer_count; i++){
+			peer_p peer = &table->peers[i];
+			if (peer->configured)
+				peer_send_hello(worker, &peer->addr);
+			if ( __atomic_load_n(&peer_states[peer->id].up, __ATOMIC_RELAXED) )
+				peer_announce(worker, table, peer, NULL, 0);
+		}
+		// A few hellos per timeout, even with short ones
+		uint64_t interval = (timeout > 0 && timeout / 3 < KEEPALIVE_INTERVAL) ? timeout / 3 : KEEPALIVE_INTERVAL;
+		peer_next_hello = worker->now + interval;
+	}
+}
+
+// Every packet of a connected client keeps it alive
+void client_seen(worker_p worker, uint16_t slot, size_t packet_len){
+	client_states[slot].last_seen = worker->now;
+	metrics_client_seen(slot, packet_len, worker->now);
+}
+
+// Takes the slot out of the wheel, the metrics and the recording. Has to happen before the slot is
+// freed, another worker may reuse it right away.
+void worker_release_slot(worker_p worker, const client_t *entry){
+	wheel_remove(&worker->wheel, entry->slot);
+	metrics_client_disconnected(entry->slot);
+	if (entry->origin == 0 && worker->record_queue)
+		record_push(worker->record_queue, &(record_entry_t){ .session = client_states[entry->slot].session, .slot = entry->slot }, NULL);
+}
+
+// Sends the BYE of a removed client to everyone who is still in its room. Our own clients say it to
+// the links as well, remote talkers get the id they had here.
+void worker_send_bye(worker_p worker, const client_t *client, const char *reason){
+	if (opts.mix && client->origin == 0)
+		mixer_remove(&mix_participants[client->slot]);
+	
+	// The BYE always carries the id the server assigned to the client
+	uint8_t packet[PACKET_HEADER_MAX];
+	size_t packet_len = packet_pack_header(packet, PACKET_BYE, client->user, 0);
+	client_table_p table = client_table_get();
+	room_p room = client_table_find_room(table, client->room_id);
+	if (room)
+		broadcast(worker, table, room, packet, packet_len, -1);
+	
+	if (client->origin == 0){
+		peer_forward(worker, table, client, packet, packet_len);
+		// The last of our clients left the room, the links can stop sending it
+		if (table->peer_count > 0 && (room == NULL || room->count == 0))
+			peer_announce_changes(worker, &client->room_id, 1, -1);
+		printf("client %s:%hu (%hhu in room %u) %s\n",
+			inet_ntoa(client->addr.sin_addr), client->addr.sin_port, client->user, client->room_id, reason);
+	} else {
+		printf("remote user %hhu of node %08x (%hhu in room %u) %s\n", client->origin_user, client->origin, client->user, client->room_id, reason);
+	}
+}
+
+// Removes the client and sends a BYE to everyone who is still in its room. Returns false if it
+// wasn't connected. The slot is released only after the client left the table and handed out
+// again only after that, so a rejoin can't get a slot that's still in use.
+bool worker_disconnect(worker_p worker, const struct sockaddr_in *addr, const char *reason){
+	client_t client;
+	if ( !client_table_remove(addr, &client) )
+		return false;
+	worker_release_slot(worker, &client);
+	worker_send_bye(worker, &client, reason);
+	client_table_free_slots(&client.slot, 1);
+	return true;
+}
+
+// Removes a remote talker and sends a BYE with its id here to our clients in its room. Returns
+// false if it wasn't known.
+bool worker_disconnect_remote(worker_p worker, uint32_t origin, uint32_t room_id, uint8_t origin_user, const char *reason){
+	client_t client;
+	if ( !client_table_remove_remote(origin, room_id, origin_user, &client) )
+		return false;
+	worker_release_slot(worker, &client);
+	worker_send_bye(worker, &client, reason);
+	client_table_free_slots(&client.slot, 1);
+	return true;
+}
+
+// Processes all buckets that are due, clients heard from since they were put in move on to their new
+// deadline. The others are collected and removed together with one copy of the client table.
+void worker_expire_clients(worker_p worker){
+	wheel_p wheel = &worker->wheel;
+	uint64_t timeout = opts.timeout * 1000;
+	client_table_p table = client_table_get();
+	size_t expired_count = 0;
+	while (wheel->tick * WHEEL_TICK <= worker->now){
+		// Take the whole bucket first, clients put back in land in later buckets
+		uint8_t bucket = wheel->tick & (WHEEL_BUCKETS - 1);
+		uint16_t slot = wheel->heads[bucket];
+		wheel->heads[bucket] = WHEEL_NONE;
+		wheel->tick++;
+		
+		while (slot != WHEEL_NONE){
+			client_state_p state = &client_states[slot];
+			uint16_t next = state->wheel_next;
+			state->in_wheel = false;
+			
+			if (state->last_seen + timeout > worker->now){
+				wheel_insert(wheel, slot, state->last_seen + timeout);
+			} else {
+				ssize_t pos = state->remote
+					? client_table_find_remote(table, state->origin, state->origin_room, state->origin_user)
+					: client_table_find(table, &state->addr);
+				if (pos != -1 && table->clients[pos].slot == slot)
+					worker->expired_slots[expired_count++] = slot;
+			}
+			slot = next;
+		}
+	}
+	if (expired_count == 0)
+		return;
+	
+	size_t removed = client_table_remove_slots(worker->expired_slots, expired_count, worker->expired_clients);
+	for(size_t i = 0; i < removed; i++){
+		worker_release_slot(worker, &worker->expired_clients[i]);
+		worker_send_bye(worker, &worker->expired_clients[i], "timed out");
+		worker->expired_slots[i] = worker->expired_clients[i].slot;
+	}
+	client_table_free_slots(worker->expired_slots, removed);
+	metrics_add(&worker->metrics->expired, removed);
+	
+	// Without a copy of the table nothing was removed. The clients that are still in the table are
+	// still ours, try again on the next tick.
+	if (removed == 0){
+		table = client_table_get();
+		for(size_t i = 0; i < expired_count; i++){
+			uint16_t slot = worker->expired_slots[i];
+			client_state_p state = &client_states[slot];
+			ssize_t pos = state->remote
+				? client_table_find_remote(table, state->origin, state->origin_room, state->origin_user)
+				: client_table_find(table, &state->addr);
+			if (pos != -1 && table->clients[pos].slot == slot && !state->in_wheel)
+				wheel_insert(wheel, slot, worker->now + WHEEL_TICK);
+		}
+	}
+}
+
+// Handles a PEER packet that arrived over the link (hops is the user of its header): passes it on
+// to the other links that want the room and fans the datagram in it out to our clients of the room
+void peer_receive(worker_p worker, client_table_p table, const peer_t *link, uint8_t *packet, size_t packet_len, uint8_t hops){
+	uint32_t origin, room_id;
+	packet_header_t header;
+	size_t header_len = peer_unpack_header(packet, packet_len, &origin, &room_id);
+	uint8_t *data = packet + header_len;
+	size_t data_len = packet_len - header_len;
+	if (header_len == 0 || packet_unpack_header(data, data_len, &header) == 0){
+		printf("invalid PEER packet from %s:%hu, %zu bytes\n", inet_ntoa(link->addr.sin_addr), link->addr.sin_port, packet_len);
+		metrics_add(&worker->metrics->invalid, 1);
+		return;
+	}
+	worker->peer_received++;
+	
+	// Drop what came around a loop
+	ssize_t pos = client_table_find_remote(table, origin, room_id, header.user);
+	if (origin == node_id || hops >= PEER_HOPS_MAX || (pos != -1 && table->clients[pos].peer != link->id)){
+		worker->peer_dropped++;
+		return;
+	}
+	
+	// Pass it on before the datagram is rewritten for our clients
+	subscription_p subscription = client_table_find_subscription(table, room_id);
+	uint16_t links = subscription ? subscription->links & ~(1 << link->id) : 0;
+	if (links != 0){
+		packet[1] = hops + 1;
+		peer_send(worker, table, links, packet, packet_len);
+	}
+	
+	if (header.type == PACKET_BYE){
+		worker_disconnect_remote(worker, origin, room_id, header.user, "disconnected");
+		return;
+	}
+	if (header.type != PACKET_DATA && header.type != PACKET_SILENCE)
+		return;
+	
+	// The first packet of a talker announces it to our clients of the room
+	if (pos == -1){
+		client_t client;
+		if ( !client_table_add_remote(origin, room_id, header.user, link, &client) ){
+			printf("remote user %hhu of node %08x rejected, server or room %u is full\n", header.user, origin, room_id);
+			return;
+		}
+		// The same talker just arrived over another link
+		if (client.peer != link->id)
+			return;
+		
+		client_states[client.slot] = (client_state_t){
+			.addr = link->addr, .last_seen = worker->now,
+			.session = __atomic_add_fetch(&record_session_count, 1, __ATOMIC_RELAXED),
+			.remote = true, .origin = origin, .origin_room = room_id, .origin_user = header.user
+		};
+		if (opts.timeout > 0)
+			wheel_insert(&worker->wheel, client.slot, worker->now + opts.timeout * 1000);
+		metrics_client_connected(&client, worker->now);
+		printf("remote user %hhu of node %08x connected to room %u as %hhu (slot %hu, link %hhu, worker %zu)\n",
+			header.user, origin, room_id, client.user, client.slot, link->id, worker->index);
+		
+		table = client_table_get();
+		pos = client_table_find_remote(table, origin, room_id, header.user);
+		if (pos == -1)
+			return;
+		uint8_t join[PACKET_HEADER_MAX];
+		size_t join_len = packet_pack_header(join, PACKET_JOIN, client.user, 0);
+		broadcast(worker, table, &table->rooms[table->clients[pos].room], join, join_len, pos);
+	}
+	
+	client_p remote = &table->clients[pos];
+	client_seen(worker, remote->slot, packet_len);
+	client_state_p state = &client_states[remote->slot];
+	if (header.type == PACKET_SILENCE){
+		// Like with our own talkers only the first SILENCE of a pause goes out
+		if (state->silent){
+			worker->silence_absorbed++;
+			return;
+		}
+		state->silent = true;
+		worker->silence_forwarded++;
+	} else {
+		state->silent = false;
+		
+		bool deactivated = false;
+		if ( !speaker_select(table, pos, header.level, worker->now, &deactivated) ){
+			worker->speaker_dropped++;
+			if (!deactivated)
+				return;
+			
+			// Our listeners play out what they have, see worker_handle_packet()
+			worker->speaker_switches++;
+			uint8_t marker[PACKET_HEADER_MAX + 1];
+			size_t marker_len = packet_pack_header(marker, PACKET_SILENCE, remote->user, header.seq);
+			marker[marker_len++] = (uint8_t)(int8_t)-PACKET_LEVEL_SILENT;
+			broadcast(worker, table, &table->rooms[remote->room], marker, marker_len, pos);
+			return;
+		}
+	}
+	
+	data[1] = remote->user;
+	broadcast(worker, table, &table->rooms[remote->room], data, data_len, pos);
+}
+
+void worker_handle_packet(worker_p worker, uint8_t *packet, size_t packet_len, struct sockaddr_in client_addr){
+	packet_header_t header;
+	size_t header_len = packet_unpack_header(packet, packet_len, &header);
+	if (header_len == 0){
+		printf("invalid packet from %s:%hu, %zu bytes\n", inet_ntoa(client_addr.sin_addr), client_addr.sin_port, packet_len);
+		metrics_add(&worker->metrics->invalid, 1);
+		return;
+	}
+	// Only PEER packets can be larger, they wrap a datagram of a client
+	if (packet_len > PACKET_MAX && header.type != PACKET_PEER){
+		metrics_add(&worker->metrics->truncated, 1);
+		return;
+	}
+	uint8_t *data = packet + header_len;
+	size_t data_len = packet_len - header_len;
+	
+	switch(header.type){
+		case PACKET_HELLO: {
+			// Clients that don't ask for a room end up in room 0
+			uint32_t room_id = 0;
+			varint_unpack(data, data_len, &room_id);
+			
+			client_t client;
+			if ( !client_table_add(&client_addr, room_id, &client) ){
+				printf("client from %s:%hu rejected, server or room %u is full\n",
+					inet_ntoa(client_addr.sin_addr), client_addr.sin_port, room_id);
+				break;
+			}
+			
+			// A client that says hello again starts over
+			wheel_remove(&worker->wheel, client.slot);
+			client_states[client.slot] = (client_state_t){
+				.addr = client_addr, .last_seen = worker->now,
+				.session = __atomic_add_fetch(&record_session_count, 1, __ATOMIC_RELAXED)
+			};
+			if (opts.timeout > 0)
+				wheel_insert(&worker->wheel, client.slot, worker->now + opts.timeout * 1000);
+			metrics_client_connected(&client, worker->now);
+			if (opts.mix)
+				mixer_add(&mix_participants[client.slot], mixer_find_room(client_table_get(), client.room_id));
+			
+			printf("client from %s:%hu connected to room %u as %hhu (slot %hu, worker %zu)\n",
+				inet_ntoa(client_addr.sin_addr), client_addr.sin_port, client.room_id, client.user, client.slot, worker->index);
+			
+			// Send a welcome packet with its client number
+			uint8_t reply[PACKET_HEADER_MAX];
+			size_t reply_len = packet_pack_header(reply, PACKET_WELCOME, client.user, 0);
+			ssize_t bytes_send = sendto(worker->fd, reply, reply_len, 0, (const struct sockaddr *)&client_addr, sizeof(client_addr));
+			if (bytes_send == -1){
+				perror("sendto");
+				metrics_add(&worker->metrics->send_failures, 1);
+			}
+			
+			// Send a join packet to all other clients in the room
+			client_table_p table = client_table_get();
+			ssize_t pos = client_table_find(table, &client_addr);
+			if (pos != -1){
+				reply_len = packet_pack_header(reply, PACKET_JOIN, client.user, 0);
+				broadcast(worker, table, &table->rooms[table->clients[pos].room], reply, reply_len, pos);
+				// The first of our clients in the room, the links have to send it from now on
+				if (table->peer_count > 0 && table->rooms[table->clients[pos].room].count == 1)
+					peer_announce_changes(worker, &client.room_id, 1, -1);
+			}
+			
+			} break;
+		case PACKET_DATA: {
+			// Broadcast packet to the sender's room (or mix it), drop packets of unknown senders
+			client_table_p table = client_table_get();
+			ssize_t sender_pos = client_table_find(table, &client_addr);
+			if (sender_pos == -1)
+				break;
+			
+			client_p sender = &table->clients[sender_pos];
+			client_seen(worker, sender->slot, packet_len);
+			if (worker->record_queue && data_len > 0){
+				record_entry_t entry = {
+					.session = client_states[sender->slot].session, .time = worker->now,
+					.room_id = sender->room_id, .slot = sender->slot, .len = data_len, .user = sender->user
+				};
+				record_push(worker->record_queue, &entry, data);
+			}
+			int frame_count = opus_packet_get_nb_frames(data, data_len);
+			worker->data_packets++;
+			worker->data_frames += (frame_count > 0) ? frame_count : 0;
+			client_states[sender->slot].silent = false;
+			
+			bool deactivated = false;
+			if ( !speaker_select(table, sender_pos, header.level, worker->now, &deactivated) ){
+				worker->speaker_dropped++;
+				if (!deactivated)
+					break;
 				
-				} break;
-			case PACKET_DATA: case PACKET_BYE: {
-				// Broadcast packet to all clients but the one sending it
-				//printf("broadcasting packet from %s:%hu to:\n",
-				//	inet_ntoa(client_addr.sin_addr), client_addr.sin_port);
-				ssize_t bytes_send;
-				for(size_t i = 0; i < client_count; i++){
-					if (clients[i].sin_addr.s_addr == client_addr.sin_addr.s_addr && clients[i].sin_port == client_addr.sin_port)
-						continue;
-					if (clients[i].sin_addr.s_addr == 0)
-						continue;
-					
-					//printf("- %s:%hu\n", inet_ntoa(clients[i].sin_addr), clients[i].sin_port);
-					bytes_send = sendto(server_fd, &packet, bytes_received, 0, (const struct sockaddr *)&clients[i], sizeof(clients[i]));
-					if (bytes_send == -1)
-						perror("sendto");
+				// Listeners play out what they have instead of concealing the missing packets
+				worker->speaker_switches++;
+				if (!opts.mix){
+					uint8_t marker[PACKET_HEADER_MAX + 1];
+					size_t marker_len = packet_pack_header(marker, PACKET_SILENCE, sender->user, header.seq);
+					marker[marker_len++] = (uint8_t)(int8_t)-PACKET_LEVEL_SILENT;
+					broadcast(worker, table, &table->rooms[sender->room], marker, marker_len, sender_pos);
+					peer_forward(worker, table, sender, marker, marker_len);
 				}
+				break;
+			}
+			
+			if (opts.mix){
+				mixer_push(&mix_participants[sender->slot], data, data_len);
+			} else {
+				broadcast(worker, table, &table->rooms[sender->room], packet, packet_len, sender_pos);
+				peer_forward(worker, table, sender, packet, packet_len);
+			}
+			
+			} break;
+		case PACKET_SILENCE: {
+			// Only the first SILENCE of a pause goes out, the rest are keepalives. Silent senders
+			// don't send DATA so they cost nothing in the fan-out.
+			client_table_p table = client_table_get();
+			ssize_t sender_pos = client_table_find(table, &client_addr);
+			if (sender_pos == -1)
+				break;
+			
+			client_p sender = &table->clients[sender_pos];
+			client_seen(worker, sender->slot, packet_len);
+			client_state_p state = &client_states[sender->slot];
+			if (state->silent){
+				// Other nodes only hear from a silent talker through its keepalives
+				worker->silence_absorbed++;
+				peer_forward(worker, table, sender, packet, packet_len);
+				break;
+			}
+			state->silent = true;
+			state->active = false;
+			worker->silence_forwarded++;
+			
+			// The mixer simply gets no frames from a silent participant
+			if (!opts.mix){
+				packet_pack_header(packet, PACKET_SILENCE, sender->user, header.seq);
+				broadcast(worker, table, &table->rooms[sender->room], packet, packet_len, sender_pos);
+				peer_forward(worker, table, sender, packet, packet_len);
+			}
+			
+			} break;
+		case PACKET_REPORT: {
+			// Deliver the report to the speaker it is about, with the reporters id in it
+			client_table_p table = client_table_get();
+			ssize_t sender_pos = client_table_find(table, &client_addr);
+			report_t report;
+			if (sender_pos == -1 || !report_unpack(data, data_len, &report))
+				break;
+			client_p sender = &table->clients[sender_pos];
+			client_seen(worker, sender->slot, packet_len);
+			
+			// In mixing mode the only stream a client receives is its mix
+			if (opts.mix){
+				if (header.user == PACKET_USER_MIX)
+					mixer_apply_report(&mix_participants[sender->slot], &report);
+				break;
+			}
+			
+			room_p room = &table->rooms[sender->room];
+			for(size_t i = room->first; i < room->first + room->count; i++){
+				if (table->clients[i].user != header.user || i == (size_t)sender_pos)
+					continue;
 				
-				// If we got a BYE packet mark the client as dead (set its IP to 0)
-				if (packet.type == PACKET_BYE && packet.user < client_count){
-					clients[packet.user].sin_addr.s_addr = 0;
-					printf("client %s:%hu (%hhu) disconnected\n",
-						inet_ntoa(client_addr.sin_addr), client_addr.sin_port, packet.user);
+				packet_pack_header(packet, PACKET_REPORT, sender->user, 0);
+				ssize_t bytes_send = sendto(worker->fd, packet, packet_len, 0, (const struct sockaddr *)&table->clients[i].addr, sizeof(table->clients[i].addr));
+				if (bytes_send == -1){
+					perror("sendto");
+					metrics_add(&worker->metrics->send_failures, 1);
 				}
-				
-				} break;
-			default:
-				printf("unknown packet, type %hhu, %zu bytes data\n", packet.type, data_len);
 				break;
+			}
+			
+			} break;
+		case PACKET_PING: {
+			// Echo the data back right away so the client measures only the network and our queue
+			client_table_p table = client_table_get();
+			ssize_t sender_pos = client_table_find(table, &client_addr);
+			if (sender_pos == -1 || data_len > PING_PAYLOAD_MAX)
+				break;
+			client_seen(worker, table->clients[sender_pos].slot, packet_len);
+			
+			packet_pack_header(packet, PACKET_PONG, header.user, 0);
+			ssize_t bytes_send = sendto(worker->fd, packet, packet_len, 0, (const struct sockaddr *)&client_addr, sizeof(client_addr));
+			if (bytes_send == -1){
+				perror("sendto");
+				metrics_add(&worker->metrics->send_failures, 1);
+			}
+			
+			} break;
+		case PACKET_KEEPALIVE: {
+			client_table_p table = client_table_get();
+			ssize_t sender_pos = client_table_find(table, &client_addr);
+			if (sender_pos != -1)
+				client_seen(worker, table->clients[sender_pos].slot, packet_len);
+			} break;
+		case PACKET_BYE:
+			worker_disconnect(worker, &client_addr, "disconnected");
+			break;
+		case PACKET_PEER_HELLO: {
+			uint32_t node = 0;
+			if (varint_unpack(data, data_len, &node) > 0 && node != 0)
+				peer_hello(worker, &client_addr, node);
+			} break;
+		case PACKET_PEER: {
+			// Only from servers we're linked with
+			client_table_p table = client_table_get();
+			peer_p link = client_table_find_peer(table, &client_addr);
+			if (link == NULL)
+				break;
+			__atomic_store_n(&peer_states[link->id].last_seen, worker->now, __ATOMIC_RELAXED);
+			peer_receive(worker, table, link, packet, packet_len, header.user);
+			} break;
+		case PACKET_PEER_ROOMS: {
+			client_table_p table = client_table_get();
+			peer_p link = client_table_find_peer(table, &client_addr);
+			if (link == NULL)
+				break;
+			__atomic_store_n(&peer_states[link->id].last_seen, worker->now, __ATOMIC_RELAXED);
+			peer_rooms_receive(worker, link, data, data_len);
+			} break;
+		default:
+			printf("unknown packet, type %hhu, %zu bytes data\n", header.type, data_len);
+			break;
+	}
+}
+
+// Packet rates since the last call, frames per DATA packet show how many frames clients pack
+// into one packet (--frames-per-packet of the client)
+void worker_print_rates(worker_p worker, double seconds){
+	size_t received = worker->recv_stats.messages - worker->last_received;
+	size_t sent = worker->send_stats.messages - worker->last_sent;
+	size_t data_packets = worker->data_packets - worker->last_data_packets;
+	size_t data_frames = worker->data_frames - worker->last_data_frames;
+	
+	printf("  packets/s: %.0f received, %.0f sent, DATA: %.0f packets/s, %.0f frames/s, %.2f frames per packet\n",
+		received / seconds, sent / seconds, data_packets / seconds, data_frames / seconds,
+		data_packets ? (double)data_frames / data_packets : 0.0);
+	
+	worker->last_received = worker->recv_stats.messages;
+	worker->last_sent = worker->send_stats.messages;
+	worker->last_data_packets = worker->data_packets;
+	worker->last_data_frames = worker->data_frames;
+}
+
+void* worker_thread(void *data){
+	worker_p worker = data;
+	
+	struct timespec last_stats;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &last_stats);
+	worker->now = last_stats.tv_sec * 1000ULL + last_stats.tv_nsec / 1000000;
+	worker->wheel.tick = worker->now / WHEEL_TICK;
+	
+	// The workers wake up at least every WHEEL_TICK to see stop_requested
+	while(!stop_requested){
+		// Reset the headers every time, the kernel overwrites the lengths
+		for(size_t i = 0; i < opts.recv_batch; i++){
+			worker->iovecs[i] = (struct iovec){ worker->packets[i], sizeof(worker->packets[i]) };
+			worker->msgs[i].msg_hdr = (struct msghdr){
+				.msg_name = &worker->packet_addrs[i], .msg_namelen = sizeof(worker->packet_addrs[i]),
+				.msg_iov = &worker->iovecs[i], .msg_iovlen = 1
+			};
+			if (worker->trace){
+				worker->msgs[i].msg_hdr.msg_control = worker->controls[i];
+				worker->msgs[i].msg_hdr.msg_controllen = sizeof(worker->controls[i]);
+			}
+		}
+		
+		// Block until at least one datagram is there, then take everything that's queued. We hold
+		// no client table while sleeping so writers don't have to wait for us. With a frame timer
+		// we wait for both and only receive what's already there.
+		__atomic_store_n(&worker->active_epoch, 0, __ATOMIC_SEQ_CST);
+		int recv_flags = MSG_WAITFORONE;
+		struct pollfd pollfds[2] = {
+			(struct pollfd){ worker->fd, POLLIN },
+			(struct pollfd){ worker->timer_fd, POLLIN }
+		};
+		if (worker->timer_fd != -1){
+			if ( poll(pollfds, 2, WHEEL_TICK) == -1 ){
+				perror("poll");
+				continue;
+			}
+			recv_flags |= MSG_DONTWAIT;
+		}
+		
+		int msg_count = 0;
+		if (worker->timer_fd == -1 || (pollfds[0].revents & POLLIN))
+			msg_count = recvmmsg(worker->fd, worker->msgs, opts.recv_batch, recv_flags, NULL);
+		__atomic_store_n(&worker->active_epoch, __atomic_load_n(&client_table_epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+		struct timespec batch_time;
+		clock_gettime(CLOCK_MONOTONIC_COARSE, &batch_time);
+		worker->now = batch_time.tv_sec * 1000ULL + batch_time.tv_nsec / 1000000;
+		if (msg_count == -1){
+			if (errno != EAGAIN)
+				perror("recvmmsg");
+			msg_count = 0;
+		}
+		if (msg_count > 0)
+			batch_stats_add(&worker->recv_stats, msg_count);
+		
+		size_t bytes_in = 0;
+		for(int m = 0; m < msg_count; m++){
+			bytes_in += worker->msgs[m].msg_len;
+			if (worker->trace && !capture_datagram(worker->trace, &worker->msgs[m].msg_hdr, worker->msgs[m].msg_len))
+				worker->capture_failures++;
+			// Datagrams larger than PEER_PACKET_MAX are cut off, nothing we sent
+			if (worker->msgs[m].msg_hdr.msg_flags & MSG_TRUNC){
+				metrics_add(&worker->metrics->truncated, 1);
+				continue;
+			}
+			worker_handle_packet(worker, worker->packets[m], worker->msgs[m].msg_len, worker->packet_addrs[m]);
+		}
+		if (msg_count > 0){
+			metrics_add(&worker->metrics->packets_in, msg_count);
+			metrics_add(&worker->metrics->bytes_in, bytes_in);
+		}
+		if (opts.timeout > 0)
+			worker_expire_clients(worker);
+		if (worker->index == 0 && client_table_get()->peer_count > 0)
+			peers_tick(worker);
+		
+		if (worker->timer_fd != -1 && (pollfds[1].revents & POLLIN)){
+			// If we fell behind mix once per missed tick so the clients don't run dry
+			uint64_t expirations = 0;
+			if ( read(worker->timer_fd, &expirations, sizeof(expirations)) == sizeof(expirations) ){
+				for(uint64_t i = 0; i < expirations; i++)
+					mixer_tick(worker);
+			}
+		}
+		
+		if (opts.stats_interval > 0){
+			struct timespec now;
+			clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+			if ((size_t)(now.tv_sec - last_stats.tv_sec) >= opts.stats_interval){
+				flockfile(stdout);
+				printf("worker %zu:\n", worker->index);
+				batch_stats_print("  recvmmsg", &worker->recv_stats);
+				batch_stats_print("  sendmmsg", &worker->send_stats);
+				printf("  send failures: %lu, truncated datagrams: %lu, timed out clients: %lu\n",
+					(unsigned long)metrics_get(&worker->metrics->send_failures), (unsigned long)metrics_get(&worker->metrics->truncated),
+					(unsigned long)metrics_get(&worker->metrics->expired));
+				worker_print_rates(worker, (now.tv_sec - last_stats.tv_sec) + (now.tv_nsec - last_stats.tv_nsec) / 1e9);
+				printf("  silence: %zu forwarded, %zu keepalives absorbed\n", worker->silence_forwarded, worker->silence_absorbed);
+				if (worker->trace)
+					printf("  capture: %zu bytes written, %zu datagrams lost\n", maplog_size(worker->trace), worker->capture_failures);
+				if (worker->record_queue)
+					printf("  recording: %zu packets queued, %zu dropped because the writer fell behind\n",
+						worker->record_queue->queued, worker->record_queue->dropped);
+				if (opts.speakers > 0)
+					printf("  active speakers: %zu packets of other talkers dropped, %zu switches\n", worker->speaker_dropped, worker->speaker_switches);
+				if (client_table_get()->peer_count > 0)
+					printf("  links: %zu PEER packets sent, %zu received, %zu dropped by the loop checks\n",
+						worker->peer_sent, worker->peer_received, worker->peer_dropped);
+				fflush(stdout);
+				funlockfile(stdout);
+				last_stats = now;
+			}
+		}
+	}
+	
+	return NULL;
+}
+
+void stop_signal_handler(int signum){
+	stop_requested = 1;
+}
+
+
+int main(int argc, char **argv){
+	parse_options(argc, argv, &opts);
+	
+	if (opts.bench_mix > 0){
+		mixer_benchmark(opts.bench_mix);
+		return 0;
+	}
+	
+	worker_count = opts.workers;
+	workers = calloc(worker_count, sizeof(worker_t));
+	client_table_init();
+	metrics_init();
+	
+	// Identifies this server on the peer links, nothing else depends on it
+	while (node_id == 0){
+		if ( getrandom(&node_id, sizeof(node_id), 0) != sizeof(node_id) ){
+			perror("getrandom");
+			return -1;
+		}
+	}
+	peers_start();
+	
+	// Recordings and traces have to be finished and the metrics segment removed before we exit.
+	// SIGINT and SIGTERM are blocked in all threads and only taken by the main thread when it waits
+	// for them below.
+	sigset_t stop_signals, old_signals;
+	sigemptyset(&stop_signals);
+	sigaddset(&stop_signals, SIGINT);
+	sigaddset(&stop_signals, SIGTERM);
+	struct sigaction action = { .sa_handler = stop_signal_handler };
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+	pthread_sigmask(SIG_BLOCK, &stop_signals, &old_signals);
+	
+	if (opts.record_dir)
+		record_start(worker_count);
+	if (opts.capture_path)
+		capture_start(worker_count);
+	
+	for(size_t i = 0; i < worker_count; i++){
+		worker_p worker = &workers[i];
+		worker->index = i;
+		worker->timer_fd = -1;
+		worker->metrics = &metrics->workers[i];
+		wheel_init(&worker->wheel);
+		worker->record_queue = opts.record_dir ? &record_queues[i] : NULL;
+		worker->trace = opts.capture_path ? &capture_traces[i] : NULL;
+		
+		worker->fd = socket(AF_INET, SOCK_DGRAM, 0);
+		if (worker->fd == -1){
+			perror("socket");
+			return -1;
+		}
+		
+		int enable = 1;
+		if (setsockopt(worker->fd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) == -1){
+			perror("setsockopt(SO_REUSEPORT)");
+			return -1;
+		}
+		
+		// Wake up now and then without traffic so silent clients still time out, links say hello and
+		// we notice a stop request
+		struct timeval wakeup = { 0, WHEEL_TICK * 1000 };
+		if (setsockopt(worker->fd, SOL_SOCKET, SO_RCVTIMEO, &wakeup, sizeof(wakeup)) == -1){
+			perror("setsockopt(SO_RCVTIMEO)");
+			return -1;
+		}
+		
+		if (worker->trace && setsockopt(worker->fd, SOL_SOCKET, SO_TIMESTAMPNS, &enable, sizeof(enable)) == -1){
+			perror("setsockopt(SO_TIMESTAMPNS)");
+			return -1;
+		}
+		
+		struct sockaddr_in addr = (struct sockaddr_in){ AF_INET, htons(opts.port), .sin_addr = { INADDR_ANY } };
+		if (bind(worker->fd, (const struct sockaddr *)&addr, sizeof(addr)) == -1){
+			perror("bind");
+			return -1;
 		}
 	}
 	
-	close(server_fd);
+	
+	if (opts.mix){
+		mixer_init();
+		
+		workers[0].timer_fd = timerfd_create(CLOCK_MONOTONIC, 0);
+		if (workers[0].timer_fd == -1){
+			perror("timerfd_create");
+			return -1;
+		}
+		
+		long frame_ns = opts.mix_frame_duration * 100000L;
+		struct itimerspec interval = {
+			.it_interval = { frame_ns / 1000000000L, frame_ns % 1000000000L },
+			.it_value = { frame_ns / 1000000000L, frame_ns % 1000000000L }
+		};
+		if ( timerfd_settime(workers[0].timer_fd, 0, &interval, NULL) == -1 ){
+			perror("timerfd_settime");
+			return -1;
+		}
+		
+		printf("mixing %u Hz, %hhu channels, %.1f ms frames\n", opts.mix_rate, opts.mix_channels, opts.mix_frame_duration / 10.0);
+	}
+	
+	printf("starting server on port %hu with %zu workers, receiving up to %zu datagrams per call, node %08x\n",
+		opts.port, worker_count, opts.recv_batch, node_id);
+	fflush(stdout);
+	
+	for(size_t i = 0; i < worker_count; i++){
+		if ( pthread_create(&workers[i].thread, NULL, worker_thread, &workers[i]) != 0 ){
+			fprintf(stderr, "failed to create worker thread %zu\n", i);
+			return -1;
+		}
+	}
+	
+	while (!stop_requested)
+		sigsuspend(&old_signals);
+	
+	for(size_t i = 0; i < worker_count; i++){
+		pthread_join(workers[i].thread, NULL);
+		close(workers[i].fd);
+	}
+	
+	// The workers are gone, so the record queues and traces have no other writer left
+	__atomic_store_n(&workers_stopped, true, __ATOMIC_RELEASE);
+	if (opts.record_dir)
+		pthread_join(record_writer, NULL);
+	if (opts.capture_path)
+		capture_stop();
+	
+	free(workers);
 }
\ No newline at end of file
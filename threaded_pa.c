@@ -6,11 +6,17 @@
 #include <pulse/simple.h>
 #include <pulse/error.h>
 
+#include "ring.h"
+
 /*
 
 The core idea here is to avoid the complex Pulse Audio API. Looks like it can not be integrated
 into a poll system call anyway so why bother? We use two instances of the simple API to write to
-and read from pipes. These pipes in turn are then used with poll to see if data is available.
+and read from a shared memory ring. The eventfd of the ring can be used with poll to see if data is
+available, the frames itself never go through the kernel.
+
+Update: It can be integrated with a custom poll function for pa_mainloop. The client does that by
+default now (async backend), this prototype is what the client does with "-a threads".
 
 Pulse Audio is not really meant for this. The functions are thread save but the objects are not.
 Therefore each thread uses its own stuff and no Pulse Audio objects are shared.
@@ -23,7 +29,10 @@ static const pa_sample_spec ss = {
 	.channels = 2
 };
 
-int pipe_in, pipe_out;
+#define FRAME_SIZE  (4800 * 2 * 2)
+#define RING_FRAMES  4
+
+ring_t ring;
 
 
 void* recording_thread(void *data){
@@ -38,23 +47,16 @@ void* recording_thread(void *data){
 	}
 	
 	
-	uint8_t buf[4800 * 2 * 2];
-	size_t buf_size = sizeof(buf);
+	uint8_t scratch[FRAME_SIZE];
 	while (true) {
-		if (pa_simple_read(pa, buf, buf_size, &error) < 0) {
+		uint8_t *frame = ring_write_frame(&ring);
+		if (pa_simple_read(pa, frame ? frame : scratch, FRAME_SIZE, &error) < 0) {
 			fprintf(stderr, __FILE__": pa_simple_read() failed: %s\n", pa_strerror(error));
 			goto finish;
 		}
 		
-		size_t bytes_written = 0;
-		while(bytes_written < buf_size){
-			ssize_t written = write(pipe_in, buf + bytes_written, buf_size - bytes_written);
-			if (written < 0){
-				perror("write failed");
-				break;
-			}
-			bytes_written += written;
-		}
+		if (frame)
+			ring_write_commit(&ring);
 	}
 	
 	finish:
@@ -76,18 +78,11 @@ void* playback_thread(void *data){
 	}
 	
 	
-	uint8_t buf[4800 * 2 * 2];
-	size_t buf_size = sizeof(buf);
 	while (true) {
-		ssize_t bytes_read = read(pipe_out, buf, buf_size);
-		if (bytes_read == 0)
-			break;
-		if (bytes_read < 0){
-			perror("read failed");
-			break;
-		}
-		
-		if (pa_simple_write(pa, buf, bytes_read, &error) < 0) {
+		ring_wait(&ring);
+		int result = pa_simple_write(pa, ring_read_frame(&ring), FRAME_SIZE, &error);
+		ring_read_release(&ring);
+		if (result < 0) {
 			fprintf(stderr, __FILE__": pa_simple_write() failed: %s\n", pa_strerror(error));
 			goto finish;
 		}
@@ -101,13 +96,10 @@ void* playback_thread(void *data){
 }
 
 int main(int argc, char **argv){
-	int fds[2];
-	if (pipe(fds) == -1){
-		perror("pipe failed");
+	if ( !ring_init(&ring, FRAME_SIZE, RING_FRAMES) ){
+		perror("ring_init failed");
 		return 1;
 	}
-	pipe_out = fds[0];
-	pipe_in = fds[1];
 	
 	
 	pthread_t ta, tb;
@@ -0,0 +1,54 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+
+Traffic traces of the server (--capture) for the replay tool. Every worker writes its own file,
+path.0, path.1, ..., with a trace_file_t header followed by one record per received datagram. A
+record is a trace_record_t with the parsed header fields (see proto.h) followed by the whole
+datagram, padded to 8 bytes so the next record is aligned. Readers map the file and walk it, a file
+of a server that was killed may end with zeros (a record with time 0 ends the trace).
+
+Times are CLOCK_REALTIME nanoseconds taken by the kernel when the datagram arrived, so the files of
+all workers can be merged by time.
+
+*/
+
+#define TRACE_MAGIC  0x31727476  // "vtr1"
+#define TRACE_VERSION  1
+// Type of datagrams that had no valid header
+#define TRACE_TYPE_INVALID  0xff
+
+typedef struct {
+	uint32_t magic, version;
+	uint16_t port, worker;
+	uint32_t reserved;
+	uint64_t started_at;  // CLOCK_REALTIME ns
+} trace_file_t, *trace_file_p;
+
+typedef struct {
+	uint64_t time;  // CLOCK_REALTIME ns
+	uint32_t addr;  // source IPv4 address in network byte order
+	uint16_t port;  // in network byte order
+	uint16_t len;   // of the datagram that follows
+	uint8_t type, user;
+	uint16_t seq;
+	uint8_t level;
+	uint8_t reserved[3];
+} trace_record_t, *trace_record_p;
+
+static inline size_t trace_record_size(size_t len){
+	return (sizeof(trace_record_t) + len + 7) & ~(size_t)7;
+}
+
+// Returns the record at offset of a mapped trace or NULL at the end of it
+static inline const trace_record_t* trace_record_at(const uint8_t *trace, size_t size, size_t offset){
+	if (offset + sizeof(trace_record_t) > size)
+		return NULL;
+	const trace_record_t *record = (const trace_record_t*)(trace + offset);
+	if (record->time == 0 || offset + trace_record_size(record->len) > size)
+		return NULL;
+	return record;
+}
\ No newline at end of file